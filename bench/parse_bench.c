@@ -0,0 +1,64 @@
+// Parse-only throughput of parse_command().
+// The shell source is included with its main() renamed, so the real parser
+// is measured without running anything.
+//
+// usage: parse_bench [lines] [args-per-command]
+// Prints one JSON object.
+
+#define main shellish_main
+#include "../shellish-skeleton.c"
+#undef main
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+  long lines = argc > 1 ? atol(argv[1]) : 200000;
+  int nargs = argc > 2 ? atoi(argv[2]) : 8;
+  if (lines <= 0 || nargs < 0) {
+    fprintf(stderr, "usage: %s [lines] [args-per-command]\n", argv[0]);
+    return 1;
+  }
+
+  // a typical generated line: cmd with arguments, a pipe and a redirect
+  size_t cap = 64 + (size_t)nargs * 16;
+  char *line = malloc(cap), *work = malloc(cap);
+  int len = snprintf(line, cap, "grep");
+  for (int i = 0; i < nargs; i++)
+    len += snprintf(line + len, cap - (size_t)len, " arg%d", i);
+  len += snprintf(line + len, cap - (size_t)len, " | cut -f1,3 >out.txt");
+
+  long long *lat = malloc(sizeof(long long) * (size_t)lines);
+  long long total = 0;
+  for (long i = 0; i < lines; i++) {
+    memcpy(work, line, (size_t)len + 1);
+    long long t0 = now_ns();
+    struct node *tree;
+    parse_command(work, &tree);
+    free_command(tree);
+    lat[i] = now_ns() - t0;
+    total += lat[i];
+  }
+  qsort(lat, (size_t)lines, sizeof(long long), cmp_ll);
+
+  double sec = (double)total / 1e9;
+  double bytes = (double)lines * (len + 1);
+  printf("{\"workload\":\"parse-%dargs\",\"shell\":\"shell-ish\",\"runs\":1,"
+         "\"commands\":%ld,\"bytes\":%.0f,\"seconds\":%.6f,"
+         "\"p50_ms\":%.6f,\"p90_ms\":%.6f,\"p99_ms\":%.6f,"
+         "\"commands_per_sec\":%.1f,\"mb_per_sec\":%.2f}\n",
+         nargs, lines, bytes, sec, lat[lines / 2] / 1e6, lat[lines * 9 / 10] / 1e6,
+         lat[lines * 99 / 100] / 1e6, lines / sec, bytes / sec / 1e6);
+  free(lat);
+  free(line);
+  free(work);
+  return 0;
+}
@@ -0,0 +1,180 @@
+#!/bin/sh
+# Runs the same workloads through Shell-ish and a reference shell (both in
+# script mode), prints a table and writes the results as JSON. Each workload
+# is first run once untimed under both shells: Shell-ish must exit with the
+# same status and print the same output (cksum) as the reference shell, and
+# every timed run must exit with that status too. Records of a shell that
+# doesn't get "matches_ref": false and the script exits with status 1.
+#
+# usage: bench/run.sh            (or: make -C bench run)
+#
+# settings (environment):
+#   SHELLISH   shell-ish binary            (default: bench/_build/shell-ish)
+#   REF_SH     reference shell             (default: /bin/sh)
+#   RUNS       repetitions per workload    (default: 5)
+#   N          commands in spawn/redirect  (default: 2000)
+#   CUT_SIZES  TSV sizes for cut, 1M..4G   (default: "1M 16M 256M")
+#   PARSE_N    lines for the parser bench  (default: 200000)
+#   OUT        JSON output                 (default: bench/results.json)
+#
+# Generated TSV files are kept in bench/_data so bigger sizes are only
+# written once.
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+SHELLISH=${SHELLISH:-$here/_build/shell-ish}
+REF_SH=${REF_SH:-/bin/sh}
+RUNS=${RUNS:-5}
+N=${N:-2000}
+CUT_SIZES=${CUT_SIZES:-1M 16M 256M}
+PARSE_N=${PARSE_N:-200000}
+OUT=${OUT:-$here/results.json}
+
+if [ ! -x "$SHELLISH" ] || [ ! -x "$here/_build/parse_bench" ]; then
+  make -C "$here" all >/dev/null
+fi
+
+data=$here/_data
+mkdir -p "$data"
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+records=$tmp/records
+mismatches=0
+
+to_bytes() {
+  case $1 in
+    *K) echo $((${1%K} * 1024)) ;;
+    *M) echo $((${1%M} * 1024 * 1024)) ;;
+    *G) echo $((${1%G} * 1024 * 1024 * 1024)) ;;
+    *) echo "$1" ;;
+  esac
+}
+
+# gen_tsv SIZE -> path of a TSV file of about SIZE bytes
+gen_tsv() {
+  f=$data/data-$1.tsv
+  if [ ! -f "$f" ]; then
+    awk -v size="$(to_bytes "$1")" 'BEGIN {
+      while (n < size) {
+        line = i "\tuser" i % 9973 "\t" i * 7 % 100003 "\thost-" i % 61 "\t/some/path/" i % 509
+        print line
+        n += length(line) + 1
+        i++
+      }
+    }' >"$f.part"
+    mv "$f.part" "$f"
+  fi
+  echo "$f"
+}
+
+# check_run SHELL SCRIPT -> "status checksum size" of one untimed run
+check_run() {
+  sum=$({ st=0; "$1" "$2" 2>"$tmp/err" || st=$?; echo $st >"$tmp/status"; } | cksum)
+  echo "$(cat "$tmp/status") $sum"
+}
+
+# mismatch NAME SHELL WHAT: report a result that differs from the reference
+mismatch() {
+  echo "run.sh: $1: $(basename "$2"): $3" >&2
+  head -n 5 "$tmp/err" | sed 's/^/  /' >&2
+  ok=false
+  mismatches=$((mismatches + 1))
+}
+
+# run_case NAME SCRIPT COMMANDS BYTES
+# runs SCRIPT RUNS times under each shell and records wall-clock percentiles
+run_case() {
+  ref=$(check_run "$REF_SH" "$2")
+  ref_status=${ref%% *}
+  for sh in "$SHELLISH" "$REF_SH"; do
+    ok=true
+    if [ "$sh" != "$REF_SH" ]; then
+      got=$(check_run "$sh" "$2")
+      if [ "${got%% *}" != "$ref_status" ]; then
+        mismatch "$1" "$sh" "exit status ${got%% *}, $(basename "$REF_SH") gives $ref_status"
+      elif [ "$got" != "$ref" ]; then
+        mismatch "$1" "$sh" "output differs from $(basename "$REF_SH") (cksum)"
+      fi
+    fi
+    i=0
+    : >"$tmp/times"
+    while [ $i -lt "$RUNS" ]; do
+      start=$(date +%s%N)
+      status=0
+      "$sh" "$2" >/dev/null 2>"$tmp/err" || status=$?
+      end=$(date +%s%N)
+      if [ "$status" != "$ref_status" ] && $ok; then
+        mismatch "$1" "$sh" "timed run exited with status $status, expected $ref_status"
+      fi
+      echo $((end - start)) >>"$tmp/times"
+      i=$((i + 1))
+    done
+    sort -n "$tmp/times" | awk -v name="$1" -v shell="$(basename "$sh")" \
+        -v cmds="$3" -v bytes="$4" -v ok="$ok" -v out="$records" '
+      { t[NR] = $1 / 1e6 }
+      function pct(p,   k) { k = int(p / 100 * NR + 0.999999); if (k < 1) k = 1; return t[k] }
+      END {
+        p50 = pct(50); secs = p50 / 1000
+        cps = secs > 0 ? cmds / secs : 0
+        mbs = secs > 0 ? bytes / secs / 1e6 : 0
+        printf "%-16s %-10s %10.2f %10.2f %10.2f %12.1f %10.2f\n", name, shell, p50, pct(90), pct(99), cps, mbs
+        printf "{\"workload\":\"%s\",\"shell\":\"%s\",\"runs\":%d,\"commands\":%d,\"bytes\":%.0f,\"seconds\":%.6f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"commands_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"matches_ref\":%s}\n", name, shell, NR, cmds, bytes, secs, p50, pct(90), pct(99), cps, mbs, ok >>out
+      }'
+  done
+}
+
+printf "%-16s %-10s %10s %10s %10s %12s %10s\n" workload shell p50_ms p90_ms p99_ms cmds/sec MB/s
+
+# trivial commands: "true" through PATH (a builtin in most shells) and
+# /bin/true, which every shell has to spawn
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) print "true" }' >"$tmp/spawn.sh"
+run_case true "$tmp/spawn.sh" "$N" 0
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) print "/bin/true" }' >"$tmp/spawn-abs.sh"
+run_case spawn "$tmp/spawn-abs.sh" "$N" 0
+
+# pipelines of 2, 8 and 32 stages over a 4 MiB file, 20 times each
+pipe_data=$(gen_tsv 4M)
+pipe_bytes=$(($(wc -c <"$pipe_data") * 20))
+for k in 2 8 32; do
+  awk -v k="$k" -v f="$pipe_data" 'BEGIN {
+    line = "cat " f
+    for (s = 2; s < k; s++) line = line " | cat"
+    line = line " | wc -c"
+    for (i = 0; i < 20; i++) print line
+  }' >"$tmp/pipe$k.sh"
+  run_case "pipe-$k" "$tmp/pipe$k.sh" $((k * 20)) "$pipe_bytes"
+done
+
+# cut over generated TSV
+for size in $CUT_SIZES; do
+  f=$(gen_tsv "$size")
+  echo "cut -f1,3,5 <$f" >"$tmp/cut.sh"
+  run_case "cut-$size" "$tmp/cut.sh" 1 "$(wc -c <"$f")"
+done
+
+# redirection-heavy loop
+awk -v n="$N" -v d="$tmp" 'BEGIN {
+  for (i = 0; i < n / 2; i++) {
+    print "echo line " i " >" d "/r1.txt"
+    print "cat <" d "/r1.txt >>" d "/r2.txt"
+  }
+}' >"$tmp/redirect.sh"
+run_case redirect "$tmp/redirect.sh" "$N" 0
+
+# parser only, short and very long argument lists
+for args in 8 2000; do
+  lines=$PARSE_N
+  [ "$args" -gt 100 ] && lines=$((PARSE_N / 200))
+  "$here/_build/parse_bench" "$lines" "$args" >>"$records"
+  tail -n 1 "$records" | awk -F'[:,]' '{
+    for (i = 1; i < NF; i += 2) { gsub(/[{}"]/, "", $i); gsub(/[{}"]/, "", $(i + 1)); v[$i] = $(i + 1) }
+    printf "%-16s %-10s %10.4f %10.4f %10.4f %12.1f %10.2f\n", v["workload"], v["shell"], v["p50_ms"], v["p90_ms"], v["p99_ms"], v["commands_per_sec"], v["mb_per_sec"]
+  }'
+done
+
+{ echo "["; sed '$!s/$/,/' "$records"; echo "]"; } >"$OUT"
+echo "results written to $OUT"
+if [ "$mismatches" -gt 0 ]; then
+  echo "run.sh: $mismatches result(s) differ from $(basename "$REF_SH"), see above" >&2
+  exit 1
+fi
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Microbenchmark: how many `true` commands per second a shell can launch.
+#
+# usage: bench/spawn_true.sh [-n count] shell-binary...
+#
+# To compare before/after a change, build both versions and pass both:
+#   git show HEAD~1:shellish-skeleton.c > /tmp/old.c
+#   gcc -O2 -o /tmp/shell-ish-old /tmp/old.c
+#   gcc -O2 -o shell-ish shellish-skeleton.c
+#   bench/spawn_true.sh -n 5000 /tmp/shell-ish-old ./shell-ish
+
+count=2000
+if [ "$1" = "-n" ]; then
+  count=$2
+  shift 2
+fi
+
+if [ $# -eq 0 ]; then
+  echo "usage: $0 [-n count] shell-binary..." >&2
+  exit 1
+fi
+
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+
+# one command per line, the shell reads them from stdin
+i=0
+while [ $i -lt "$count" ]; do
+  echo true
+  i=$((i + 1))
+done >"$input"
+echo exit >>"$input"
+
+for sh in "$@"; do
+  start=$(date +%s.%N)
+  "$sh" <"$input" >/dev/null 2>&1
+  end=$(date +%s.%N)
+  echo "$start $end $count $sh" | awk '{
+    t = $2 - $1
+    printf "%-30s %6d commands in %7.3f s  %9.1f commands/sec\n", $4, $3, t, $3 / t
+  }'
+done
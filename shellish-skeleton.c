@@ -1,6 +1,8 @@
+#define _GNU_SOURCE // pipe2, strndup
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
@@ -11,6 +13,28 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <sys/ioctl.h> // TIOCGWINSZ
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <pwd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h> // SSE2/AVX2 intrinsics for cut
+#define CUT_SIMD_X86
+#endif
+
+extern char **environ;
 
 const char *sysname = "shellish";
 
@@ -20,6 +44,8 @@ enum return_codes {
   UNKNOWN = 2,
 };
 
+struct node; // a parsed command line, see parse_command()
+
 struct command_t {
   char *name;
   bool background;
@@ -27,6 +53,8 @@ struct command_t {
   int arg_count;
   char **args;
   char *redirects[3];     // redirects[0] = input (<), redirects[1] = output (>), redirects[2] = append (>>)
+  char **assigns;         // NAME=value words before the command, only for its environment
+  struct node *body;      // ( list ) or a compound command run by a forked child
   struct command_t *next; // next command in pipe chain (cmd1 | cmd2 | cmd3)
 };
 
@@ -52,921 +80,7544 @@ void print_command(struct command_t *command) {
   }
 }
 
+// per-line arena: parse_command() builds the whole command tree in here and
+// free_command() releases it with a single reset. Blocks never move, so
+// pointers stay valid until the reset; the newest (biggest) block is kept.
+struct arena_block {
+  struct arena_block *next;
+  size_t cap, used;
+  char data[];
+};
+
+struct arena {
+  struct arena_block *head;
+};
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+static struct arena line_arena;
+
+static void *arena_alloc(struct arena *a, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  struct arena_block *b = a->head;
+  if (b == NULL || b->cap - b->used < size) {
+    size_t cap = b ? b->cap * 2 : ARENA_BLOCK_SIZE;
+    if (cap < size)
+      cap = size;
+    b = malloc(sizeof(struct arena_block) + cap);
+    if (b == NULL) {
+      fprintf(stderr, "-%s: out of memory\n", sysname);
+      exit(1);
+    }
+    b->cap = cap;
+    b->used = 0;
+    b->next = a->head;
+    a->head = b;
+  }
+  void *p = b->data + b->used;
+  b->used += size;
+  return p;
+}
+
+static void arena_reset(struct arena *a) {
+  struct arena_block *b = a->head;
+  if (b == NULL)
+    return;
+  while (b->next != NULL) {
+    struct arena_block *old = b->next;
+    b->next = old->next;
+    free(old);
+  }
+  b->used = 0;
+}
+
+// position in an arena: arena_release() frees everything allocated after it
+// (e.g. the expanded words of one loop iteration)
+struct arena_mark {
+  struct arena_block *block;
+  size_t used;
+};
+
+static struct arena_mark arena_save(struct arena *a) {
+  struct arena_mark m = {a->head, a->head ? a->head->used : 0};
+  return m;
+}
+
+static void arena_release(struct arena *a, struct arena_mark m) {
+  while (a->head != m.block) {
+    struct arena_block *old = a->head;
+    a->head = old->next;
+    free(old);
+  }
+  if (a->head != NULL)
+    a->head->used = m.used;
+}
+
 /**
  * Release allocated memory of a command
- * @param  command [description]
- * @return         [description]
+ * @param  tree [description]
+ * @return      [description]
  */
-int free_command(struct command_t *command) {
-  // free argument strings
-  if (command->arg_count) {
-    for (int i = 0; i < command->arg_count; ++i)
-      free(command->args[i]);
-    free(command->args);
-  }
-  // free redirection file names if they exist
-  for (int i = 0; i < 3; ++i)
-    if (command->redirects[i])
-      free(command->redirects[i]);
-
-  // if there is a piped command, free it recursively
-  if (command->next) {
-    free_command(command->next);
-    command->next = NULL;
-  }
-
-  free(command->name);
-  free(command);
+int free_command(struct node *tree) {
+  // the whole tree (strings, argv arrays, piped commands) lives in the
+  // line arena, so one reset frees all of it
+  (void)tree;
+  arena_reset(&line_arena);
   return 0;
 }
 
+// the prompt as a string, from $PS1 (see the prompt section); *width is
+// the width of its last line on the screen
+static int prompt_text(char *out, size_t size, int *width);
+
+// the prompt's background worker (git branch) writes a byte here when the
+// prompt should be drawn again; read_key() then returns KEY_REDRAW
+static int prompt_wake[2] = {-1, -1};
+
 /**
  * Show the command prompt
  * @return [description]
  */
 int show_prompt() {
-  char cwd[1024], hostname[1024];
-  gethostname(hostname, sizeof(hostname));
-  getcwd(cwd, sizeof(cwd));
+  char p[4096];
+  prompt_text(p, sizeof(p), NULL);
   // basic shell prompt with user@host:cwd
-  printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+  printf("%s", p);
   return 0;
 }
 
-/**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
- */
-int parse_command(char *buf, struct command_t *command) {
-  const char *splitters = " \t"; // split at whitespace
-  int index, len;
-  len = strlen(buf);
-
-  // remove leading spaces/tabs
-  while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-  {
-    buf++;
-    len--;
+// Keyboard input is read in chunks. Bytes after Enter (the rest of a pasted
+// block) stay here for the next prompt.
+static struct {
+  unsigned char buf[4096];
+  int pos, len;
+} term_in;
+
+static int term_getc(void) {
+  if (term_in.pos == term_in.len) {
+    ssize_t n;
+    do
+      n = read(STDIN_FILENO, term_in.buf, sizeof(term_in.buf));
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+      return EOF;
+    term_in.pos = 0;
+    term_in.len = n;
   }
-  // remove trailing spaces/tabs
-  while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-    buf[--len] = 0; // trim right whitespace
+  return term_in.buf[term_in.pos++];
+}
 
-  // user can press TAB for autocomplete (we mark it with '?')
-  if (len > 0 && buf[len - 1] == '?') // auto-complete
-    command->auto_complete = true;
-
-  // '&' means run in background
-  if (len > 0 && buf[len - 1] == '&') // background
-    command->background = true;
-
-  // first token is the command name
-  char *pch = strtok(buf, splitters);
-  if (pch == NULL) {
-    command->name = (char *)malloc(1);
-    command->name[0] = 0;
-  } else {
-    command->name = (char *)malloc(strlen(pch) + 1);
-    strcpy(command->name, pch);
+static bool term_pending(void) { return term_in.pos < term_in.len; }
+
+static void term_write(const char *s, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(STDOUT_FILENO, s, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    s += n;
+    len -= n;
   }
+}
 
-  // start args array (will grow with realloc)
-  command->args = (char **)malloc(sizeof(char *));
+// keys that are not a single byte
+enum {
+  KEY_UP = 1000,
+  KEY_DOWN,
+  KEY_RIGHT,
+  KEY_LEFT,
+  KEY_HOME,
+  KEY_END,
+  KEY_DELETE,
+  KEY_WORD_LEFT,  // Ctrl-Left, Alt-B
+  KEY_WORD_RIGHT, // Ctrl-Right, Alt-F
+  KEY_WORD_DELETE,      // Alt-D
+  KEY_WORD_BACKSPACE,   // Alt-Backspace
+  KEY_REDRAW,           // not a key: the prompt changed (prompt_wake)
+  KEY_UNKNOWN,
+};
 
-  int redirect_index;
-  int arg_index = 0;
-  char temp_buf[1024], *arg;
+// Read one key, decoding escape sequences (ESC [ params final, ESC O x,
+// ESC x) with a small state machine. Returns a byte, a KEY_ code or EOF.
+static int read_key(void) {
+  enum { ST_GROUND, ST_ESC, ST_CSI, ST_SS3 } state = ST_GROUND;
+  int params[2] = {0, 0}, nparams = 0;
 
   while (1) {
-    // tokenize remaining parts
-    pch = strtok(NULL, splitters);
-    if (!pch)
-      break;
-
-    arg = temp_buf;
-    strcpy(arg, pch);
-    len = strlen(arg);
-
-    if (len == 0)
-      continue; // empty arg, go for next
-
-    // trim left whitespace
-    while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-    {
-      arg++;
-      len--;
+    if (state == ST_GROUND && !term_pending() && prompt_wake[0] != -1) {
+      // wait for a key or for the prompt worker
+      struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {prompt_wake[0], POLLIN, 0}};
+      while (poll(pfd, 2, -1) < 0 && errno == EINTR) {}
+      if (pfd[1].revents & POLLIN) {
+        char drain[64];
+        while (read(prompt_wake[0], drain, sizeof(drain)) > 0) {}
+        return KEY_REDRAW;
+      }
     }
-    // trim right whitespace
-    while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-      arg[--len] = 0; // trim right whitespace
-
-    if (len == 0)
-      continue; // empty arg, go for next
-
-    // '|' means pipe: create next command and parse the rest recursively
-    if (strcmp(arg, "|") == 0) {
-      struct command_t *c =
-          (struct command_t *)malloc(sizeof(struct command_t));
-      int l = strlen(pch);
-      pch[l] = splitters[0]; // restore strtok termination
-      index = 1;
-      while (pch[index] == ' ' || pch[index] == '\t')
-        index++; // skip whitespaces
-
-      parse_command(pch + index, c);
-      pch[l] = 0; // put back strtok termination
-      command->next = c;
-      continue;
-    }
-
-    // '&' is already handled (background flag)
-    if (strcmp(arg, "&") == 0)
-      continue; // handled before
-
-    // redirection parsing:
-    // <file  -> redirects[0]
-    // >file  -> redirects[1]
-    // >>file -> redirects[2]
-    redirect_index = -1;
-    if (arg[0] == '<')
-      redirect_index = 0;
-    if (arg[0] == '>') {
-      if (len > 1 && arg[1] == '>') {
-        redirect_index = 2;
-        arg++;
-        len--;
-      } else
-        redirect_index = 1;
-    }
-    if (redirect_index != -1) {
-      // IMPORTANT: our parser expects no space like >out.txt or <in.txt
-      command->redirects[redirect_index] = (char *)malloc(len);
-      strcpy(command->redirects[redirect_index], arg + 1);
-      continue;
-    }
-
-    // normal arguments (also support quoted strings)
-    if (len > 2 &&
-        ((arg[0] == '"' && arg[len - 1] == '"') ||
-         (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-    {
-      arg[--len] = 0;
-      arg++;
+    int c = term_getc();
+    if (c == EOF)
+      return EOF;
+    switch (state) {
+    case ST_GROUND:
+      if (c != 27)
+        return c;
+      state = ST_ESC;
+      break;
+    case ST_ESC:
+      if (c == '[') {
+        state = ST_CSI;
+        break;
+      }
+      if (c == 'O') {
+        state = ST_SS3;
+        break;
+      }
+      if (c == 'b' || c == 'B')
+        return KEY_WORD_LEFT;
+      if (c == 'f' || c == 'F')
+        return KEY_WORD_RIGHT;
+      if (c == 'd' || c == 'D')
+        return KEY_WORD_DELETE;
+      if (c == 127 || c == 8)
+        return KEY_WORD_BACKSPACE;
+      return KEY_UNKNOWN;
+    case ST_CSI:
+      if (c >= '0' && c <= '9') {
+        if (nparams == 0)
+          nparams = 1;
+        params[nparams - 1] = params[nparams - 1] * 10 + (c - '0');
+        break;
+      }
+      if (c == ';') {
+        if (nparams == 0)
+          nparams = 1;
+        if (nparams < 2)
+          nparams++;
+        break;
+      }
+      if (c < 0x40 || c > 0x7e)
+        break; // intermediate bytes: keep going until the final byte
+      bool ctrl = nparams == 2 && params[1] == 5;
+      switch (c) {
+      case 'A': return KEY_UP;
+      case 'B': return KEY_DOWN;
+      case 'C': return ctrl ? KEY_WORD_RIGHT : KEY_RIGHT;
+      case 'D': return ctrl ? KEY_WORD_LEFT : KEY_LEFT;
+      case 'H': return KEY_HOME;
+      case 'F': return KEY_END;
+      case '~':
+        switch (params[0]) {
+        case 1: case 7: return KEY_HOME;
+        case 4: case 8: return KEY_END;
+        case 3: return KEY_DELETE;
+        }
+      }
+      return KEY_UNKNOWN;
+    case ST_SS3:
+      switch (c) {
+      case 'A': return KEY_UP;
+      case 'B': return KEY_DOWN;
+      case 'C': return KEY_RIGHT;
+      case 'D': return KEY_LEFT;
+      case 'H': return KEY_HOME;
+      case 'F': return KEY_END;
+      }
+      return KEY_UNKNOWN;
     }
-
-    // add arg to args array
-    command->args =
-        (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-    command->args[arg_index] = (char *)malloc(len + 1);
-    strcpy(command->args[arg_index++], arg);
   }
-  command->arg_count = arg_index;
+}
 
-  // we need argv format for execv: argv[0]=name ... argv[last]=NULL
-  command->args = (char **)realloc(command->args,
-                                   sizeof(char *) * (command->arg_count += 2));
+static bool parse_is_space(char c) { return c == ' ' || c == '\t' || c == '\n'; }
 
-  // shift everything forward by 1 so we can insert argv[0]
-  for (int i = command->arg_count - 2; i > 0; --i)
-    command->args[i] = command->args[i - 1];
+static bool parse_is_operator(char c) {
+  return c == '|' || c == '&' || c == '<' || c == '>' || c == ';' || c == '(' ||
+         c == ')' || c == '\n';
+}
 
-  // set args[0] as the command name
-  command->args[0] = strdup(command->name);
+static char parse_empty[1];
 
-  // last arg must be NULL for execv
-  command->args[command->arg_count - 1] = NULL;
+// A '$' that is not quoted with '...' or escaped is stored as one of these
+// bytes in the parsed words; expand_command() replaces it just before
+// running. The result of a "$x" is not split into fields or globbed.
+#define EXPAND_MARK '\001'
+#define EXPAND_MARK_QUOTED '\002'
+// put before a quoted or escaped * ? [ ~ (or a marker byte) so that the
+// expansion keeps it literal
+#define QUOTE_ESC '\003'
 
-  return 0;
+static bool parse_is_special(char c) {
+  return c == '*' || c == '?' || c == '[' || c == '~' ||
+         c == EXPAND_MARK || c == EXPAND_MARK_QUOTED || c == QUOTE_ESC;
 }
 
-void prompt_backspace() {
-  putchar(8);   // move cursor back
-  putchar(' '); // erase char
-  putchar(8);   // move cursor back again
+// terminate the argv slice of one command; an empty command gets name ""
+static void parse_finish(struct command_t *c, char **argv, int argc) {
+  if (argc == 0)
+    argv[argc++] = parse_empty;
+  argv[argc] = NULL;
+  c->name = argv[0];
+  c->args = argv;
+  c->arg_count = argc + 1; // like before: argv[0] ... NULL
 }
 
-/**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
- */
-int prompt(struct command_t *command) {
-  int index = 0;
-  char c;
-  char buf[4096];
-  static char oldbuf[4096];
+// A command line is parsed into a tree of these. Pipe chains are the
+// command_t chains of the skeleton; the tree only adds the control flow
+// around them. Loops run the same tree again and again: words are expanded
+// on a copy of each chain, so the tree itself never changes.
+enum node_type {
+  NODE_CMD,   // pipe chain
+  NODE_AND,   // left && right
+  NODE_OR,    // left || right
+  NODE_GROUP, // { left; }
+  NODE_IF,    // if left; then right; else orelse; fi
+  NODE_WHILE, // while left; do right; done
+  NODE_UNTIL, // until left; do right; done
+  NODE_FOR,   // for var in words; do right; done
+};
+
+struct node {
+  enum node_type type;
+  bool negate;              // ! chain
+  struct command_t *cmd;    // NODE_CMD
+  struct node *left, *right;
+  struct node *orelse;      // NODE_IF: else part (an elif is a NODE_IF)
+  char *var;                // NODE_FOR
+  char **words;             // NODE_FOR: NULL terminated; NULL without `in`
+  struct node *next;        // next command of a list (a; b & c)
+};
 
-  // we use termios to read char-by-char (no canonical mode)
-  static struct termios backup_termios, new_termios;
-  tcgetattr(STDIN_FILENO, &backup_termios);
-  new_termios = backup_termios;
+#define PARSE_INCOMPLETE -2
 
-  // disable ICANON (line buffering) and ECHO (we echo manually)
-  new_termios.c_lflag &=
-      ~(ICANON |
-        ECHO); // Also disable automatic echo. We manually echo each char.
-  tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+struct parser {
+  const char *p;      // next byte of the line
+  char *out;          // words are copied here
+  char **slots;       // argv slices of all commands
+  const char *error;  // first syntax error
+  bool incomplete;    // the line ended inside a construct: needs more lines
+};
+
+static void *parse_fail(struct parser *ps, const char *msg) {
+  if (ps->error == NULL) {
+    ps->error = msg;
+    ps->incomplete = *ps->p == '\0';
+  }
+  return NULL;
+}
 
-  show_prompt();
-  buf[0] = 0;
+static void *parse_unexpected(struct parser *ps) {
+  static char msg[64];
+  if (*ps->p == '\0')
+    return parse_fail(ps, "unexpected end of input");
+  size_t n = 1;
+  while (ps->p[n] != '\0' && !parse_is_space(ps->p[n]) && !parse_is_operator(ps->p[n]) && n < 20)
+    n++;
+  if (*ps->p == '\n')
+    snprintf(msg, sizeof(msg), "unexpected newline");
+  else
+    snprintf(msg, sizeof(msg), "unexpected `%.*s'", (int)n, ps->p);
+  return parse_fail(ps, msg);
+}
 
+// skip spaces, tabs and a comment (and newlines too with newlines = true)
+static void parse_skip(struct parser *ps, bool newlines) {
   while (1) {
-    c = getchar();
+    while (*ps->p == ' ' || *ps->p == '\t' || (newlines && *ps->p == '\n'))
+      ps->p++;
+    if (*ps->p != '#')
+      return;
+    while (*ps->p != '\0' && *ps->p != '\n')
+      ps->p++;
+  }
+}
 
-    if (c == 9) // TAB key
-    {
-      buf[index++] = '?'; // mark autocomplete request
-      break;
-    }
+// is the next word the reserved word kw (unquoted, alone)?
+static bool parse_at_keyword(struct parser *ps, const char *kw) {
+  size_t n = strlen(kw);
+  return strncmp(ps->p, kw, n) == 0 &&
+         (ps->p[n] == '\0' || parse_is_space(ps->p[n]) || parse_is_operator(ps->p[n]));
+}
 
-    if (c == 127) // backspace key
-    {
-      if (index > 0) {
-        prompt_backspace();
-        index--;
-      }
-      continue;
-    }
+// a reserved word that ends a list
+static bool parse_at_list_end(struct parser *ps) {
+  static const char *const ends[] = {"then", "else", "elif", "fi", "do", "done", "}"};
+  if (*ps->p == '\0' || *ps->p == ')')
+    return true;
+  for (size_t i = 0; i < sizeof(ends) / sizeof(ends[0]); i++)
+    if (parse_at_keyword(ps, ends[i]))
+      return true;
+  return false;
+}
 
-    // ignore some escape sequence bytes for arrows
-    if (c == 27 || c == 91 || c == 66 || c == 67 || c == 68) {
-      continue;
-    }
+static bool parse_keyword(struct parser *ps, const char *kw) {
+  parse_skip(ps, true);
+  if (!parse_at_keyword(ps, kw)) {
+    if (*ps->p == '\0')
+      parse_fail(ps, "unexpected end of input");
+    else
+      parse_unexpected(ps);
+    return false;
+  }
+  ps->p += strlen(kw);
+  return true;
+}
 
-    if (c == 65) // up arrow: show previous command
-    {
-      while (index > 0) {
-        prompt_backspace();
-        index--;
-      }
+static size_t param_len(const char *s); // in the expansion section
+
+// After a '$' marker: copy the parameter name ("?", "*", "x", "{#x",
+// "{PIPESTATUS[@]") as it is, so quoting adds no QUOTE_ESC bytes the
+// expander would not recognize. Returns p after it.
+static const char *parse_param_name(const char *p, char **out) {
+  const char *start = p;
+  if (*p == '{' && *++p == '#')
+    p++;
+  const char *name = p;
+  p += param_len(p);
+  if (*start == '{' && p - name == 10 && strncmp(name, "PIPESTATUS", 10) == 0 && *p == '[') {
+    const char *close = strchr(p, ']');
+    if (close != NULL && memchr(p, '"', close - p) == NULL)
+      p = close + 1;
+  }
+  memcpy(*out, start, p - start);
+  *out += p - start;
+  return p;
+}
 
-      char tmpbuf[4096];
-      printf("%s", oldbuf);
-      strcpy(tmpbuf, buf);
-      strcpy(buf, oldbuf);
-      strcpy(oldbuf, tmpbuf);
-      index += strlen(buf);
-      continue;
+// Copy one word into ps->out (without quotes and escapes) and return it.
+// Quotes may appear anywhere in it (a"b c"d -> ab cd).
+static char *parse_word(struct parser *ps) {
+  char *word = ps->out, *out = ps->out;
+  const char *p = ps->p;
+  while (*p != '\0' && !parse_is_space(*p) && !parse_is_operator(*p)) {
+    if (*p == '\'') {
+      // single quotes: everything literal up to the next '
+      const char *q = strchr(p + 1, '\'');
+      if (q == NULL)
+        return parse_fail(ps, "unterminated quote");
+      for (p++; p < q; p++) {
+        if (parse_is_special(*p))
+          *out++ = QUOTE_ESC;
+        *out++ = *p;
+      }
+      p = q + 1;
+    } else if (*p == '"') {
+      // double quotes: backslash only escapes " \ $ `
+      for (p++; *p != '"'; p++) {
+        if (*p == '\0')
+          return parse_fail(ps, "unterminated quote");
+        if (*p == '\\' && strchr("\"\\$`", p[1]) != NULL && p[1] != '\0') {
+          *out++ = *++p;
+        } else if (*p == '$') {
+          *out++ = EXPAND_MARK_QUOTED;
+          p = parse_param_name(p + 1, &out) - 1;
+        } else {
+          if (parse_is_special(*p))
+            *out++ = QUOTE_ESC;
+          *out++ = *p;
+        }
+      }
+      p++;
+    } else if (*p == '\\' && p[1] != '\0') {
+      if (parse_is_special(p[1]))
+        *out++ = QUOTE_ESC;
+      *out++ = p[1];
+      p += 2;
+    } else if (*p == '$') {
+      *out++ = EXPAND_MARK;
+      p = parse_param_name(p + 1, &out);
+    } else {
+      *out++ = *p++;
     }
+  }
+  *out++ = '\0';
+  ps->out = out;
+  ps->p = p;
+  return word;
+}
 
-    // echo typed character ourselves
-    putchar(c);
-    buf[index++] = c;
-
-    if (index >= sizeof(buf) - 1)
-      break;
+// <file, > file, >>file; returns false if ps->p is not at a redirection
+static bool parse_redirect(struct parser *ps, struct command_t *c) {
+  int index;
+  if (*ps->p == '<') {
+    index = 0;
+  } else if (*ps->p == '>') {
+    index = ps->p[1] == '>' ? 2 : 1;
+  } else {
+    return false;
+  }
+  ps->p += index == 2 ? 2 : 1;
+  parse_skip(ps, false);
+  if (*ps->p == '\0' || parse_is_operator(*ps->p)) {
+    parse_fail(ps, "missing file name after redirection");
+    return true;
+  }
+  char *word = parse_word(ps);
+  if (word != NULL)
+    c->redirects[index] = word;
+  return true;
+}
 
-    if (c == '\n') // ENTER
+// words and redirections of one command, up to an operator
+static struct command_t *parse_simple(struct parser *ps) {
+  struct command_t *c = arena_alloc(&line_arena, sizeof(struct command_t));
+  memset(c, 0, sizeof(*c));
+  char **argv = ps->slots;
+  int argc = 0;
+  while (1) {
+    parse_skip(ps, false);
+    if (parse_redirect(ps, c)) {
+      if (ps->error != NULL)
+        return NULL;
+      continue;
+    }
+    if (*ps->p == '\0' || parse_is_operator(*ps->p))
       break;
-
-    if (c == 4) // Ctrl+D -> exit shell
-      return EXIT;
+    char *word = parse_word(ps);
+    if (word == NULL)
+      return NULL;
+    argv[argc++] = word;
   }
+  if (argc == 0 && c->redirects[0] == NULL && c->redirects[1] == NULL && c->redirects[2] == NULL)
+    return *ps->p == '|' ? parse_fail(ps, "missing command before '|'") : parse_unexpected(ps);
+  parse_finish(c, argv, argc);
+  ps->slots += argc + 1;
+  return c;
+}
 
-  // remove newline at the end
-  if (index > 0 && buf[index - 1] == '\n')
-    index--;
+static struct node *parse_list(struct parser *ps);
 
-  // null terminate string
-  buf[index++] = '\0';
+static struct node *parse_new_node(enum node_type type) {
+  struct node *n = arena_alloc(&line_arena, sizeof(struct node));
+  memset(n, 0, sizeof(*n));
+  n->type = type;
+  return n;
+}
 
-  // save command for up arrow history
-  strcpy(oldbuf, buf);
+// a list that must have at least one command
+static struct node *parse_body(struct parser *ps) {
+  struct node *n = parse_list(ps);
+  if (n == NULL && ps->error == NULL)
+    parse_unexpected(ps);
+  return n;
+}
 
-  // fill command struct from input string
-  parse_command(buf, command);
+// if ... fi after the `if` (or `elif`)
+static struct node *parse_if(struct parser *ps) {
+  struct node *n = parse_new_node(NODE_IF);
+  if ((n->left = parse_body(ps)) == NULL || !parse_keyword(ps, "then") ||
+      (n->right = parse_body(ps)) == NULL)
+    return NULL;
+  parse_skip(ps, true);
+  if (parse_at_keyword(ps, "elif")) {
+    ps->p += 4;
+    return (n->orelse = parse_if(ps)) != NULL ? n : NULL;
+  }
+  if (parse_at_keyword(ps, "else")) {
+    ps->p += 4;
+    if ((n->orelse = parse_body(ps)) == NULL)
+      return NULL;
+  }
+  return parse_keyword(ps, "fi") ? n : NULL;
+}
 
-  // restore terminal settings before executing
-  tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-  return SUCCESS;
+// for NAME [in word ...] ; do list done, after the `for`
+static struct node *parse_for(struct parser *ps) {
+  struct node *n = parse_new_node(NODE_FOR);
+  parse_skip(ps, false);
+  size_t len = 0;
+  while (len < 255 && (ps->p[len] == '_' || (ps->p[len] >= 'a' && ps->p[len] <= 'z') ||
+                       (ps->p[len] >= 'A' && ps->p[len] <= 'Z') ||
+                       (len > 0 && ps->p[len] >= '0' && ps->p[len] <= '9')))
+    len++;
+  if (len == 0 || !(ps->p[len] == '\0' || parse_is_space(ps->p[len]) || parse_is_operator(ps->p[len])))
+    return parse_fail(ps, *ps->p == '\0' ? "unexpected end of input" : "bad for loop variable");
+  n->var = arena_alloc(&line_arena, len + 1);
+  memcpy(n->var, ps->p, len);
+  n->var[len] = '\0';
+  ps->p += len;
+
+  parse_skip(ps, true);
+  if (parse_at_keyword(ps, "in")) {
+    ps->p += 2;
+    n->words = ps->slots;
+    int count = 0;
+    while (1) {
+      parse_skip(ps, false);
+      if (*ps->p == ';' || *ps->p == '\n') {
+        ps->p++;
+        break;
+      }
+      if (*ps->p == '\0' || parse_is_operator(*ps->p))
+        return parse_unexpected(ps);
+      char *word = parse_word(ps);
+      if (word == NULL)
+        return NULL;
+      n->words[count++] = word;
+    }
+    n->words[count] = NULL;
+    ps->slots += count + 1;
+  } else if (*ps->p == ';') {
+    ps->p++;
+  }
+  if (!parse_keyword(ps, "do") || (n->right = parse_body(ps)) == NULL ||
+      !parse_keyword(ps, "done"))
+    return NULL;
+  return n;
 }
 
-// This function tries to find full path of a command using PATH env.
-// We need this because we use execv (not execvp).
-static char *resolve_path(const char *cmd) {
+// a command of the skeleton's kind that runs body (a subshell, or a
+// compound command in a pipe chain or in the background) in a forked
+// child; its name is the source text, for jobs and stats
+static struct command_t *parse_wrap(struct parser *ps, struct node *body,
+                                    const char *start) {
+  struct command_t *c = arena_alloc(&line_arena, sizeof(struct command_t));
+  memset(c, 0, sizeof(*c));
+  size_t len = ps->p - start;
+  while (len > 0 && parse_is_space(start[len - 1]))
+    len--;
+  char *text = arena_alloc(&line_arena, len + 1);
+  memcpy(text, start, len);
+  text[len] = '\0';
+  parse_finish(c, ps->slots, 0);
+  c->args[0] = c->name = text;
+  ps->slots += 2;
+  c->body = body;
+  return c;
+}
 
-  // if command already has '/', we treat it as a path
-  if (strchr(cmd, '/') != NULL) {
-    return strdup(cmd);
+// One stage of a pipe chain. A compound command is returned in *compound
+// if it can run in the shell itself; otherwise the stage is a command.
+static struct command_t *parse_stage(struct parser *ps, struct node **compound) {
+  const char *start = ps->p;
+  struct node *n = NULL;
+  bool subshell = false;
+  *compound = NULL;
+  if (*ps->p == '(') {
+    ps->p++;
+    n = parse_body(ps);
+    if (n == NULL)
+      return NULL;
+    parse_skip(ps, true);
+    if (*ps->p != ')')
+      return parse_unexpected(ps);
+    ps->p++;
+    subshell = true;
+  } else if (parse_at_keyword(ps, "{")) {
+    ps->p++;
+    n = parse_new_node(NODE_GROUP);
+    if ((n->left = parse_body(ps)) == NULL || !parse_keyword(ps, "}"))
+      return NULL;
+  } else if (parse_at_keyword(ps, "if")) {
+    ps->p += 2;
+    n = parse_if(ps);
+  } else if (parse_at_keyword(ps, "while") || parse_at_keyword(ps, "until")) {
+    n = parse_new_node(*ps->p == 'w' ? NODE_WHILE : NODE_UNTIL);
+    ps->p += 5;
+    if ((n->left = parse_body(ps)) == NULL || !parse_keyword(ps, "do") ||
+        (n->right = parse_body(ps)) == NULL || !parse_keyword(ps, "done"))
+      return NULL;
+  } else if (parse_at_keyword(ps, "for")) {
+    ps->p += 3;
+    n = parse_for(ps);
+  } else {
+    return parse_simple(ps);
   }
-
-  // get PATH (like /bin:/usr/bin:...)
-  char *path_env = getenv("PATH");
-  if (path_env == NULL)
+  if (n == NULL)
     return NULL;
 
-  // strtok will modify the string, so we copy it first
-  char *path_copy = strdup(path_env);
-  if (path_copy == NULL)
+  // redirections after a compound command: it runs in a child then
+  struct command_t redirects;
+  memset(&redirects, 0, sizeof(redirects));
+  while (1) {
+    parse_skip(ps, false);
+    if (!parse_redirect(ps, &redirects))
+      break;
+    if (ps->error != NULL)
+      return NULL;
+  }
+  bool redirected = redirects.redirects[0] || redirects.redirects[1] || redirects.redirects[2];
+  if (!subshell && !redirected) {
+    *compound = n;
     return NULL;
+  }
+  struct command_t *c = parse_wrap(ps, n, start);
+  memcpy(c->redirects, redirects.redirects, sizeof(c->redirects));
+  return c;
+}
 
-  char *saveptr = NULL;
-  char *dir = strtok_r(path_copy, ":", &saveptr);
-
-  char candidate[PATH_MAX];
-
-  // try each directory in PATH
-  while (dir != NULL) {
-    snprintf(candidate, sizeof(candidate), "%s/%s", dir, cmd);
-
-    // check if file exists and executable
-    if (access(candidate, X_OK) == 0) {
-      free(path_copy);
-      return strdup(candidate);
+// [!] stage | stage | ...
+static struct node *parse_pipeline(struct parser *ps) {
+  parse_skip(ps, false);
+  bool negate = parse_at_keyword(ps, "!");
+  if (negate) {
+    ps->p++;
+    parse_skip(ps, false);
+  }
+  struct node *n = parse_new_node(NODE_CMD);
+  n->negate = negate;
+  struct command_t **tail = &n->cmd;
+  while (1) {
+    const char *start = ps->p;
+    struct node *compound;
+    struct command_t *c = parse_stage(ps, &compound);
+    if (ps->error != NULL)
+      return NULL;
+    parse_skip(ps, false);
+    bool piped = *ps->p == '|' && ps->p[1] != '|';
+    if (compound != NULL) {
+      if (n->cmd == NULL && !piped && !negate)
+        return compound; // runs in the shell, like bash
+      c = parse_wrap(ps, compound, start);
     }
-
-    dir = strtok_r(NULL, ":", &saveptr);
+    *tail = c;
+    tail = &c->next;
+    if (!piped)
+      return n;
+    ps->p++;
+    parse_skip(ps, true);
+    if (*ps->p == '\0')
+      return parse_fail(ps, "missing command after '|'");
+    if (*ps->p == '|')
+      return parse_fail(ps, "missing command before '|'");
   }
-
-  free(path_copy);
-  return NULL;
 }
 
-// Apply <, >, >> redirections by opening files and dup2 to stdin/stdout
-static void apply_redirects(struct command_t *command) {
-
-  // input redirection: <file
-  if (command->redirects[0] != NULL) {
-    int fd_in = open(command->redirects[0], O_RDONLY);
-    if (fd_in < 0) {
-      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[0], strerror(errno));
-      exit(1);
-    }
-    // replace stdin with file
-    if (dup2(fd_in, STDIN_FILENO) < 0) {
-      fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
-      close(fd_in);
-      exit(1);
-    }
-    close(fd_in);
+// pipeline && pipeline || ...
+static struct node *parse_and_or(struct parser *ps) {
+  struct node *left = parse_pipeline(ps);
+  while (left != NULL) {
+    parse_skip(ps, false);
+    if ((ps->p[0] != '&' && ps->p[0] != '|') || ps->p[1] != ps->p[0])
+      return left;
+    struct node *n = parse_new_node(ps->p[0] == '&' ? NODE_AND : NODE_OR);
+    ps->p += 2;
+    parse_skip(ps, true);
+    if (*ps->p == '\0')
+      return parse_fail(ps, "unexpected end of input");
+    n->left = left;
+    n->right = parse_pipeline(ps);
+    left = n->right != NULL ? n : NULL;
   }
+  return NULL;
+}
 
-  // output append redirection: >>file
-  if (command->redirects[2] != NULL) {
-    int fd_out = open(command->redirects[2], O_WRONLY | O_CREAT | O_APPEND, 0644);
-    if (fd_out < 0) {
-      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[2], strerror(errno));
-      exit(1);
-    }
-    // replace stdout with file
-    if (dup2(fd_out, STDOUT_FILENO) < 0) {
-      fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
-      close(fd_out);
-      exit(1);
-    }
-    close(fd_out);
-  } else if (command->redirects[1] != NULL) {
-    // output overwrite redirection: >file
-    int fd_out = open(command->redirects[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd_out < 0) {
-      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[1], strerror(errno));
-      exit(1);
-    }
-    // replace stdout with file
-    if (dup2(fd_out, STDOUT_FILENO) < 0) {
-      fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
-      close(fd_out);
-      exit(1);
+// Commands separated by ';', '&' or newlines, up to the end of the line,
+// a ')' or a reserved word that ends the list (then, fi, done, ...).
+// Returns NULL for an empty list (check ps->error).
+static struct node *parse_list(struct parser *ps) {
+  struct node *head = NULL, **tail = &head;
+  while (1) {
+    parse_skip(ps, true);
+    if (parse_at_list_end(ps))
+      return head;
+    const char *start = ps->p;
+    struct node *n = parse_and_or(ps);
+    if (n == NULL)
+      return NULL;
+    parse_skip(ps, false);
+    if (*ps->p == '&') {
+      // '&' means run in background; a chain is marked like before,
+      // anything else runs in a forked child
+      if (n->type == NODE_CMD && !n->negate) {
+        for (struct command_t *c = n->cmd; c != NULL; c = c->next)
+          c->background = true;
+      } else {
+        struct node *bg = parse_new_node(NODE_CMD);
+        bg->cmd = parse_wrap(ps, n, start);
+        bg->cmd->background = true;
+        n = bg;
+      }
+      ps->p++;
+    } else if (*ps->p == ';' || *ps->p == '\n') {
+      ps->p++;
+    } else if (!parse_at_list_end(ps)) {
+      return parse_unexpected(ps);
     }
-    close(fd_out);
+    *tail = n;
+    tail = &n->next;
   }
 }
 
-// simple helper: parse a positive integer, return -1 if not valid
-static int parse_positive_int(const char *s) {
-  if (s == NULL || *s == '\0') return -1;
-  int x = 0;
-  for (int i = 0; s[i] != '\0'; i++) {
-    if (s[i] < '0' || s[i] > '9') return -1;
-    x = x * 10 + (s[i] - '0');
+/**
+ * Parse a command string into a tree of commands
+ * @param  buf  [description]
+ * @param  tree [description]
+ * @return      0, -1 on a syntax error (tree is NULL), or PARSE_INCOMPLETE
+ *              if buf ends inside a construct (an if without fi, a '|' at
+ *              the end...), then the caller can add the next line
+ */
+int parse_command(char *buf, struct node **tree) {
+  size_t len = strlen(buf);
+
+  // one pass over buf: words are copied (without quotes and escapes) into
+  // out, and argv slices of every command point into it. A word takes at
+  // least one byte of the line and adds one terminator, a byte of the line
+  // gets at most one QUOTE_ESC, and every command needs at most two extra
+  // argv slots, so these bounds always hold.
+  struct parser ps = {
+      .p = buf,
+      .out = arena_alloc(&line_arena, 3 * len + 2),
+      .slots = arena_alloc(&line_arena, sizeof(char *) * (2 * len + 4)),
+  };
+  *tree = parse_list(&ps);
+  if (ps.error == NULL && *ps.p != '\0')
+    parse_unexpected(&ps);
+  if (ps.error != NULL) {
+    *tree = NULL;
+    if (ps.incomplete)
+      return PARSE_INCOMPLETE;
+    fprintf(stderr, "-%s: syntax error: %s\n", sysname, ps.error);
+    return -1;
   }
-  return x;
-}
 
-// Custom command: pinfo <pid>
-// We read /proc/<pid>/status and print some fields.
-static int builtin_pinfo(struct command_t *command) {
+  // user can press TAB for autocomplete (we mark it with '?')
+  size_t end = len;
+  while (end > 0 && parse_is_space(buf[end - 1]))
+    end--;
+  if (end > 0 && buf[end - 1] == '?' && *tree != NULL && (*tree)->type == NODE_CMD)
+    (*tree)->cmd->auto_complete = true;
+  return 0;
+}
 
-  // if user didn't give pid
-  if (command->args[1] == NULL) {
-    fprintf(stderr, "-%s: pinfo: missing pid\n", sysname);
-    return SUCCESS;
-  }
+// ---------------------------------------------------------------------------
+// history: every interactive line is appended to ~/.shellish_history (or
+// $HISTFILE) with one O_APPEND write, so sessions share the file. At startup
+// the file is only mmap'ed; it is split into lines the first time history is
+// used. The last HIST_MAX entries live in a ring; entries from the file point
+// into the mapping, entries of this session are malloc'ed.
 
-  // only accept numeric pid
-  int pid = parse_positive_int(command->args[1]);
-  if (pid <= 0) {
-    fprintf(stderr, "-%s: pinfo: invalid pid\n", sysname);
-    return SUCCESS;
-  }
+#define HIST_MAX (128 * 1024)
 
-  // build /proc/<pid>/status path
-  char path[PATH_MAX];
-  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+struct hist_entry {
+  char *line;
+  int len;
+  bool owned;
+};
 
-  FILE *f = fopen(path, "r");
-  if (!f) {
-    // if file does not exist, process probably not found
-    fprintf(stderr, "-%s: pinfo: %s\n", sysname, strerror(errno));
-    return SUCCESS;
+static struct {
+  int fd;                  // append fd, -1 if the file can't be written
+  char *map;               // the file as it was at startup
+  size_t map_len;
+  bool loaded;
+  struct hist_entry *ring;
+  long count;              // entries so far; entry n is ring[(n - 1) % HIST_MAX]
+} hist = {.fd = -1};
+
+static void history_init(void) {
+  char path[4096];
+  const char *file = getenv("HISTFILE");
+  if (file == NULL) {
+    const char *home = getenv("HOME");
+    if (home == NULL)
+      return;
+    snprintf(path, sizeof(path), "%s/.%s_history", home, sysname);
+    file = path;
   }
-
-  // read status file and print some important lines
-  char line[512];
-  int shown = 0;
-  while (fgets(line, sizeof(line), f) != NULL) {
-    if (strncmp(line, "Name:", 5) == 0 ||
-        strncmp(line, "State:", 6) == 0 ||
-        strncmp(line, "PPid:", 5) == 0 ||
-        strncmp(line, "VmSize:", 7) == 0 ||
-        strncmp(line, "VmRSS:", 6) == 0) {
-      fputs(line, stdout);
-      shown++;
-    }
-    if (shown >= 5) break; // stop after printing 5 items
+  hist.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (hist.fd < 0)
+    return;
+  struct stat st;
+  if (fstat(hist.fd, &st) == 0 && st.st_size > 0) {
+    hist.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hist.fd, 0);
+    if (hist.map == MAP_FAILED)
+      hist.map = NULL;
+    else
+      hist.map_len = st.st_size;
   }
-  fclose(f);
-  return SUCCESS;
 }
 
-// create room directory if it does not exist
-static int ensure_dir_exists(const char *dir) {
-  struct stat st;
-  if (stat(dir, &st) == 0) {
-    if (S_ISDIR(st.st_mode)) return 0;
-    return -1;
+static void history_push(char *line, int len, bool owned) {
+  struct hist_entry *e = &hist.ring[hist.count % HIST_MAX];
+  if (e->owned)
+    free(e->line);
+  e->line = line;
+  e->len = len;
+  e->owned = owned;
+  hist.count++;
+}
+
+// split the mapped file into entries (only the last HIST_MAX are kept)
+static void history_load(void) {
+  if (hist.loaded)
+    return;
+  hist.loaded = true;
+  hist.ring = calloc(HIST_MAX, sizeof(struct hist_entry));
+  char *p = hist.map, *end = hist.map + hist.map_len;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    if (nl == NULL)
+      nl = end;
+    if (nl > p)
+      history_push(p, nl - p, false);
+    p = nl + 1;
   }
-  if (mkdir(dir, 0777) == 0) return 0;
-  return -1;
 }
 
-// create fifo if it does not exist
-static int ensure_fifo_exists(const char *path) {
-  struct stat st;
-  if (stat(path, &st) == 0) {
-    if (S_ISFIFO(st.st_mode)) return 0;
-    return -1;
+static struct hist_entry *history_get(long n) {
+  if (n < 1 || n > hist.count || n <= hist.count - HIST_MAX)
+    return NULL;
+  return &hist.ring[(n - 1) % HIST_MAX];
+}
+
+static void history_add(const char *line) {
+  history_load();
+  int len = strlen(line);
+  if (len == 0)
+    return;
+  struct hist_entry *last = history_get(hist.count);
+  if (last != NULL && last->len == len && memcmp(last->line, line, len) == 0)
+    return;
+  char *copy = malloc(len + 1);
+  memcpy(copy, line, len);
+  copy[len] = '\n';
+  if (hist.fd >= 0 && write(hist.fd, copy, len + 1) < 0) {
+    close(hist.fd);
+    hist.fd = -1;
   }
-  if (mkfifo(path, 0666) == 0) return 0;
-  if (errno == EEXIST) return 0;
-  return -1;
+  copy[len] = '\0';
+  history_push(copy, len, true);
 }
 
-// This child keeps reading from our own fifo and prints messages to screen.
-static void chatroom_reader_loop(const char *fifo_path) {
-  int fd = open(fifo_path, O_RDONLY | O_NONBLOCK);
-  if (fd < 0) exit(1);
+// Expand a leading !!, !n, !-n or !prefix. Returns a malloc'ed line, NULL
+// if there is nothing to expand, or "" (after an error) if the event is not
+// found.
+static char *history_expand(const char *line) {
+  const char *p = line;
+  while (*p == ' ' || *p == '\t')
+    p++;
+  if (p[0] != '!' || p[1] == '\0' || p[1] == ' ' || p[1] == '\t' || p[1] == '=')
+    return NULL;
+  history_load();
+
+  const char *word = p + 1, *rest = word;
+  while (*rest != '\0' && *rest != ' ' && *rest != '\t')
+    rest++;
+  int wlen = rest - word;
 
-  char buf[1024];
-  while (1) {
-    ssize_t n = read(fd, buf, sizeof(buf));
-    if (n > 0) {
-      write(STDOUT_FILENO, buf, (size_t)n);
+  struct hist_entry *e = NULL;
+  char *num_end;
+  if (wlen == 1 && word[0] == '!') {
+    e = history_get(hist.count);
+  } else {
+    long n = strtol(word, &num_end, 10);
+    if (num_end == rest && wlen > 0 && !(wlen == 1 && word[0] == '-')) {
+      e = history_get(n < 0 ? hist.count + 1 + n : n);
     } else {
-      // small sleep to avoid busy loop
-      usleep(20000);
+      for (long i = hist.count; i > 0 && i > hist.count - HIST_MAX; i--) {
+        struct hist_entry *c = history_get(i);
+        if (c->len >= wlen && memcmp(c->line, word, wlen) == 0) {
+          e = c;
+          break;
+        }
+      }
     }
   }
+  if (e == NULL) {
+    fprintf(stderr, "-%s: !%.*s: event not found\n", sysname, wlen, word);
+    return strdup("");
+  }
+
+  size_t rlen = strlen(rest);
+  char *out = malloc(e->len + rlen + 1);
+  memcpy(out, e->line, e->len);
+  memcpy(out + e->len, rest, rlen + 1);
+  return out;
 }
 
-// Builtin command: chatroom <roomname> <username>
-// Uses /tmp/chatroom-<roomname>/ and named pipes for each user.
-static int builtin_chatroom(struct command_t *command) {
-  if (command->args[1] == NULL || command->args[2] == NULL) {
-    fprintf(stderr, "-%s: chatroom: usage: chatroom <roomname> <username>\n", sysname);
-    return SUCCESS;
+// history [n]: list the last n entries (all by default)
+static int builtin_history(struct command_t *command) {
+  history_load();
+  long n = hist.count;
+  if (command->args[1] != NULL) {
+    char *end;
+    n = strtol(command->args[1], &end, 10);
+    if (*end != '\0' || n < 0) {
+      fprintf(stderr, "-%s: history: %s: numeric argument required\n", sysname,
+              command->args[1]);
+      return 1;
+    }
+  }
+  long first = hist.count - n + 1;
+  if (first <= hist.count - HIST_MAX)
+    first = hist.count - HIST_MAX + 1;
+  if (first < 1)
+    first = 1;
+  for (long i = first; i <= hist.count; i++) {
+    struct hist_entry *e = history_get(i);
+    printf("%5ld  %.*s\n", i, e->len, e->line);
   }
+  return SUCCESS;
+}
 
-  const char *room = command->args[1];
-  const char *user = command->args[2];
+// Ctrl-R search state: level k holds the entries (newest first) containing
+// the first k+1 bytes of the query. Each new byte only filters the previous
+// level, and backspace pops a level, so keystrokes don't rescan everything.
+struct hist_search {
+  char query[256];
+  int qlen;
+  long *levels[256];
+  long counts[256];
+  long sel;                // index of the shown match in the top level
+};
 
-  char roomdir[PATH_MAX];
+static void hist_search_push(struct hist_search *s, char c) {
+  if (s->qlen >= (int)sizeof(s->query) - 1)
+    return;
+  s->query[s->qlen++] = c;
+  int k = s->qlen - 1;
+  long cap = k == 0 ? (hist.count < HIST_MAX ? hist.count : HIST_MAX) : s->counts[k - 1];
+  long *out = malloc(sizeof(long) * (cap ? cap : 1)), n = 0;
+  if (k == 0) {
+    for (long i = hist.count; i > 0 && i > hist.count - HIST_MAX; i--) {
+      struct hist_entry *e = history_get(i);
+      if (memchr(e->line, c, e->len) != NULL)
+        out[n++] = i;
+    }
+  } else {
+    for (long j = 0; j < s->counts[k - 1]; j++) {
+      struct hist_entry *e = history_get(s->levels[k - 1][j]);
+      if (memmem(e->line, e->len, s->query, s->qlen) != NULL)
+        out[n++] = s->levels[k - 1][j];
+    }
+  }
+  s->levels[k] = out;
+  s->counts[k] = n;
+  s->sel = 0;
+}
+
+static void hist_search_pop(struct hist_search *s) {
+  if (s->qlen == 0)
+    return;
+  s->qlen--;
+  free(s->levels[s->qlen]);
+  s->sel = 0;
+}
+
+static struct hist_entry *hist_search_match(struct hist_search *s) {
+  if (s->qlen == 0 || s->sel >= s->counts[s->qlen - 1])
+    return NULL;
+  return history_get(s->levels[s->qlen - 1][s->sel]);
+}
+
+// Incremental reverse search (Ctrl-R) inside prompt(). On return buf holds
+// the chosen line; returns true if Enter was pressed (run it right away).
+static bool history_search(char *buf, int *len, int buf_size) {
+  history_load();
+  struct hist_search s;
+  memset(&s, 0, sizeof(s));
+  bool run = false, failed = false;
+  char saved[4096];
+  memcpy(saved, buf, *len);
+  int saved_len = *len;
+
+  while (1) {
+    struct hist_entry *m = hist_search_match(&s);
+    if (!term_pending()) {
+      char out[8192];
+      int n = snprintf(out, sizeof(out), "\r\033[K(%sreverse-i-search)`%.*s': %.*s",
+                       failed ? "failed " : "", s.qlen, s.query,
+                       m ? (m->len < 4096 ? m->len : 4096) : 0, m ? m->line : "");
+      term_write(out, n < (int)sizeof(out) ? n : (int)sizeof(out) - 1);
+    }
+
+    int c = read_key();
+    if (c == KEY_REDRAW)
+      continue;
+    if (c == 18) { // Ctrl-R again: next older match
+      failed = m == NULL || s.sel + 1 >= s.counts[s.qlen - 1];
+      if (!failed)
+        s.sel++;
+      continue;
+    }
+    failed = false;
+    if (c == 127 || c == 8) {
+      hist_search_pop(&s);
+      continue;
+    }
+    if (c >= 32 && c < 127) {
+      hist_search_push(&s, c);
+      continue;
+    }
+
+    if (c == 7 || c == 3 || c == EOF) { // Ctrl-G/Ctrl-C: give up, restore the line
+      memcpy(buf, saved, saved_len);
+      *len = saved_len;
+    } else if (m != NULL) {
+      *len = m->len < buf_size - 2 ? m->len : buf_size - 2;
+      memcpy(buf, m->line, *len);
+    }
+    run = c == '\r' || c == '\n';
+    break;
+  }
+  while (s.qlen > 0)
+    hist_search_pop(&s);
+  return run;
+}
+
+// ---------------------------------------------------------------------------
+// tab completion: command names come from a prefix trie of the builtins and
+// all executables on PATH. A PATH directory is rescanned only when its mtime
+// changes. Every trie node records in which PATH directories (bits 0..62)
+// the name exists, bit 63 is for builtins. File names come from a cache of
+// sorted readdir results per directory, also checked by mtime, so a TAB in a
+// big directory is a binary search instead of a new scan.
+
+struct trie_node {
+  struct trie_node *child;   // children are kept sorted by c
+  struct trie_node *sibling;
+  uint64_t dirs;             // != 0: a command name ends here
+  char c;
+};
+
+#define COMP_BUILTIN_BIT (1ULL << 63)
+#define COMP_MAX_DIRS 63
+#define COMP_DIR_CACHE_MAX 16
+#define COMP_LIST_MAX 200
+
+static const char *comp_builtins[] = {
+    "bg", "break", "cat", "cd", "chatroom", "continue", "cut", "exit", "export",
+    "fg", "hash", "history", "jobs", "kill", "parallel", "pinfo", "set", "stats",
+    "time", "unset", "wait",
+};
+
+static struct trie_node comp_trie;
+static char *comp_path_env;
+static struct {
+  char *dir;
+  struct timespec mtime;
+} comp_dirs[COMP_MAX_DIRS];
+static int comp_dir_count;
+
+static void trie_free(struct trie_node *n) {
+  while (n != NULL) {
+    struct trie_node *next = n->sibling;
+    trie_free(n->child);
+    free(n);
+    n = next;
+  }
+}
+
+static void trie_insert(const char *name, uint64_t bit) {
+  struct trie_node *n = &comp_trie;
+  for (; *name != '\0'; name++) {
+    struct trie_node **link = &n->child;
+    while (*link != NULL && (*link)->c < *name)
+      link = &(*link)->sibling;
+    if (*link == NULL || (*link)->c != *name) {
+      struct trie_node *c = calloc(1, sizeof(struct trie_node));
+      c->c = *name;
+      c->sibling = *link;
+      *link = c;
+    }
+    n = *link;
+  }
+  n->dirs |= bit;
+}
+
+static void trie_clear_bit(struct trie_node *n, uint64_t bit) {
+  for (; n != NULL; n = n->sibling) {
+    n->dirs &= ~bit;
+    trie_clear_bit(n->child, bit);
+  }
+}
+
+static struct trie_node *trie_find(const char *prefix, int len) {
+  struct trie_node *n = &comp_trie;
+  for (int i = 0; i < len && n != NULL; i++) {
+    n = n->child;
+    while (n != NULL && n->c != prefix[i])
+      n = n->sibling;
+  }
+  return n;
+}
+
+static void comp_scan_dir(int i) {
+  uint64_t bit = 1ULL << i;
+  trie_clear_bit(comp_trie.child, bit);
+  DIR *d = opendir(comp_dirs[i].dir);
+  if (d == NULL)
+    return;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    if (ent->d_name[0] == '.')
+      continue;
+    struct stat st;
+    if (fstatat(dirfd(d), ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+        (st.st_mode & 0111))
+      trie_insert(ent->d_name, bit);
+  }
+  closedir(d);
+}
+
+// bring the command trie up to date with PATH and its directories
+static void comp_sync_commands(void) {
+  const char *path_env = getenv("PATH");
+  if (path_env == NULL)
+    path_env = "";
+  if (comp_path_env == NULL || strcmp(comp_path_env, path_env) != 0) {
+    trie_free(comp_trie.child);
+    comp_trie.child = NULL;
+    for (int i = 0; i < comp_dir_count; i++)
+      free(comp_dirs[i].dir);
+    comp_dir_count = 0;
+    free(comp_path_env);
+    comp_path_env = strdup(path_env);
+
+    for (size_t i = 0; i < sizeof(comp_builtins) / sizeof(comp_builtins[0]); i++)
+      trie_insert(comp_builtins[i], COMP_BUILTIN_BIT);
+    for (const char *p = path_env; *p != '\0' && comp_dir_count < COMP_MAX_DIRS;) {
+      const char *colon = strchr(p, ':');
+      size_t len = colon ? (size_t)(colon - p) : strlen(p);
+      if (len > 0) {
+        comp_dirs[comp_dir_count].dir = strndup(p, len);
+        memset(&comp_dirs[comp_dir_count].mtime, 0, sizeof(struct timespec));
+        comp_dir_count++;
+      }
+      if (colon == NULL)
+        break;
+      p = colon + 1;
+    }
+  }
+
+  for (int i = 0; i < comp_dir_count; i++) {
+    struct stat st;
+    if (stat(comp_dirs[i].dir, &st) != 0)
+      memset(&st, 0, sizeof(st));
+    if (st.st_mtim.tv_sec == comp_dirs[i].mtime.tv_sec &&
+        st.st_mtim.tv_nsec == comp_dirs[i].mtime.tv_nsec)
+      continue;
+    comp_dirs[i].mtime = st.st_mtim;
+    comp_scan_dir(i);
+  }
+}
+
+// collected matches of one TAB press
+struct comp_result {
+  const char *list[COMP_LIST_MAX];
+  char *owned;               // storage for names built from the trie
+  size_t owned_len;
+  long count;                // all matches (list holds the first ones)
+  char common[1024];         // longest common prefix of all matches
+  bool unique_is_dir;
+};
+
+static void trie_collect(struct trie_node *n, char *name, int depth,
+                         struct comp_result *r) {
+  for (; n != NULL; n = n->sibling) {
+    if (depth >= 1000)
+      return;
+    name[depth] = n->c;
+    if (n->dirs != 0) {
+      if (r->count < COMP_LIST_MAX) {
+        memcpy(r->owned + r->owned_len, name, depth + 1);
+        r->owned[r->owned_len + depth + 1] = '\0';
+        r->list[r->count] = r->owned + r->owned_len;
+        r->owned_len += depth + 2;
+      }
+      r->count++;
+    }
+    trie_collect(n->child, name, depth + 1, r);
+  }
+}
+
+static void comp_commands(const char *prefix, int len, struct comp_result *r) {
+  comp_sync_commands();
+  struct trie_node *n = trie_find(prefix, len);
+  if (n == NULL)
+    return;
+
+  // common prefix: follow the chain while there is a single way to go
+  memcpy(r->common, prefix, len);
+  int clen = len;
+  struct trie_node *c = n;
+  while (c->dirs == 0 && c->child != NULL && c->child->sibling == NULL &&
+         clen < (int)sizeof(r->common) - 1) {
+    c = c->child;
+    r->common[clen++] = c->c;
+  }
+  r->common[clen] = '\0';
+
+  char name[1024];
+  memcpy(name, prefix, len);
+  r->owned = malloc(COMP_LIST_MAX * 1026);
+  if (n->dirs != 0) {
+    r->list[0] = strcpy(r->owned, r->common);
+    r->owned_len = len + 1;
+    r->count = 1;
+  }
+  trie_collect(n->child, name, len, r);
+}
+
+struct dir_cache {
+  char *path;
+  struct timespec mtime;
+  char *names;               // all names, NUL separated
+  char **sorted;
+  long n;
+  unsigned long checked_epoch;
+  struct dir_cache *next;    // most recently used first
+};
+
+static struct dir_cache *dir_caches;
+
+// glob expansion starts a new epoch for each command line: a directory is
+// stat'ed at most once per line however many patterns read it
+static unsigned long dir_cache_epoch = 1;
+
+static int comp_strcmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void dir_cache_free(struct dir_cache *c) {
+  free(c->path);
+  free(c->names);
+  free(c->sorted);
+  free(c);
+}
+
+// sorted entries of dir, rescanned only if its mtime changed; with
+// same_epoch a cache already checked in this epoch is used as it is
+static struct dir_cache *dir_cache_get(const char *dir, bool same_epoch) {
+  struct dir_cache **link = &dir_caches, *c = NULL;
+  int depth = 0;
+  for (; *link != NULL; link = &(*link)->next, depth++) {
+    if (strcmp((*link)->path, dir) == 0) {
+      c = *link;
+      *link = c->next;
+      break;
+    }
+    if (depth == COMP_DIR_CACHE_MAX - 1 && (*link)->next != NULL) {
+      // drop the least recently used caches
+      struct dir_cache *old = (*link)->next;
+      (*link)->next = NULL;
+      while (old != NULL) {
+        struct dir_cache *next = old->next;
+        dir_cache_free(old);
+        old = next;
+      }
+    }
+  }
+  if (c != NULL && same_epoch && c->checked_epoch == dir_cache_epoch) {
+    c->next = dir_caches;
+    dir_caches = c;
+    return c;
+  }
+
+  struct stat st;
+  if (stat(dir, &st) != 0) {
+    if (c != NULL)
+      dir_cache_free(c);
+    return NULL;
+  }
+  if (c != NULL && (c->mtime.tv_sec != st.st_mtim.tv_sec ||
+                    c->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+    dir_cache_free(c);
+    c = NULL;
+  }
+
+  if (c == NULL) {
+    DIR *d = opendir(dir);
+    if (d == NULL)
+      return NULL;
+    c = calloc(1, sizeof(struct dir_cache));
+    c->path = strdup(dir);
+    c->mtime = st.st_mtim;
+    size_t len = 0, cap = 4096;
+    c->names = malloc(cap);
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        continue;
+      size_t l = strlen(ent->d_name) + 1;
+      if (len + l > cap) {
+        while (len + l > cap)
+          cap *= 2;
+        c->names = realloc(c->names, cap);
+      }
+      memcpy(c->names + len, ent->d_name, l);
+      len += l;
+      c->n++;
+    }
+    closedir(d);
+    c->sorted = malloc(sizeof(char *) * (c->n ? c->n : 1));
+    char *p = c->names;
+    for (long i = 0; i < c->n; i++, p += strlen(p) + 1)
+      c->sorted[i] = p;
+    qsort(c->sorted, c->n, sizeof(char *), comp_strcmp);
+  }
+
+  c->checked_epoch = dir_cache_epoch;
+  c->next = dir_caches;
+  dir_caches = c;
+  return c;
+}
+
+// complete the file name in word (may contain a directory part)
+static void comp_files(const char *word, int len, struct comp_result *r) {
+  char dir[4096];
+  const char *slash = memrchr(word, '/', len);
+  const char *base = slash ? slash + 1 : word;
+  int blen = len - (base - word);
+  if (slash == NULL)
+    strcpy(dir, ".");
+  else if (word[0] == '~' && (slash == word + 1))
+    snprintf(dir, sizeof(dir), "%s/", getenv("HOME") ? getenv("HOME") : "");
+  else
+    snprintf(dir, sizeof(dir), "%.*s", (int)(base - word), word);
+
+  struct dir_cache *c = dir_cache_get(dir, false);
+  if (c == NULL)
+    return;
+
+  // binary search for the first name >= base, then walk the matches
+  long lo = 0, hi = c->n;
+  char key[1024];
+  snprintf(key, sizeof(key), "%.*s", blen, base);
+  while (lo < hi) {
+    long mid = (lo + hi) / 2;
+    if (strcmp(c->sorted[mid], key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  long first = -1, last = -1;
+  for (long i = lo; i < c->n && strncmp(c->sorted[i], key, blen) == 0; i++) {
+    if (c->sorted[i][0] == '.' && blen == 0)
+      continue; // hidden files only when asked for
+    if (first < 0)
+      first = i;
+    last = i;
+    if (r->count < COMP_LIST_MAX)
+      r->list[r->count] = c->sorted[i];
+    r->count++;
+  }
+  if (first < 0)
+    return;
+
+  // in sorted order the common prefix of all is that of first and last
+  const char *a = c->sorted[first], *b = c->sorted[last];
+  int clen = 0;
+  while (a[clen] != '\0' && a[clen] == b[clen] && clen < (int)sizeof(r->common) - 1)
+    clen++;
+  memcpy(r->common, a, clen);
+  r->common[clen] = '\0';
+
+  if (r->count == 1) {
+    char full[8192];
+    struct stat st;
+    snprintf(full, sizeof(full), "%s/%s", dir, a);
+    r->unique_is_dir = stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+  }
+}
+
+// TAB in prompt(): complete the word before the cursor (buf[0..*index]).
+// When there is nothing more to add, the matches are listed on new lines,
+// returns true and the caller redraws the prompt.
+static bool complete_line(char *buf, int *index, int buf_size) {
+  int start = *index;
+  while (start > 0 && strchr(" \t|<>&;()", buf[start - 1]) == NULL)
+    start--;
+  int before = start;
+  while (before > 0 && (buf[before - 1] == ' ' || buf[before - 1] == '\t'))
+    before--;
+  const char *word = buf + start;
+  int len = *index - start;
+  // a command comes first, after | & ; ( and after reserved words like then
+  bool command_pos = before == 0 || strchr("|&;(", buf[before - 1]) != NULL;
+  if (!command_pos) {
+    static const char *const kws[] = {"{", "!", "if", "then", "else", "elif",
+                                      "while", "until", "do"};
+    int kw = before;
+    while (kw > 0 && strchr(" \t|&;()", buf[kw - 1]) == NULL)
+      kw--;
+    for (size_t i = 0; i < sizeof(kws) / sizeof(kws[0]); i++)
+      if ((size_t)(before - kw) == strlen(kws[i]) && strncmp(buf + kw, kws[i], before - kw) == 0)
+        command_pos = true;
+  }
+  command_pos = command_pos && memchr(word, '/', len) == NULL;
+
+  struct comp_result *r = calloc(1, sizeof(struct comp_result));
+  bool listed = false;
+  int base_len = len;
+  if (command_pos) {
+    comp_commands(word, len, r);
+  } else {
+    comp_files(word, len, r);
+    const char *slash = memrchr(word, '/', len);
+    base_len = slash ? len - (slash + 1 - word) : len;
+  }
+
+  if (r->count == 0) {
+    putchar('\a');
+  } else {
+    // add what all matches share (escaping characters the parser splits on)
+    char add[2048];
+    int n = 0;
+    for (const char *p = r->common + base_len; *p != '\0' && n < (int)sizeof(add) - 3; p++) {
+      if (strchr(" \t|<>&'\"\\", *p) != NULL)
+        add[n++] = '\\';
+      add[n++] = *p;
+    }
+    if (r->count == 1)
+      add[n++] = r->unique_is_dir ? '/' : ' ';
+
+    if (n > 0 && *index + n < buf_size - 2) {
+      memcpy(buf + *index, add, n);
+      *index += n;
+    } else if (r->count > 1) {
+      printf("\n");
+      for (long i = 0; i < r->count && i < COMP_LIST_MAX; i++)
+        printf("%s%s", r->list[i], i + 1 < r->count ? "  " : "");
+      if (r->count > COMP_LIST_MAX)
+        printf("... (%ld more)", r->count - COMP_LIST_MAX);
+      printf("\n");
+      listed = true;
+    }
+  }
+  fflush(stdout);
+  free(r->owned);
+  free(r);
+  return listed;
+}
+
+// state of the line being edited in prompt()
+struct line_editor {
+  char buf[4096];
+  int len, pos;       // bytes in buf, cursor offset
+  char prompt[4096];   // last line of the prompt, redrawn with the line
+  int prompt_len, prompt_width;
+  int prompt_lines;   // lines of a multi-line $PS1 above that one
+  int cols;           // terminal width
+  int scroll;         // first byte shown when the line is wider than that
+  char editbuf[4096]; // the line being typed while browsing the history
+  int edit_len;
+  long hist_pos;      // history entry shown by up/down, 0 if none
+};
+
+// display width of s[0..len): UTF-8 continuation bytes take no column
+static int text_width(const char *s, int len) {
+  int w = 0;
+  for (int i = 0; i < len; i++)
+    if (((unsigned char)s[i] & 0xC0) != 0x80)
+      w++;
+  return w;
+}
+
+// Redraw prompt and line with a single write(). A line wider than the
+// terminal scrolls horizontally so the cursor stays visible.
+static void editor_refresh(struct line_editor *e) {
+  int avail = e->cols - e->prompt_width - 1;
+  if (avail < 8)
+    avail = 8;
+  if (e->scroll > e->pos)
+    e->scroll = e->pos;
+  while (text_width(e->buf + e->scroll, e->pos - e->scroll) >= avail)
+    do
+      e->scroll++;
+    while (e->scroll < e->pos && ((unsigned char)e->buf[e->scroll] & 0xC0) == 0x80);
+  int end = e->scroll, w = 0;
+  while (end < e->len && (w < avail || ((unsigned char)e->buf[end] & 0xC0) == 0x80)) {
+    if (((unsigned char)e->buf[end] & 0xC0) != 0x80)
+      w++;
+    end++;
+  }
+
+  char out[sizeof(e->buf) + sizeof(e->prompt) + 64];
+  int n = 0;
+  out[n++] = '\r';
+  memcpy(out + n, e->prompt, e->prompt_len);
+  n += e->prompt_len;
+  memcpy(out + n, e->buf + e->scroll, end - e->scroll);
+  n += end - e->scroll;
+  n += sprintf(out + n, "\033[K\r");
+  int col = e->prompt_width + text_width(e->buf + e->scroll, e->pos - e->scroll);
+  if (col > 0)
+    n += sprintf(out + n, "\033[%dC", col);
+  term_write(out, n);
+}
+
+static void editor_insert(struct line_editor *e, const char *s, int n) {
+  if (e->len + n >= (int)sizeof(e->buf) - 1)
+    n = sizeof(e->buf) - 1 - e->len;
+  if (n <= 0)
+    return;
+  memmove(e->buf + e->pos + n, e->buf + e->pos, e->len - e->pos);
+  memcpy(e->buf + e->pos, s, n);
+  e->pos += n;
+  e->len += n;
+}
+
+// remove buf[from..to)
+static void editor_delete(struct line_editor *e, int from, int to) {
+  memmove(e->buf + from, e->buf + to, e->len - to);
+  e->len -= to - from;
+  if (e->pos > to)
+    e->pos -= to - from;
+  else if (e->pos > from)
+    e->pos = from;
+}
+
+static int editor_prev_char(struct line_editor *e, int i) {
+  while (i > 0 && ((unsigned char)e->buf[--i] & 0xC0) == 0x80)
+    ;
+  return i;
+}
+
+static int editor_next_char(struct line_editor *e, int i) {
+  while (i < e->len && ((unsigned char)e->buf[++i] & 0xC0) == 0x80)
+    ;
+  return i;
+}
+
+static int editor_word_left(struct line_editor *e) {
+  int i = e->pos;
+  while (i > 0 && e->buf[i - 1] == ' ')
+    i--;
+  while (i > 0 && e->buf[i - 1] != ' ')
+    i--;
+  return i;
+}
+
+static int editor_word_right(struct line_editor *e) {
+  int i = e->pos;
+  while (i < e->len && e->buf[i] == ' ')
+    i++;
+  while (i < e->len && e->buf[i] != ' ')
+    i++;
+  return i;
+}
+
+// up/down: replace the line with an older/newer history entry
+static void editor_history(struct line_editor *e, int dir) {
+  history_load();
+  if (e->hist_pos == 0) {
+    e->hist_pos = hist.count + 1;
+    memcpy(e->editbuf, e->buf, e->len);
+    e->edit_len = e->len;
+  }
+  long pos = e->hist_pos + dir;
+  struct hist_entry *h = history_get(pos);
+  if (h == NULL && pos != hist.count + 1)
+    return;
+  e->hist_pos = pos;
+  if (h != NULL) {
+    e->len = h->len < (int)sizeof(e->buf) - 2 ? h->len : (int)sizeof(e->buf) - 2;
+    memcpy(e->buf, h->line, e->len);
+  } else {
+    memcpy(e->buf, e->editbuf, e->edit_len);
+    e->len = e->edit_len;
+  }
+  e->pos = e->len;
+}
+
+// (re)build the prompt of the editor; continuation lines get "> ". The
+// lines of a multi-line $PS1 before the last one are printed here, once:
+// editor_refresh() only redraws the last line. redraw: the prompt is on
+// the screen already, go back up and print it over.
+static void editor_prompt(struct line_editor *e, bool continuation, bool redraw) {
+  char text[sizeof(e->prompt)];
+  int len;
+  if (continuation) {
+    len = strlen(strcpy(text, "> "));
+    e->prompt_width = len;
+  } else {
+    len = prompt_text(text, sizeof(text), &e->prompt_width);
+    if (len >= (int)sizeof(text))
+      len = sizeof(text) - 1;
+  }
+
+  char out[2 * sizeof(text) + 32];
+  int n = 0;
+  if (redraw && e->prompt_lines > 0)
+    n += sprintf(out, "\r\033[%dA", e->prompt_lines);
+  e->prompt_lines = 0;
+  int start = 0;
+  for (int i = 0; i < len; i++) {
+    if (text[i] != '\n')
+      continue;
+    // raw mode: \r\n, and clear what an older prompt left on the line
+    memcpy(out + n, text + start, i - start);
+    n += i - start;
+    n += sprintf(out + n, "\033[K\r\n");
+    e->prompt_lines++;
+    start = i + 1;
+  }
+  if (n > 0)
+    term_write(out, n);
+  e->prompt_len = len - start;
+  memcpy(e->prompt, text + start, e->prompt_len);
+}
+
+/**
+ * Prompt a command from the user
+ * @param  buf      [description]
+ * @param  buf_size [description]
+ * @return          [description]
+ */
+int prompt(struct node **tree) {
+  static struct line_editor e;
+  // lines of an unfinished construct (if ... without fi, a '|' at the end)
+  static char *pending = NULL;
+  *tree = NULL;
+
+  // raw mode: no line buffering, no echo, Ctrl-C/Ctrl-Z/Ctrl-S come in as
+  // bytes. The terminal settings are read once; the shell keeps them.
+  static struct termios backup_termios, raw_termios;
+  static bool have_termios = false;
+  if (!have_termios) {
+    tcgetattr(STDIN_FILENO, &backup_termios);
+    raw_termios = backup_termios;
+    raw_termios.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw_termios.c_iflag &= ~(IXON | ICRNL);
+    raw_termios.c_cc[VMIN] = 1;
+    raw_termios.c_cc[VTIME] = 0;
+    have_termios = true;
+  }
+  tcsetattr(STDIN_FILENO, TCSANOW, &raw_termios);
+
+  struct winsize ws;
+  e.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+  editor_prompt(&e, pending != NULL, false);
+  e.len = e.pos = e.scroll = 0;
+  e.hist_pos = 0;
+  editor_refresh(&e);
+
+  while (1) {
+    int c = read_key();
+
+    if (c == EOF) { // terminal went away
+      tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+      return EXIT;
+    }
+    if (c == '\r' || c == '\n') // ENTER
+      break;
+    if (c == KEY_REDRAW) { // a slow prompt segment is ready
+      editor_prompt(&e, pending != NULL, true);
+      editor_refresh(&e);
+      continue;
+    }
+
+    switch (c) {
+    case 4: // Ctrl-D: exit on an empty line, else delete under the cursor
+      if (e.len == 0 && pending != NULL) {
+        term_write("\r\n", 2);
+        tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+        fprintf(stderr, "-%s: syntax error: unexpected end of input\n", sysname);
+        free(pending);
+        pending = NULL;
+        return SUCCESS;
+      }
+      if (e.len == 0) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+        return EXIT;
+      }
+      // fall through
+    case KEY_DELETE:
+      if (e.pos < e.len)
+        editor_delete(&e, e.pos, editor_next_char(&e, e.pos));
+      break;
+    case 127: // backspace
+    case 8:
+      if (e.pos > 0)
+        editor_delete(&e, editor_prev_char(&e, e.pos), e.pos);
+      break;
+    case 3: // Ctrl-C: drop the line
+      term_write("^C\r\n", 4);
+      e.len = e.pos = e.scroll = 0;
+      e.hist_pos = 0;
+      if (pending != NULL) { // and the unfinished construct
+        free(pending);
+        pending = NULL;
+        tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+        return SUCCESS;
+      }
+      break;
+    case 1: // Ctrl-A
+    case KEY_HOME:
+      e.pos = 0;
+      break;
+    case 5: // Ctrl-E
+    case KEY_END:
+      e.pos = e.len;
+      break;
+    case 2: // Ctrl-B
+    case KEY_LEFT:
+      e.pos = editor_prev_char(&e, e.pos);
+      break;
+    case 6: // Ctrl-F
+    case KEY_RIGHT:
+      e.pos = editor_next_char(&e, e.pos);
+      break;
+    case KEY_WORD_LEFT:
+      e.pos = editor_word_left(&e);
+      break;
+    case KEY_WORD_RIGHT:
+      e.pos = editor_word_right(&e);
+      break;
+    case 23: // Ctrl-W
+    case KEY_WORD_BACKSPACE:
+      editor_delete(&e, editor_word_left(&e), e.pos);
+      break;
+    case KEY_WORD_DELETE:
+      editor_delete(&e, e.pos, editor_word_right(&e));
+      break;
+    case 11: // Ctrl-K: delete to the end
+      e.len = e.pos;
+      break;
+    case 21: // Ctrl-U: delete to the start
+      editor_delete(&e, 0, e.pos);
+      break;
+    case 12: // Ctrl-L: clear the screen
+      term_write("\033[H\033[2J", 7);
+      editor_prompt(&e, pending != NULL, false);
+      break;
+    case 16: // Ctrl-P
+    case KEY_UP:
+      editor_history(&e, -1);
+      break;
+    case 14: // Ctrl-N
+    case KEY_DOWN:
+      editor_history(&e, 1);
+      break;
+    case 18: // Ctrl-R: incremental reverse search
+      if (history_search(e.buf, &e.len, sizeof(e.buf))) {
+        e.pos = e.len;
+        goto done;
+      }
+      e.pos = e.len;
+      break;
+    case 9: { // TAB: complete the word before the cursor
+      char tail[sizeof(e.buf)];
+      int tail_len = e.len - e.pos;
+      memcpy(tail, e.buf + e.pos, tail_len);
+      if (complete_line(e.buf, &e.pos, sizeof(e.buf) - tail_len))
+        editor_prompt(&e, pending != NULL, false); // below the list
+      memcpy(e.buf + e.pos, tail, tail_len);
+      e.len = e.pos + tail_len;
+      break;
+    }
+    default:
+      if (c >= 32 && c < 256 && c != 127) {
+        // a paste comes in one read(): take all plain bytes at once
+        char text[sizeof(term_in.buf) + 1];
+        int n = 0;
+        text[n++] = c;
+        while (term_pending() && term_in.buf[term_in.pos] >= 32 &&
+               term_in.buf[term_in.pos] != 127)
+          text[n++] = term_in.buf[term_in.pos++];
+        editor_insert(&e, text, n);
+      }
+      break;
+    }
+
+    // with more input already buffered, redraw once at the end
+    if (!term_pending())
+      editor_refresh(&e);
+  }
+
+done:
+  e.pos = e.len;
+  editor_refresh(&e);
+  term_write("\r\n", 2);
+  e.buf[e.len] = '\0';
+
+  // restore terminal settings before executing
+  tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+
+  // !!, !n and !prefix are replaced by the history entry
+  char *expanded = history_expand(e.buf);
+  char *line = expanded ? expanded : e.buf;
+  if (expanded != NULL && expanded[0] != '\0')
+    printf("%s\n", expanded);
+
+  // save command in the history
+  history_add(line);
+
+  // fill command tree from input string; an unfinished construct waits
+  // for more lines
+  if (pending != NULL) {
+    size_t n = strlen(pending);
+    pending = realloc(pending, n + strlen(line) + 2);
+    pending[n] = '\n';
+    strcpy(pending + n + 1, line);
+  } else {
+    pending = strdup(line);
+  }
+  free(expanded);
+  int parsed = parse_command(pending, tree);
+  if (parsed != PARSE_INCOMPLETE) {
+    free(pending);
+    pending = NULL;
+  }
+  return parsed == -1 ? UNKNOWN : SUCCESS;
+}
+
+// PATH lookup cache (like bash's `hash` table).
+// Every command found in PATH is remembered here, so we don't call access()
+// on each PATH directory again for every command. The table is dropped when
+// PATH changes or when one of the PATH directories gets a new mtime.
+#define PATH_HASH_BUCKETS 256
+
+struct path_dir {
+  char *dir;
+  struct timespec mtime;
+  unsigned long checked_epoch; // last epoch we called stat() for this dir
+};
+
+struct path_hash_entry {
+  char *name;
+  char *full_path;
+  int dir_index; // index in path_dirs where the command was found
+  int hits;
+  struct path_hash_entry *next;
+};
+
+static struct path_hash_entry *path_hash[PATH_HASH_BUCKETS];
+static struct path_dir *path_dirs = NULL;
+static int path_dir_count = 0;
+static char *path_cached_env = NULL; // PATH value that path_dirs was built from
+
+// Each command line gets a new epoch, so a PATH directory is stat'ed at most
+// once per line (and not once per pipeline stage).
+static unsigned long path_epoch = 1;
+
+static unsigned int path_hash_index(const char *s) {
+  unsigned int h = 2166136261u; // FNV-1a
+  for (; *s != '\0'; s++) {
+    h ^= (unsigned char)*s;
+    h *= 16777619u;
+  }
+  return h % PATH_HASH_BUCKETS;
+}
+
+// forget all remembered commands
+static void path_hash_clear(void) {
+  for (int i = 0; i < PATH_HASH_BUCKETS; i++) {
+    struct path_hash_entry *e = path_hash[i];
+    while (e != NULL) {
+      struct path_hash_entry *next = e->next;
+      free(e->name);
+      free(e->full_path);
+      free(e);
+      e = next;
+    }
+    path_hash[i] = NULL;
+  }
+}
+
+static void path_dirs_reset(void) {
+  for (int i = 0; i < path_dir_count; i++)
+    free(path_dirs[i].dir);
+  free(path_dirs);
+  free(path_cached_env);
+  path_dirs = NULL;
+  path_dir_count = 0;
+  path_cached_env = NULL;
+}
+
+// check if directory i was modified since we last looked at it
+static bool path_dir_changed(int i) {
+  struct path_dir *d = &path_dirs[i];
+  if (d->checked_epoch == path_epoch)
+    return false;
+  d->checked_epoch = path_epoch;
+
+  struct stat st;
+  if (stat(d->dir, &st) != 0)
+    memset(&st, 0, sizeof(st));
+  if (st.st_mtim.tv_sec == d->mtime.tv_sec &&
+      st.st_mtim.tv_nsec == d->mtime.tv_nsec)
+    return false;
+  d->mtime = st.st_mtim;
+  return true;
+}
+
+// make sure path_dirs matches current PATH, return -1 if PATH is not set
+static int path_cache_sync(void) {
+  char *path_env = getenv("PATH");
+  if (path_env == NULL) {
+    path_hash_clear();
+    path_dirs_reset();
+    return -1;
+  }
+  if (path_cached_env != NULL && strcmp(path_cached_env, path_env) == 0)
+    return 0;
+
+  // PATH changed: everything we remembered may be wrong now
+  path_hash_clear();
+  path_dirs_reset();
+  path_cached_env = strdup(path_env);
+  if (path_cached_env == NULL)
+    return -1;
+
+  // split PATH by ':' (empty entries are skipped)
+  for (const char *p = path_env; *p != '\0';) {
+    const char *colon = strchr(p, ':');
+    size_t len = colon ? (size_t)(colon - p) : strlen(p);
+    if (len > 0) {
+      path_dirs = realloc(path_dirs, sizeof(struct path_dir) * (path_dir_count + 1));
+      struct path_dir *d = &path_dirs[path_dir_count++];
+      d->dir = strndup(p, len);
+      d->checked_epoch = 0;
+      memset(&d->mtime, 0, sizeof(d->mtime));
+      path_dir_changed(path_dir_count - 1); // record initial mtime
+    }
+    if (colon == NULL)
+      break;
+    p = colon + 1;
+  }
+  return 0;
+}
+
+// This function tries to find full path of a command using PATH env.
+// We need this because we use execv (not execvp).
+// Returned string is malloc'ed, caller must free it.
+static char *resolve_path(const char *cmd) {
+
+  // if command already has '/', we treat it as a path
+  if (strchr(cmd, '/') != NULL) {
+    return strdup(cmd);
+  }
+
+  if (path_cache_sync() != 0)
+    return NULL;
+
+  // fast path: command is already in the table
+  unsigned int h = path_hash_index(cmd);
+  for (struct path_hash_entry *e = path_hash[h]; e != NULL; e = e->next) {
+    if (strcmp(e->name, cmd) != 0)
+      continue;
+
+    // if an earlier directory changed, cmd may now be shadowed there;
+    // if its own directory changed, cmd may have been removed
+    bool stale = false;
+    for (int i = 0; i <= e->dir_index; i++)
+      if (path_dir_changed(i))
+        stale = true;
+    if (!stale) {
+      e->hits++;
+      return strdup(e->full_path);
+    }
+    path_hash_clear();
+    break;
+  }
+
+  char candidate[PATH_MAX];
+
+  // slow path: try each directory in PATH
+  for (int i = 0; i < path_dir_count; i++) {
+    if (path_dir_changed(i))
+      path_hash_clear();
+
+    snprintf(candidate, sizeof(candidate), "%s/%s", path_dirs[i].dir, cmd);
+
+    // check if file exists and executable
+    if (access(candidate, X_OK) == 0) {
+      struct path_hash_entry *e = malloc(sizeof(struct path_hash_entry));
+      e->name = strdup(cmd);
+      e->full_path = strdup(candidate);
+      e->dir_index = i;
+      e->hits = 1;
+      e->next = path_hash[h];
+      path_hash[h] = e;
+      return strdup(candidate);
+    }
+  }
+
+  return NULL;
+}
+
+// Builtin command: hash [-r] [name ...]
+// Without arguments prints the remembered commands, -r forgets all of them,
+// and names are looked up and added to the table.
+static int builtin_hash(struct command_t *command) {
+  if (command->args[1] != NULL && strcmp(command->args[1], "-r") == 0) {
+    path_hash_clear();
+    return SUCCESS;
+  }
+
+  if (command->args[1] != NULL) {
+    int status = 0;
+    for (int i = 1; command->args[i] != NULL; i++) {
+      char *full_path = resolve_path(command->args[i]);
+      if (full_path == NULL) {
+        fprintf(stderr, "-%s: hash: %s: not found\n", sysname, command->args[i]);
+        status = 1;
+      }
+      free(full_path);
+    }
+    return status;
+  }
+
+  int shown = 0;
+  for (int i = 0; i < PATH_HASH_BUCKETS; i++) {
+    for (struct path_hash_entry *e = path_hash[i]; e != NULL; e = e->next) {
+      if (shown++ == 0)
+        printf("hits\tcommand\n");
+      printf("%4d\t%s\n", e->hits, e->full_path);
+    }
+  }
+  if (shown == 0)
+    printf("%s: hash table empty\n", sysname);
+  return SUCCESS;
+}
+
+// Open the files of <, >, >> redirections (without touching stdin/stdout).
+// fds[0] gets the input file and fds[1] the output file, -1 if not given.
+// Files are opened with O_CLOEXEC, so they don't leak into exec'ed commands.
+// Returns -1 (after printing the error) if a file cannot be opened.
+static int open_redirects(struct command_t *command, int fds[2]) {
+  fds[0] = fds[1] = -1;
+
+  // input redirection: <file
+  if (command->redirects[0] != NULL) {
+    fds[0] = open(command->redirects[0], O_RDONLY | O_CLOEXEC);
+    if (fds[0] < 0) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[0], strerror(errno));
+      return -1;
+    }
+  }
+
+  // output append redirection: >>file
+  // output overwrite redirection: >file
+  const char *out = NULL;
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  if (command->redirects[2] != NULL) {
+    out = command->redirects[2];
+    flags |= O_APPEND;
+  } else if (command->redirects[1] != NULL) {
+    out = command->redirects[1];
+    flags |= O_TRUNC;
+  }
+  if (out != NULL) {
+    fds[1] = open(out, flags, 0644);
+    if (fds[1] < 0) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, out, strerror(errno));
+      if (fds[0] != -1) close(fds[0]);
+      fds[0] = -1;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Apply <, >, >> redirections by opening files and dup2 to stdin/stdout
+// (used in forked children, exits on error)
+// _exit is used in children: exit() would flush the shell's stdin buffer
+// and move the file offset of a script we are reading.
+static void apply_redirects(struct command_t *command) {
+  int fds[2];
+  if (open_redirects(command, fds) != 0)
+    _exit(1);
+
+  for (int i = 0; i < 2; i++) {
+    if (fds[i] == -1)
+      continue;
+    // replace stdin/stdout with file
+    if (dup2(fds[i], i) < 0) {
+      fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
+      _exit(1);
+    }
+    close(fds[i]);
+  }
+}
+
+// simple helper: parse a positive integer, return -1 if not valid
+static int parse_positive_int(const char *s) {
+  if (s == NULL || *s == '\0') return -1;
+  int x = 0;
+  for (int i = 0; s[i] != '\0'; i++) {
+    if (s[i] < '0' || s[i] > '9') return -1;
+    x = x * 10 + (s[i] - '0');
+  }
+  return x;
+}
+
+// ---- job control ----
+//
+// Every command line that starts processes becomes a job. A SIGCHLD handler
+// reaps children as soon as they change state (so no zombies are left
+// until the next command) and sends (pid, status, rusage) through a
+// self-pipe; the main loop reads the pipe and updates the job table.
+// When stdin is a terminal every job gets its own process group and the
+// foreground job owns the terminal.
+
+struct child_event {
+  pid_t pid;
+  int status;
+  struct rusage ru;
+};
+
+enum job_state { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+struct job_proc {
+  pid_t pid;
+  bool done;
+  bool stopped;
+  int status;        // wait status, valid when done
+  struct rusage ru;  // resources used, valid when done
+  struct timespec end;
+  int stage;         // index in the pipe chain
+  char *name;        // command name of the stage
+};
+
+struct job {
+  int id;
+  pid_t pgid;
+  char *cmdline;
+  struct job_proc *procs;
+  int nprocs;
+  int procs_cap;
+  int ndone;                // procs that exited
+  int nstopped;             // procs that are stopped
+  enum job_state state;
+  bool background;
+  bool notify;              // state changed and was not reported yet
+  bool has_tmodes;
+  struct termios tmodes;    // terminal settings of a stopped job
+  struct timespec start;
+  struct timespec end;
+  int nstages;              // commands in the pipe chain (threads included)
+  struct job *next;
+};
+
+static struct job *job_list = NULL;
+static int sigchld_pipe[2] = {-1, -1};
+
+// pid -> process of a job, so a child event is found without walking all
+// jobs (a pipe chain may have hundreds of stages). Open addressing with
+// linear probing; the size is a power of two and kept at most half full.
+struct proc_ref {
+  pid_t pid;             // 0: empty slot
+  struct job *job;
+  int index;             // in job->procs
+};
+
+// exit status of the last foreground command line ($?) and of each stage
+// of it (${PIPESTATUS[n]}). With pipefail, $? is the last non-zero stage.
+static int last_status = 0;
+static int *pipe_status = NULL;
+static int pipe_status_n = 0;
+static int pipe_status_cap = 0;
+static bool pipefail = false;
+static pid_t last_bg_pid = 0; // $!
+// a foreground command was killed by Ctrl-C (or the shell got SIGINT while
+// running a builtin): the rest of the command line (a loop...) is skipped
+static volatile sig_atomic_t interrupted = 0;
+
+static struct proc_ref *proc_index = NULL;
+static size_t proc_index_size = 0;
+static size_t proc_index_used = 0;
+static bool job_control = false; // interactive: process groups + terminal
+static pid_t shell_pgid;
+static struct termios shell_tmodes;
+
+// signals the interactive shell ignores; children get the default back
+static const int job_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGPIPE};
+#define JOB_SIGNALS_N (int)(sizeof(job_signals) / sizeof(job_signals[0]))
+
+static void sigint_handler(int sig) {
+  (void)sig;
+  interrupted = 1;
+}
+
+static void sigchld_handler(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  struct child_event ev;
+  // reap everything now; the record is picked up by jobs_read_events()
+  while ((ev.pid = wait4(-1, &ev.status, WNOHANG | WUNTRACED | WCONTINUED, &ev.ru)) > 0)
+    write(sigchld_pipe[1], &ev, sizeof(ev));
+  errno = saved_errno;
+}
+
+// interactive is false for -c, scripts and non-terminal stdin: then there
+// is no job control even if stdin happens to be a terminal
+static void jobs_init(bool interactive) {
+  if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == 0)
+    fcntl(sigchld_pipe[1], F_SETPIPE_SZ, 1024 * 1024); // room for many events
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sigchld_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, NULL);
+
+  if (!interactive || !isatty(STDIN_FILENO))
+    return;
+
+  // wait until we are in the foreground, then take our own process group
+  while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+    kill(-shell_pgid, SIGTTIN);
+  for (int i = 0; i < JOB_SIGNALS_N; i++)
+    signal(job_signals[i], SIG_IGN);
+  // Ctrl-C while a builtin runs in the shell stops the loop around it
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sigint_handler;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGINT, &sa, NULL);
+  setpgid(0, 0);
+  shell_pgid = getpgrp();
+  tcsetpgrp(STDIN_FILENO, shell_pgid);
+  tcgetattr(STDIN_FILENO, &shell_tmodes);
+  job_control = true;
+}
+
+// In a forked child: join process group pgid (0: a new group) and take
+// the terminal if it leads a foreground job, then undo the signal setup of
+// the shell (tcsetpgrp must come first, while SIGTTOU is still ignored).
+static void job_child_setup(pid_t pgid, bool foreground) {
+  if (job_control) {
+    setpgid(0, pgid);
+    if (foreground && pgid == 0)
+      tcsetpgrp(STDIN_FILENO, getpgrp());
+  }
+  for (int i = 0; i < JOB_SIGNALS_N; i++)
+    signal(job_signals[i], SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+}
+
+// text of a command line, used in job listings
+static char *command_to_string(struct command_t *command) {
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream(&buf, &len);
+  if (f == NULL)
+    return strdup(command->name);
+
+  for (struct command_t *c = command; c != NULL; c = c->next) {
+    if (c != command) fputs(" | ", f);
+    for (int i = 0; c->args[i] != NULL; i++)
+      fprintf(f, i ? " %s" : "%s", c->args[i]);
+    if (c->redirects[0]) fprintf(f, " <%s", c->redirects[0]);
+    if (c->redirects[1]) fprintf(f, " >%s", c->redirects[1]);
+    if (c->redirects[2]) fprintf(f, " >>%s", c->redirects[2]);
+  }
+  fclose(f);
+  return buf;
+}
+
+static struct job *job_new(struct command_t *command) {
+  struct job *j = calloc(1, sizeof(struct job));
+  int id = 0;
+  struct job **tail = &job_list;
+  for (; *tail != NULL; tail = &(*tail)->next)
+    if ((*tail)->id > id) id = (*tail)->id;
+  j->id = id + 1;
+  j->cmdline = command_to_string(command);
+  j->background = command->background;
+  for (struct command_t *c = command; c != NULL; c = c->next)
+    j->nstages++;
+  clock_gettime(CLOCK_MONOTONIC, &j->start);
+  *tail = j; // jobs are kept in creation order
+  return j;
+}
+
+static size_t proc_index_slot(pid_t pid) {
+  return ((size_t)pid * 2654435761u) & (proc_index_size - 1);
+}
+
+static void proc_index_put(pid_t pid, struct job *job, int index) {
+  if (2 * (proc_index_used + 1) > proc_index_size) {
+    // grow and move the entries over
+    struct proc_ref *old = proc_index;
+    size_t old_size = proc_index_size;
+    proc_index_size = old_size ? old_size * 2 : 64;
+    proc_index = calloc(proc_index_size, sizeof(struct proc_ref));
+    proc_index_used = 0;
+    for (size_t i = 0; i < old_size; i++)
+      if (old[i].pid != 0)
+        proc_index_put(old[i].pid, old[i].job, old[i].index);
+    free(old);
+  }
+  size_t i = proc_index_slot(pid);
+  while (proc_index[i].pid != 0 && proc_index[i].pid != pid)
+    i = (i + 1) & (proc_index_size - 1);
+  if (proc_index[i].pid == 0)
+    proc_index_used++;
+  proc_index[i] = (struct proc_ref){pid, job, index};
+}
+
+static struct proc_ref *proc_index_get(pid_t pid) {
+  if (proc_index_size == 0)
+    return NULL;
+  for (size_t i = proc_index_slot(pid); proc_index[i].pid != 0;
+       i = (i + 1) & (proc_index_size - 1))
+    if (proc_index[i].pid == pid)
+      return &proc_index[i];
+  return NULL;
+}
+
+static void proc_index_del(pid_t pid) {
+  struct proc_ref *r = proc_index_get(pid);
+  if (r == NULL)
+    return;
+  // backward shift: move later entries of the probe run into the hole
+  size_t hole = (size_t)(r - proc_index), mask = proc_index_size - 1;
+  for (size_t i = (hole + 1) & mask; proc_index[i].pid != 0; i = (i + 1) & mask) {
+    size_t home = proc_index_slot(proc_index[i].pid);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      proc_index[hole] = proc_index[i];
+      hole = i;
+    }
+  }
+  proc_index[hole].pid = 0;
+  proc_index_used--;
+}
+
+static void job_add_proc(struct job *j, pid_t pid, int stage, const char *name) {
+  if (j->nprocs == j->procs_cap) {
+    j->procs_cap = j->procs_cap ? 2 * j->procs_cap : 4;
+    j->procs = realloc(j->procs, sizeof(struct job_proc) * j->procs_cap);
+  }
+  proc_index_put(pid, j, j->nprocs);
+  struct job_proc *p = &j->procs[j->nprocs++];
+  memset(p, 0, sizeof(struct job_proc));
+  p->pid = pid;
+  p->stage = stage;
+  p->name = strdup(name);
+  if (j->pgid == 0)
+    j->pgid = pid; // first process leads the process group
+}
+
+static void job_remove(struct job *j) {
+  for (struct job **p = &job_list; *p != NULL; p = &(*p)->next) {
+    if (*p == j) {
+      *p = j->next;
+      break;
+    }
+  }
+  free(j->cmdline);
+  for (int i = 0; i < j->nprocs; i++) {
+    proc_index_del(j->procs[i].pid);
+    free(j->procs[i].name);
+  }
+  free(j->procs);
+  free(j);
+}
+
+static void job_update_state(struct job *j) {
+  bool running = j->ndone + j->nstopped < j->nprocs;
+  enum job_state state = running ? JOB_RUNNING : j->nstopped > 0 ? JOB_STOPPED : JOB_DONE;
+  if (state != j->state) {
+    j->state = state;
+    j->notify = true;
+    if (state == JOB_DONE)
+      clock_gettime(CLOCK_MONOTONIC, &j->end);
+  }
+}
+
+static void job_apply_event(const struct child_event *ev) {
+  struct proc_ref *r = proc_index_get(ev->pid);
+  if (r == NULL)
+    return; // not ours (e.g. chatroom helper processes)
+  struct job *j = r->job;
+  struct job_proc *p = &j->procs[r->index];
+  if (p->done)
+    return;
+
+  if (WIFSTOPPED(ev->status)) {
+    if (!p->stopped) j->nstopped++;
+    p->stopped = true;
+  } else if (WIFCONTINUED(ev->status)) {
+    if (p->stopped) j->nstopped--;
+    p->stopped = false;
+  } else {
+    if (p->stopped) j->nstopped--;
+    p->stopped = false;
+    p->done = true;
+    j->ndone++;
+    p->status = ev->status;
+    p->ru = ev->ru;
+    clock_gettime(CLOCK_MONOTONIC, &p->end);
+  }
+  job_update_state(j);
+}
+
+// Read child events from the SIGCHLD pipe and update the job table.
+// If block is true, wait until at least one event is there.
+static void jobs_read_events(bool block) {
+  if (block) {
+    struct pollfd pfd = {sigchld_pipe[0], POLLIN, 0};
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {}
+  }
+  struct child_event ev;
+  while (read(sigchld_pipe[0], &ev, sizeof(ev)) == (ssize_t)sizeof(ev))
+    job_apply_event(&ev);
+}
+
+static void job_signal(struct job *j, int sig) {
+  if (job_control && j->pgid > 0) {
+    kill(-j->pgid, sig);
+    return;
+  }
+  for (int i = 0; i < j->nprocs; i++)
+    if (!j->procs[i].done)
+      kill(j->procs[i].pid, sig);
+}
+
+// wait status of the job: status of its last process
+static int job_status(struct job *j) {
+  return j->nprocs > 0 ? j->procs[j->nprocs - 1].status : 0;
+}
+
+// exit code of a wait status, as a shell reports it (128 + signal)
+static int status_code(int status) {
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+// start the statuses of a new command line of n stages, all 0
+static void pipe_status_reset(int n) {
+  if (n > pipe_status_cap) {
+    pipe_status_cap = n;
+    pipe_status = realloc(pipe_status, sizeof(int) * n);
+  }
+  memset(pipe_status, 0, sizeof(int) * n);
+  pipe_status_n = n;
+}
+
+// statuses of the processes of a job that was waited for in the foreground
+static void job_pipe_status(struct job *j) {
+  for (int i = 0; i < j->nprocs; i++) {
+    struct job_proc *p = &j->procs[i];
+    if (p->stage < pipe_status_n)
+      pipe_status[p->stage] = p->done ? status_code(p->status) : 128 + SIGTSTP;
+    if (p->done && WIFSIGNALED(p->status) && WTERMSIG(p->status) == SIGINT)
+      interrupted = 1;
+  }
+}
+
+// $? from the stage statuses
+static void pipe_status_done(void) {
+  last_status = pipe_status_n > 0 ? pipe_status[pipe_status_n - 1] : 0;
+  for (int i = pipe_status_n - 1; pipefail && last_status == 0 && i >= 0; i--)
+    last_status = pipe_status[i];
+}
+
+static void job_state_text(struct job *j, char *buf, size_t size) {
+  if (j->state == JOB_RUNNING) {
+    snprintf(buf, size, "Running");
+  } else if (j->state == JOB_STOPPED) {
+    snprintf(buf, size, "Stopped");
+  } else {
+    int st = job_status(j);
+    if (WIFSIGNALED(st))
+      snprintf(buf, size, "%s", strsignal(WTERMSIG(st)));
+    else if (WEXITSTATUS(st) != 0)
+      snprintf(buf, size, "Exit %d", WEXITSTATUS(st));
+    else
+      snprintf(buf, size, "Done");
+  }
+}
+
+static double timeval_sec(struct timeval tv) {
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+static double timespec_diff(struct timespec a, struct timespec b) {
+  return (double)(b.tv_sec - a.tv_sec) + (double)(b.tv_nsec - a.tv_nsec) / 1e9;
+}
+
+// print one job like: [1]+  Running   sleep 10 &
+// verbose adds one line per process with its status and resource usage
+static void job_print(struct job *j, bool verbose) {
+  char state[64];
+  job_state_text(j, state, sizeof(state));
+  char mark = j->next == NULL ? '+' : (j->next->next == NULL ? '-' : ' ');
+  printf("[%d]%c  %-22s %s%s\n", j->id, mark, state, j->cmdline,
+         j->background && j->state == JOB_RUNNING ? " &" : "");
+
+  if (!verbose) return;
+  for (int i = 0; i < j->nprocs; i++) {
+    struct job_proc *p = &j->procs[i];
+    if (!p->done) {
+      printf("      %-8d %s\n", p->pid, p->stopped ? "stopped" : "running");
+      continue;
+    }
+    printf("      %-8d exit %-3d user %.3fs sys %.3fs maxrss %ld kB\n", p->pid,
+           status_code(p->status),
+           timeval_sec(p->ru.ru_utime), timeval_sec(p->ru.ru_stime), p->ru.ru_maxrss);
+  }
+  if (j->state == JOB_DONE) {
+    printf("      wall %.3fs\n", timespec_diff(j->start, j->end));
+  }
+}
+
+// report background jobs that finished or stopped since the last prompt
+static void jobs_notify(void) {
+  jobs_read_events(false);
+  struct job *j = job_list;
+  while (j != NULL) {
+    struct job *next = j->next;
+    if (j->notify && j->background) {
+      job_print(j, false);
+      j->notify = false;
+      if (j->state == JOB_DONE)
+        job_remove(j);
+    }
+    j = next;
+  }
+  fflush(stdout);
+}
+
+static void stats_job_waited(struct job *j); // in the stats section below
+
+// Wait for a foreground job until it finishes or is stopped (Ctrl-Z).
+// The job gets the terminal while it runs.
+static void job_wait_fg(struct job *j) {
+  if (job_control) tcsetpgrp(STDIN_FILENO, j->pgid);
+  while (j->state == JOB_RUNNING)
+    jobs_read_events(true);
+
+  if (job_control) {
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    if (j->state == JOB_STOPPED) {
+      tcgetattr(STDIN_FILENO, &j->tmodes);
+      j->has_tmodes = true;
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+  }
+  stats_job_waited(j);
+
+  if (j->state == JOB_STOPPED) {
+    j->background = true;
+    j->notify = false;
+    printf("\n");
+    job_print(j, false);
+  }
+}
+
+// continue a stopped job in the foreground (give it the terminal back)
+static void job_continue(struct job *j) {
+  j->background = false;
+  if (job_control) {
+    tcsetpgrp(STDIN_FILENO, j->pgid);
+    if (j->has_tmodes)
+      tcsetattr(STDIN_FILENO, TCSADRAIN, &j->tmodes);
+  }
+  job_signal(j, SIGCONT);
+  for (int i = 0; i < j->nprocs; i++)
+    j->procs[i].stopped = false;
+  j->nstopped = 0;
+  job_update_state(j);
+  j->notify = false;
+}
+
+// find job by "%n", "%%", "%+", "%-" or a pid of one of its processes
+static struct job *job_find(const char *spec) {
+  struct job *last = NULL, *prev = NULL;
+  for (struct job *j = job_list; j != NULL; j = j->next) {
+    prev = last;
+    last = j;
+  }
+  if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 || strcmp(spec, "%") == 0)
+    return last;
+  if (strcmp(spec, "%-") == 0)
+    return prev;
+
+  bool is_jobspec = spec[0] == '%';
+  int n = parse_positive_int(is_jobspec ? spec + 1 : spec);
+  if (n <= 0) return NULL;
+  if (!is_jobspec) {
+    struct proc_ref *r = proc_index_get(n);
+    return r != NULL ? r->job : NULL;
+  }
+  for (struct job *j = job_list; j != NULL; j = j->next)
+    if (j->id == n) return j;
+  return NULL;
+}
+
+// Builtin command: jobs [-l]
+static int builtin_jobs(struct command_t *command) {
+  bool verbose = command->args[1] != NULL && strcmp(command->args[1], "-l") == 0;
+  jobs_read_events(false);
+  struct job *j = job_list;
+  while (j != NULL) {
+    struct job *next = j->next;
+    job_print(j, verbose);
+    j->notify = false;
+    if (j->state == JOB_DONE)
+      job_remove(j); // reported, forget it
+    j = next;
+  }
+  return SUCCESS;
+}
+
+// Builtin commands: fg [%n] and bg [%n]
+static int builtin_fg_bg(struct command_t *command, bool foreground) {
+  jobs_read_events(false);
+  struct job *j = job_find(command->args[1]);
+  if (j == NULL || j->state == JOB_DONE) {
+    fprintf(stderr, "-%s: %s: %s: no such job\n", sysname, command->name,
+            command->args[1] ? command->args[1] : "current");
+    pipe_status[0] = 1;
+    return SUCCESS;
+  }
+
+  if (!foreground) {
+    j->background = true;
+    job_signal(j, SIGCONT);
+    printf("[%d]  %s &\n", j->id, j->cmdline);
+    return SUCCESS;
+  }
+
+  printf("%s\n", j->cmdline);
+  fflush(stdout);
+  job_continue(j);
+  job_wait_fg(j);
+  pipe_status_reset(j->nstages);
+  job_pipe_status(j);
+  if (j->state == JOB_DONE)
+    job_remove(j);
+  return SUCCESS;
+}
+
+// Builtin command: wait [%n | pid ...]
+// Without arguments waits for all running background jobs.
+static int builtin_wait(struct command_t *command) {
+  jobs_read_events(false);
+
+  if (command->args[1] == NULL) {
+    while (1) {
+      bool running = false;
+      for (struct job *j = job_list; j != NULL; j = j->next)
+        if (j->state == JOB_RUNNING) running = true;
+      if (!running) break;
+      jobs_read_events(true);
+    }
+    struct job *j = job_list;
+    while (j != NULL) {
+      struct job *next = j->next;
+      if (j->state == JOB_DONE) job_remove(j);
+      j = next;
+    }
+    return SUCCESS;
+  }
+
+  for (int i = 1; command->args[i] != NULL; i++) {
+    struct job *j = job_find(command->args[i]);
+    if (j == NULL) {
+      fprintf(stderr, "-%s: wait: %s: no such job\n", sysname, command->args[i]);
+      pipe_status[0] = 1;
+      continue;
+    }
+    while (j->state == JOB_RUNNING)
+      jobs_read_events(true);
+    if (j->state == JOB_DONE)
+      job_remove(j);
+  }
+  return SUCCESS;
+}
+
+static const struct {
+  const char *name;
+  int sig;
+} signal_names[] = {
+    {"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+    {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+};
+#define SIGNAL_NAMES_N (int)(sizeof(signal_names) / sizeof(signal_names[0]))
+
+// "9", "KILL" or "SIGKILL" -> signal number, -1 if unknown
+static int parse_signal(const char *s) {
+  int n = parse_positive_int(s);
+  if (n >= 0) return n;
+  if (strncmp(s, "SIG", 3) == 0) s += 3;
+  for (int i = 0; i < SIGNAL_NAMES_N; i++)
+    if (strcasecmp(s, signal_names[i].name) == 0)
+      return signal_names[i].sig;
+  return -1;
+}
+
+// Builtin command: kill [-SIG | -s SIG | -l] (%n | pid) ...
+static int builtin_kill(struct command_t *command) {
+  int sig = SIGTERM;
+  int i = 1;
+
+  if (command->args[1] != NULL && strcmp(command->args[1], "-l") == 0) {
+    for (int k = 0; k < SIGNAL_NAMES_N; k++)
+      printf("%2d) SIG%s\n", signal_names[k].sig, signal_names[k].name);
+    return SUCCESS;
+  }
+  if (command->args[i] != NULL && strcmp(command->args[i], "-s") == 0 && command->args[i + 1] != NULL) {
+    sig = parse_signal(command->args[i + 1]);
+    i += 2;
+  } else if (command->args[i] != NULL && command->args[i][0] == '-' && command->args[i][1] != '\0') {
+    sig = parse_signal(command->args[i] + 1);
+    i++;
+  }
+  if (sig < 0) {
+    fprintf(stderr, "-%s: kill: invalid signal\n", sysname);
+    pipe_status[0] = 2;
+    return SUCCESS;
+  }
+  if (command->args[i] == NULL) {
+    fprintf(stderr, "-%s: kill: usage: kill [-SIG | -s SIG | -l] (%%n | pid) ...\n", sysname);
+    pipe_status[0] = 2;
+    return SUCCESS;
+  }
+
+  for (; command->args[i] != NULL; i++) {
+    const char *target = command->args[i];
+    if (target[0] == '%') {
+      struct job *j = job_find(target);
+      if (j == NULL) {
+        fprintf(stderr, "-%s: kill: %s: no such job\n", sysname, target);
+        pipe_status[0] = 1;
+        continue;
+      }
+      job_signal(j, sig);
+      if (sig == SIGKILL || sig == SIGTERM)
+        job_signal(j, SIGCONT); // a stopped job must run to die
+      continue;
+    }
+    int pid = parse_positive_int(target);
+    if (pid <= 0) {
+      fprintf(stderr, "-%s: kill: %s: arguments must be process or job IDs\n", sysname, target);
+      pipe_status[0] = 1;
+      continue;
+    }
+    if (kill(pid, sig) != 0) {
+      fprintf(stderr, "-%s: kill: (%d) - %s\n", sysname, pid, strerror(errno));
+      pipe_status[0] = 1;
+    }
+  }
+  return SUCCESS;
+}
+
+// Start an external command with posix_spawn instead of fork + execv.
+// environment of a command: environ with its NAME=value prefixes on top
+// (in the line arena)
+static char **command_env(struct command_t *command) {
+  if (command->assigns == NULL)
+    return environ;
+  int n = 0, na = 0;
+  while (environ[n] != NULL)
+    n++;
+  while (command->assigns[na] != NULL)
+    na++;
+  char **env = arena_alloc(&line_arena, sizeof(char *) * (n + na + 1)), **e = env;
+  for (int i = 0; i < n; i++) {
+    size_t len = strcspn(environ[i], "=");
+    bool replaced = false;
+    for (int k = 0; k < na && !replaced; k++)
+      replaced = strncmp(command->assigns[k], environ[i], len + 1) == 0;
+    if (!replaced)
+      *e++ = environ[i];
+  }
+  for (int k = 0; k < na; k++)
+    *e++ = command->assigns[k];
+  *e = NULL;
+  return env;
+}
+
+// glibc implements posix_spawn with clone(CLONE_VM | CLONE_VFORK), so the
+// shell's page tables are not copied for every command.
+// in_fd/out_fd are pipe ends that become stdin/stdout (-1 to keep ours);
+// <, > and >> redirections override them. The pipe fds must be O_CLOEXEC,
+// so the child only keeps the copies on 0 and 1.
+// With job control the child joins process group pgid (0: a new group led
+// by the child, which also gets the terminal if foreground is true).
+// Returns pid of the child or -1 (after printing the error).
+static pid_t spawn_command(struct command_t *command, const char *full_path,
+                           int in_fd, int out_fd, pid_t pgid, bool foreground) {
+  int redir[2];
+  if (open_redirects(command, redir) != 0)
+    return -1;
+  if (redir[0] != -1) in_fd = redir[0];
+  if (redir[1] != -1) out_fd = redir[1];
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+#if __GLIBC_PREREQ(2, 35)
+  // take the terminal in the child before exec (signals are still blocked
+  // there, so this does not stop it with SIGTTOU); must be before the dup2s
+  if (job_control && foreground && pgid == 0)
+    posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#else
+  (void)foreground; // job_wait_fg() gives the terminal after the spawn
+#endif
+  if (in_fd != -1 && in_fd != STDIN_FILENO)
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+  if (out_fd != -1 && out_fd != STDOUT_FILENO)
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+#if __GLIBC_PREREQ(2, 34)
+  // nothing but 0-2 is inherited, even fds opened without O_CLOEXEC
+  // (close_range in the child)
+  posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#endif
+
+  // the shell ignores SIGPIPE (builtins on threads get EPIPE instead) and
+  // the job control signals, but commands should get the defaults back
+  posix_spawnattr_t attr;
+  sigset_t sigdef;
+  short flags = POSIX_SPAWN_SETSIGDEF;
+  posix_spawnattr_init(&attr);
+  sigemptyset(&sigdef);
+  for (int i = 0; i < JOB_SIGNALS_N; i++)
+    sigaddset(&sigdef, job_signals[i]);
+  posix_spawnattr_setsigdefault(&attr, &sigdef);
+  if (job_control) {
+    posix_spawnattr_setpgroup(&attr, pgid);
+    flags |= POSIX_SPAWN_SETPGROUP;
+  }
+  posix_spawnattr_setflags(&attr, flags);
+
+  pid_t pid;
+  int err = posix_spawn(&pid, full_path, &actions, &attr, command->args, command_env(command));
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+
+  if (redir[0] != -1) close(redir[0]);
+  if (redir[1] != -1) close(redir[1]);
+
+  if (err != 0) {
+    // exec failed in the child (e.g. permission denied)
+    fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(err));
+    return -1;
+  }
+  return pid;
+}
+
+
+// Output buffer: output is collected here and written with one write()
+// when the buffer is full. With fd == -1 it only grows in memory.
+struct out_buf {
+  char *data;
+  size_t len;
+  size_t cap;
+  int fd;
+  bool failed; // write error (e.g. EPIPE), no point producing more output
+};
+
+static void out_flush(struct out_buf *ob) {
+  size_t off = 0;
+  while (off < ob->len) {
+    ssize_t w = write(ob->fd, ob->data + off, ob->len - off);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      ob->failed = true; // e.g. EPIPE, reader is gone
+      break;
+    }
+    off += (size_t)w;
+  }
+  ob->len = 0;
+}
+
+static void out_put(struct out_buf *ob, const char *p, size_t n) {
+  if (ob->len + n > ob->cap) {
+    if (ob->fd != -1) {
+      out_flush(ob);
+    }
+    if (ob->len + n > ob->cap) {
+      while (ob->len + n > ob->cap)
+        ob->cap *= 2;
+      ob->data = realloc(ob->data, ob->cap);
+    }
+  }
+  memcpy(ob->data + ob->len, p, n);
+  ob->len += n;
+}
+
+// ---- /proc reading for pinfo ----
+//
+// Files are read with pread() on fds that stay open between samples, and
+// parsed by hand (no stdio), so sampling thousands of processes every
+// second stays cheap.
+
+static int proc_dirfd = -1;
+
+// open /proc/<pid>/<name> (pid 0: /proc/<name>)
+static int proc_open(int pid, const char *name) {
+  if (proc_dirfd < 0)
+    proc_dirfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  char path[64];
+  if (pid > 0)
+    snprintf(path, sizeof(path), "%d/%s", pid, name);
+  else
+    snprintf(path, sizeof(path), "%s", name);
+  return openat(proc_dirfd, path, O_RDONLY | O_CLOEXEC);
+}
+
+// read the whole file from offset 0 into buf (NUL terminated)
+static ssize_t proc_read(int fd, char *buf, size_t size) {
+  size_t len = 0;
+  while (len < size - 1) {
+    ssize_t n = pread(fd, buf + len, size - 1 - len, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    len += n;
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+static uint64_t proc_u64(const char **p) {
+  const char *s = *p;
+  while (*s == ' ' || *s == '\t')
+    s++;
+  uint64_t v = 0;
+  bool neg = *s == '-';
+  if (neg)
+    s++;
+  while (*s >= '0' && *s <= '9')
+    v = v * 10 + (*s++ - '0');
+  *p = s;
+  return neg ? 0 : v;
+}
+
+static void proc_skip_fields(const char **p, int n) {
+  const char *s = *p;
+  while (n-- > 0) {
+    while (*s == ' ')
+      s++;
+    while (*s != ' ' && *s != '\0')
+      s++;
+  }
+  *p = s;
+}
+
+struct proc_stat {
+  int pid, ppid;
+  char state;
+  char comm[64];
+  uint64_t utime, stime;  // clock ticks
+  uint64_t starttime;     // clock ticks after boot
+  long threads;
+  uint64_t vsize;         // bytes
+  uint64_t rss;           // pages
+};
+
+// /proc/<pid>/stat: "pid (comm) S ppid ..." where comm may hold spaces
+// and parentheses, so it ends at the last ')'
+static bool proc_parse_stat(const char *buf, struct proc_stat *st) {
+  const char *open = strchr(buf, '('), *close = strrchr(buf, ')');
+  if (open == NULL || close == NULL || close < open)
+    return false;
+  const char *p = buf;
+  st->pid = proc_u64(&p);
+  size_t n = close - open - 1;
+  if (n >= sizeof(st->comm))
+    n = sizeof(st->comm) - 1;
+  memcpy(st->comm, open + 1, n);
+  st->comm[n] = '\0';
+
+  p = close + 2;
+  st->state = *p++;
+  st->ppid = proc_u64(&p);       // field 4
+  proc_skip_fields(&p, 9);       // 5..13
+  st->utime = proc_u64(&p);      // 14
+  st->stime = proc_u64(&p);      // 15
+  proc_skip_fields(&p, 4);       // 16..19
+  st->threads = proc_u64(&p);    // 20
+  proc_skip_fields(&p, 1);       // 21
+  st->starttime = proc_u64(&p);  // 22
+  st->vsize = proc_u64(&p);      // 23
+  st->rss = proc_u64(&p);        // 24
+  return true;
+}
+
+// value of "Key:" in a "Key: value" file (status, io, smaps_rollup), or
+// NULL; the value starts after the blanks
+static const char *proc_field(const char *buf, const char *key) {
+  size_t klen = strlen(key);
+  for (const char *p = buf; p != NULL && *p != '\0';) {
+    if (strncmp(p, key, klen) == 0 && p[klen] == ':') {
+      p += klen + 1;
+      while (*p == ' ' || *p == '\t')
+        p++;
+      return p;
+    }
+    p = strchr(p, '\n');
+    if (p != NULL)
+      p++;
+  }
+  return NULL;
+}
+
+static double proc_uptime(void) {
+  char buf[128];
+  int fd = proc_open(0, "uptime");
+  if (fd < 0)
+    return 0;
+  ssize_t n = proc_read(fd, buf, sizeof(buf));
+  close(fd);
+  return n > 0 ? strtod(buf, NULL) : 0;
+}
+
+static void out_printf(struct out_buf *ob, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void out_printf(struct out_buf *ob, const char *fmt, ...) {
+  char tmp[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    out_put(ob, tmp, n < (int)sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+// one process watched by the pinfo table
+struct pinfo_proc {
+  int pid;
+  int fd;               // /proc/<pid>/stat, kept open between samples
+  struct proc_stat st;
+  bool sampled;         // there is a previous sample
+  uint64_t prev_ticks;  // utime + stime at the previous sample
+  uint64_t prev_rss;
+  double cpu;           // percent
+  long rss_delta;       // KiB since the previous sample
+};
+
+enum pinfo_sort { PINFO_SORT_PID, PINFO_SORT_CPU, PINFO_SORT_RSS };
+
+static enum pinfo_sort pinfo_sort_key;
+
+static int pinfo_cmp(const void *a, const void *b) {
+  const struct pinfo_proc *x = *(struct pinfo_proc *const *)a;
+  const struct pinfo_proc *y = *(struct pinfo_proc *const *)b;
+  if (pinfo_sort_key == PINFO_SORT_CPU && x->cpu != y->cpu)
+    return x->cpu < y->cpu ? 1 : -1;
+  if (pinfo_sort_key == PINFO_SORT_RSS && x->st.rss != y->st.rss)
+    return x->st.rss < y->st.rss ? 1 : -1;
+  return x->pid - y->pid;
+}
+
+static int pinfo_int_cmp(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+struct pinfo_table {
+  struct pinfo_proc *procs;  // sorted by pid
+  int n, cap;
+};
+
+// With all set, make the table match the pids now in /proc: both lists
+// are sorted, so this is a merge that keeps the open fds of known pids.
+static void pinfo_scan(struct pinfo_table *t) {
+  DIR *d = opendir("/proc");
+  if (d == NULL)
+    return;
+  int *pids = NULL, npids = 0, cap = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    int pid = parse_positive_int(ent->d_name);
+    if (pid <= 0)
+      continue;
+    if (npids == cap) {
+      cap = cap ? cap * 2 : 1024;
+      pids = realloc(pids, sizeof(int) * cap);
+    }
+    pids[npids++] = pid;
+  }
+  closedir(d);
+  qsort(pids, npids, sizeof(int), pinfo_int_cmp); // readdir order is not a promise
+
+  struct pinfo_proc *out = malloc(sizeof(struct pinfo_proc) * (npids ? npids : 1));
+  int i = 0, j = 0, n = 0;
+  while (j < npids) {
+    while (i < t->n && t->procs[i].pid < pids[j]) {
+      if (t->procs[i].fd >= 0)
+        close(t->procs[i].fd);
+      i++;
+    }
+    if (i < t->n && t->procs[i].pid == pids[j]) {
+      out[n++] = t->procs[i++];
+    } else {
+      memset(&out[n], 0, sizeof(struct pinfo_proc));
+      out[n].pid = pids[j];
+      out[n].fd = -1;
+      n++;
+    }
+    j++;
+  }
+  for (; i < t->n; i++)
+    if (t->procs[i].fd >= 0)
+      close(t->procs[i].fd);
+  free(t->procs);
+  free(pids);
+  t->procs = out;
+  t->n = t->cap = n;
+}
+
+// Read /proc/<pid>/stat of every process. CPU% is taken over the time
+// since the previous sample, or over the whole life of the process on the
+// first one. Processes that are gone are dropped from the table.
+static void pinfo_sample(struct pinfo_table *t, double interval) {
+  static long ticks_per_sec = 0, page_kb = 0;
+  if (ticks_per_sec == 0) {
+    ticks_per_sec = sysconf(_SC_CLK_TCK);
+    page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  }
+  double uptime = proc_uptime();
+  char buf[1024];
+  int n = 0;
+  for (int i = 0; i < t->n; i++) {
+    struct pinfo_proc *p = &t->procs[i];
+    if (p->fd < 0)
+      p->fd = proc_open(p->pid, "stat");
+    if (p->fd < 0 || proc_read(p->fd, buf, sizeof(buf)) <= 0 ||
+        !proc_parse_stat(buf, &p->st)) {
+      // gone (ESRCH), or the pid now belongs to another process
+      if (p->fd >= 0)
+        close(p->fd);
+      continue;
+    }
+    uint64_t ticks = p->st.utime + p->st.stime;
+    if (p->sampled && interval > 0) {
+      p->cpu = 100.0 * (ticks - p->prev_ticks) / ticks_per_sec / interval;
+      p->rss_delta = ((long)p->st.rss - (long)p->prev_rss) * page_kb;
+    } else {
+      double age = uptime - (double)p->st.starttime / ticks_per_sec;
+      p->cpu = age > 0 ? 100.0 * ticks / ticks_per_sec / age : 0;
+      p->rss_delta = 0;
+    }
+    p->prev_ticks = ticks;
+    p->prev_rss = p->st.rss;
+    p->sampled = true;
+    t->procs[n++] = *p;
+  }
+  t->n = n;
+}
+
+static void pinfo_render(struct pinfo_table *t, struct out_buf *ob, bool clear, int max_rows) {
+  long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  struct pinfo_proc **view = malloc(sizeof(struct pinfo_proc *) * (t->n ? t->n : 1));
+  double total_cpu = 0;
+  uint64_t total_rss = 0;
+  for (int i = 0; i < t->n; i++) {
+    view[i] = &t->procs[i];
+    total_cpu += t->procs[i].cpu;
+    total_rss += t->procs[i].st.rss * page_kb;
+  }
+  qsort(view, t->n, sizeof(view[0]), pinfo_cmp);
+
+  if (clear)
+    out_put(ob, "\033[H\033[2J", 7);
+  out_printf(ob, "%d processes, %.1f%% CPU, %llu MiB RSS\n", t->n, total_cpu,
+             (unsigned long long)(total_rss / 1024));
+  out_printf(ob, "%7s %7s %s %6s %4s %10s %9s  %s\n", "PID", "PPID", "S", "CPU%",
+             "THR", "RSS(KiB)", "dRSS", "NAME");
+  for (int i = 0; i < t->n && (max_rows <= 0 || i < max_rows); i++) {
+    struct pinfo_proc *p = view[i];
+    out_printf(ob, "%7d %7d %c %6.1f %4ld %10llu %+9ld  %s\n", p->pid, p->st.ppid,
+               p->st.state, p->cpu, p->st.threads,
+               (unsigned long long)(p->st.rss * page_kb), p->rss_delta, p->st.comm);
+  }
+  free(view);
+}
+
+// JSON string (quotes and escapes included)
+static void out_json_str(struct out_buf *ob, const char *s, size_t len) {
+  out_put(ob, "\"", 1);
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      char e[2] = {'\\', c};
+      out_put(ob, e, 2);
+    } else if (c < 0x20) {
+      out_printf(ob, "\\u%04x", c);
+    } else {
+      out_put(ob, s + i, 1);
+    }
+  }
+  out_put(ob, "\"", 1);
+}
+
+// rest of the line starting at v
+static int proc_line_len(const char *v) {
+  const char *end = strchr(v, '\n');
+  return end ? end - v : (int)strlen(v);
+}
+
+static uint64_t proc_field_u64(const char *buf, const char *key) {
+  const char *v = proc_field(buf, key);
+  return v ? proc_u64(&v) : 0;
+}
+
+// read /proc/<pid>/<name> into buf; -1 if the process or file is gone
+static ssize_t proc_read_file(int pid, const char *name, char *buf, size_t size) {
+  int fd = proc_open(pid, name);
+  if (fd < 0)
+    return -1;
+  ssize_t n = proc_read(fd, buf, size);
+  int saved = errno;
+  close(fd);
+  errno = saved;
+  return n;
+}
+
+enum {
+  PINFO_VIEW_THREADS = 1,
+  PINFO_VIEW_FDS = 2,
+  PINFO_VIEW_IO = 4,
+  PINFO_VIEW_CTXT = 8,
+  PINFO_VIEW_MEM = 16,
+};
+
+static const char *pinfo_status_keys[] = {"Name", "State", "PPid", "VmSize", "VmRSS"};
+
+// -t: one line per thread from /proc/<pid>/task/<tid>/stat
+static void pinfo_view_threads(int pid, bool json, struct out_buf *ob) {
+  long ticks_per_sec = sysconf(_SC_CLK_TCK);
+  double uptime = proc_uptime();
+  char name[64], buf[1024];
+  int dfd = proc_open(pid, "task");
+  DIR *d = dfd >= 0 ? fdopendir(dfd) : NULL;
+  if (d == NULL) {
+    if (dfd >= 0)
+      close(dfd);
+    out_put(ob, json ? ",\"threads\":[]" : "Threads: ?\n", json ? 13 : 11);
+    return;
+  }
+
+  int *tids = NULL, n = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    int tid = parse_positive_int(ent->d_name);
+    if (tid > 0) {
+      tids = realloc(tids, sizeof(int) * (n + 1));
+      tids[n++] = tid;
+    }
+  }
+  closedir(d);
+  qsort(tids, n, sizeof(int), pinfo_int_cmp);
+
+  if (json)
+    out_put(ob, ",\"threads\":[", 12);
+  else
+    out_printf(ob, "Threads (%d):\n%9s %s %6s %9s %9s  %s\n", n, "TID", "S", "CPU%",
+               "USER(s)", "SYS(s)", "NAME");
+  bool first = true;
+  for (int i = 0; i < n; i++) {
+    struct proc_stat st;
+    snprintf(name, sizeof(name), "task/%d/stat", tids[i]);
+    if (proc_read_file(pid, name, buf, sizeof(buf)) <= 0 || !proc_parse_stat(buf, &st))
+      continue; // thread exited meanwhile
+    // average over the thread's life (a single sample has no delta)
+    double age = uptime - (double)st.starttime / ticks_per_sec;
+    double cpu = age > 0 ? 100.0 * (st.utime + st.stime) / ticks_per_sec / age : 0;
+    double user = (double)st.utime / ticks_per_sec, sys = (double)st.stime / ticks_per_sec;
+    if (json) {
+      out_printf(ob, "%s{\"tid\":%d,\"state\":\"%c\",\"cpu\":%.2f,\"user_sec\":%.2f,"
+                     "\"sys_sec\":%.2f,\"name\":",
+                 first ? "" : ",", st.pid, st.state, cpu, user, sys);
+      out_json_str(ob, st.comm, strlen(st.comm));
+      out_put(ob, "}", 1);
+    } else {
+      out_printf(ob, "%9d %c %6.1f %9.2f %9.2f  %s\n", st.pid, st.state, cpu, user, sys,
+                 st.comm);
+    }
+    first = false;
+  }
+  if (json)
+    out_put(ob, "]", 1);
+  free(tids);
+}
+
+// -f: open fds and what they point to
+static void pinfo_view_fds(int pid, bool json, struct out_buf *ob) {
+  int dfd = proc_open(pid, "fd");
+  DIR *d = dfd >= 0 ? fdopendir(dfd) : NULL;
+  if (d == NULL) {
+    // e.g. EACCES for processes of other users
+    if (dfd >= 0)
+      close(dfd);
+    if (json)
+      out_printf(ob, ",\"fds\":{\"error\":\"%s\"}", strerror(errno));
+    else
+      out_printf(ob, "Fds: %s\n", strerror(errno));
+    return;
+  }
+
+  int *fds = NULL, n = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    int fd = parse_positive_int(ent->d_name);
+    if (fd >= 0 && ent->d_name[0] != '.') {
+      fds = realloc(fds, sizeof(int) * (n + 1));
+      fds[n++] = fd;
+    }
+  }
+  qsort(fds, n, sizeof(int), pinfo_int_cmp);
+
+  if (json)
+    out_printf(ob, ",\"fds\":{\"count\":%d,\"list\":[", n);
+  else
+    out_printf(ob, "Fds (%d):\n", n);
+  for (int i = 0; i < n; i++) {
+    char name[16], target[PATH_MAX];
+    snprintf(name, sizeof(name), "%d", fds[i]);
+    ssize_t len = readlinkat(dirfd(d), name, target, sizeof(target) - 1);
+    if (len < 0)
+      len = 0;
+    if (json) {
+      out_printf(ob, "%s{\"fd\":%d,\"target\":", i ? "," : "", fds[i]);
+      out_json_str(ob, target, len);
+      out_put(ob, "}", 1);
+    } else {
+      out_printf(ob, "%6d -> %.*s\n", fds[i], (int)len, target);
+    }
+  }
+  if (json)
+    out_put(ob, "]}", 2);
+  closedir(d);
+  free(fds);
+}
+
+// -i: /proc/<pid>/io
+static void pinfo_view_io(int pid, bool json, struct out_buf *ob) {
+  static const char *keys[] = {"rchar", "wchar", "syscr", "syscw", "read_bytes",
+                               "write_bytes", "cancelled_write_bytes"};
+  char buf[1024];
+  if (proc_read_file(pid, "io", buf, sizeof(buf)) < 0) {
+    if (json)
+      out_printf(ob, ",\"io\":{\"error\":\"%s\"}", strerror(errno));
+    else
+      out_printf(ob, "I/O: %s\n", strerror(errno));
+    return;
+  }
+  out_put(ob, json ? ",\"io\":{" : "I/O:\n", json ? 7 : 5);
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    uint64_t v = proc_field_u64(buf, keys[i]);
+    if (json)
+      out_printf(ob, "%s\"%s\":%llu", i ? "," : "", keys[i], (unsigned long long)v);
+    else
+      out_printf(ob, "  %-22s %llu\n", keys[i], (unsigned long long)v);
+  }
+  if (json)
+    out_put(ob, "}", 1);
+}
+
+// -c: context switches from status (already read by the caller)
+static void pinfo_view_ctxt(const char *status, bool json, struct out_buf *ob) {
+  uint64_t vol = proc_field_u64(status, "voluntary_ctxt_switches");
+  uint64_t invol = proc_field_u64(status, "nonvoluntary_ctxt_switches");
+  if (json)
+    out_printf(ob, ",\"ctxt_switches\":{\"voluntary\":%llu,\"involuntary\":%llu}",
+               (unsigned long long)vol, (unsigned long long)invol);
+  else
+    out_printf(ob, "Context switches: %llu voluntary, %llu involuntary\n",
+               (unsigned long long)vol, (unsigned long long)invol);
+}
+
+// -m: memory summary from smaps_rollup (kB)
+static void pinfo_view_mem(int pid, bool json, struct out_buf *ob) {
+  static const char *keys[] = {"Rss", "Pss", "Pss_Anon", "Pss_File", "Pss_Shmem",
+                               "Anonymous", "Shared_Clean", "Shared_Dirty",
+                               "Private_Clean", "Private_Dirty", "Swap", "SwapPss"};
+  char buf[4096];
+  if (proc_read_file(pid, "smaps_rollup", buf, sizeof(buf)) < 0) {
+    if (json)
+      out_printf(ob, ",\"memory\":{\"error\":\"%s\"}", strerror(errno));
+    else
+      out_printf(ob, "Memory: %s\n", strerror(errno));
+    return;
+  }
+  out_put(ob, json ? ",\"memory_kb\":{" : "Memory (kB):\n", json ? 14 : 13);
+  bool first = true;
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    const char *v = proc_field(buf, keys[i]);
+    if (v == NULL)
+      continue; // older kernels have no Pss_Anon etc.
+    uint64_t kb = proc_u64(&v);
+    if (json)
+      out_printf(ob, "%s\"%s\":%llu", first ? "" : ",", keys[i], (unsigned long long)kb);
+    else
+      out_printf(ob, "  %-14s %10llu\n", keys[i], (unsigned long long)kb);
+    first = false;
+  }
+  if (json)
+    out_put(ob, "}", 1);
+}
+
+// a table sample as one JSON array (one line per sample)
+static void pinfo_render_json(struct pinfo_table *t, struct out_buf *ob) {
+  long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  out_put(ob, "[", 1);
+  for (int i = 0; i < t->n; i++) {
+    struct pinfo_proc *p = &t->procs[i];
+    out_printf(ob, "%s{\"pid\":%d,\"ppid\":%d,\"state\":\"%c\",\"cpu\":%.2f,"
+                   "\"threads\":%ld,\"rss_kb\":%llu,\"rss_delta_kb\":%ld,\"name\":",
+               i ? "," : "", p->pid, p->st.ppid, p->st.state, p->cpu, p->st.threads,
+               (unsigned long long)(p->st.rss * page_kb), p->rss_delta);
+    out_json_str(ob, p->st.comm, strlen(p->st.comm));
+    out_put(ob, "}", 1);
+  }
+  out_put(ob, "]\n", 2);
+}
+
+// pinfo <pid>: the classic lines of /proc/<pid>/status, then the views
+// asked for. With json, one object per process on its own line.
+// -1 if the process can't be read
+static int pinfo_detail(int pid, unsigned views, bool json, struct out_buf *ob) {
+  char status[8192];
+  if (proc_read_file(pid, "status", status, sizeof(status)) < 0) {
+    // if file does not exist, process probably not found
+    fprintf(stderr, "-%s: pinfo: %d: %s\n", sysname, pid, strerror(errno));
+    return -1;
+  }
+
+  if (json)
+    out_printf(ob, "{\"pid\":%d", pid);
+  for (size_t i = 0; i < sizeof(pinfo_status_keys) / sizeof(pinfo_status_keys[0]); i++) {
+    const char *key = pinfo_status_keys[i];
+    const char *v = proc_field(status, key);
+    if (v == NULL)
+      continue;
+    if (!json) {
+      out_printf(ob, "%s:\t%.*s\n", key, proc_line_len(v), v);
+    } else if (key[0] == 'V') {
+      out_printf(ob, ",\"%s\":%llu", key[2] == 'S' ? "vm_size_kb" : "vm_rss_kb",
+                 (unsigned long long)proc_u64(&v));
+    } else if (key[0] == 'P') {
+      out_printf(ob, ",\"ppid\":%llu", (unsigned long long)proc_u64(&v));
+    } else {
+      out_printf(ob, ",\"%s\":", key[0] == 'N' ? "name" : "state");
+      out_json_str(ob, v, proc_line_len(v));
+    }
+  }
+
+  if (views & PINFO_VIEW_THREADS)
+    pinfo_view_threads(pid, json, ob);
+  if (views & PINFO_VIEW_FDS)
+    pinfo_view_fds(pid, json, ob);
+  if (views & PINFO_VIEW_IO)
+    pinfo_view_io(pid, json, ob);
+  if (views & PINFO_VIEW_CTXT)
+    pinfo_view_ctxt(status, json, ob);
+  if (views & PINFO_VIEW_MEM)
+    pinfo_view_mem(pid, json, ob);
+  if (json)
+    out_put(ob, "}\n", 2);
+  return 0;
+}
+
+// Custom command: pinfo <pid>
+// pinfo [-t] [-f] [-i] [-c] [-m] [-v] pid...   details of each process:
+//   threads, fds, I/O, context switches, memory (smaps_rollup), -v all
+// pinfo pid1 pid2 ... | pinfo -a     table with CPU%, RSS and RSS change
+//   -w <seconds>   refresh like top (until Ctrl-C or -n)
+//   -n <count>     number of samples
+//   -s cpu|rss|pid sort order (default: cpu with -w, else pid)
+// -j prints JSON instead: an object per process, or an array per sample.
+static int builtin_pinfo(struct command_t *command, int out_fd) {
+  bool all = false, table = false, json = false;
+  unsigned views = 0;
+  double interval = 0;
+  long count = 1;
+  pinfo_sort_key = PINFO_SORT_PID;
+  bool sort_set = false;
+  int *pids = NULL, npids = 0;
+
+  for (int i = 1; command->args[i] != NULL; i++) {
+    const char *a = command->args[i];
+    if (strcmp(a, "-a") == 0) {
+      all = table = true;
+    } else if (a[0] == '-' && a[1] != '\0' && strspn(a + 1, "tficmvj") == strlen(a + 1)) {
+      for (const char *f = a + 1; *f != '\0'; f++) {
+        switch (*f) {
+        case 't': views |= PINFO_VIEW_THREADS; break;
+        case 'f': views |= PINFO_VIEW_FDS; break;
+        case 'i': views |= PINFO_VIEW_IO; break;
+        case 'c': views |= PINFO_VIEW_CTXT; break;
+        case 'm': views |= PINFO_VIEW_MEM; break;
+        case 'v': views |= ~0u; break;
+        case 'j': json = true; break;
+        }
+      }
+    } else if ((strcmp(a, "-w") == 0 || strcmp(a, "-n") == 0 || strcmp(a, "-s") == 0) &&
+               command->args[i + 1] != NULL) {
+      const char *v = command->args[++i];
+      table = true;
+      if (a[1] == 'w') {
+        char *end;
+        interval = strtod(v, &end);
+        if (*end != '\0' || interval <= 0) {
+          fprintf(stderr, "-%s: pinfo: %s: invalid interval\n", sysname, v);
+          free(pids);
+          return 1;
+        }
+        if (!sort_set)
+          pinfo_sort_key = PINFO_SORT_CPU;
+        if (count == 1)
+          count = -1; // until interrupted
+      } else if (a[1] == 'n') {
+        count = parse_positive_int(v);
+        if (count <= 0) {
+          fprintf(stderr, "-%s: pinfo: %s: invalid count\n", sysname, v);
+          free(pids);
+          return 1;
+        }
+      } else {
+        sort_set = true;
+        if (strcmp(v, "cpu") == 0)
+          pinfo_sort_key = PINFO_SORT_CPU;
+        else if (strcmp(v, "rss") == 0)
+          pinfo_sort_key = PINFO_SORT_RSS;
+        else if (strcmp(v, "pid") == 0)
+          pinfo_sort_key = PINFO_SORT_PID;
+        else {
+          fprintf(stderr, "-%s: pinfo: %s: sort by cpu, rss or pid\n", sysname, v);
+          free(pids);
+          return 1;
+        }
+      }
+    } else {
+      // only accept numeric pid
+      int pid = parse_positive_int(a);
+      if (pid <= 0) {
+        fprintf(stderr, "-%s: pinfo: %s: invalid pid\n", sysname, a);
+        free(pids);
+        return 1;
+      }
+      pids = realloc(pids, sizeof(int) * (npids + 1));
+      pids[npids++] = pid;
+    }
+  }
+
+  // if user didn't give pid
+  if (npids == 0 && !all) {
+    fprintf(stderr, "-%s: pinfo: missing pid\n", sysname);
+    return 1;
+  }
+
+  struct out_buf ob = {.data = malloc(64 * 1024), .cap = 64 * 1024, .fd = out_fd};
+  int status = 0;
+  if (!table && (npids == 1 || views != 0 || json)) {
+    for (int i = 0; i < npids; i++) {
+      if (pinfo_detail(pids[i], views, json, &ob) != 0)
+        status = 1;
+      if (!json && views != 0 && i + 1 < npids)
+        out_put(&ob, "\n", 1);
+    }
+    out_flush(&ob);
+    free(ob.data);
+    free(pids);
+    return status;
+  }
+
+  if (count != 1 && interval == 0)
+    interval = 1;
+
+  struct pinfo_table t = {0};
+  if (!all) {
+    // explicit pids: the table is just these (sorted, no duplicates)
+    qsort(pids, npids, sizeof(int), pinfo_int_cmp);
+    t.procs = calloc(npids, sizeof(struct pinfo_proc));
+    for (int i = 0; i < npids; i++) {
+      if (t.n > 0 && t.procs[t.n - 1].pid == pids[i])
+        continue;
+      t.procs[t.n].pid = pids[i];
+      t.procs[t.n].fd = -1;
+      t.n++;
+    }
+  }
+
+  // refreshing on a terminal: redraw in place, as many rows as fit
+  bool refresh = interval > 0 && isatty(out_fd);
+  int rows = 0;
+  struct winsize ws;
+  if (refresh && ioctl(out_fd, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 3)
+    rows = ws.ws_row - 3;
+
+  struct timespec last, now;
+  clock_gettime(CLOCK_MONOTONIC, &last);
+  for (long k = 0; count < 0 || k < count; k++) {
+    if (k > 0) {
+      struct timespec ts = {(time_t)interval,
+                            (long)((interval - (time_t)interval) * 1e9)};
+      nanosleep(&ts, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = timespec_diff(last, now);
+    last = now;
+
+    if (all)
+      pinfo_scan(&t);
+    pinfo_sample(&t, k > 0 ? elapsed : 0);
+    if (t.n == 0 && !all) {
+      fprintf(stderr, "-%s: pinfo: no such process\n", sysname);
+      status = 1;
+      break;
+    }
+    if (json)
+      pinfo_render_json(&t, &ob);
+    else
+      pinfo_render(&t, &ob, refresh, rows);
+    out_flush(&ob);
+    if (ob.failed)
+      break; // e.g. pinfo -a -w 1 | head
+  }
+
+  for (int i = 0; i < t.n; i++)
+    if (t.procs[i].fd >= 0)
+      close(t.procs[i].fd);
+  free(t.procs);
+  free(ob.data);
+  free(pids);
+  return status;
+}
+
+// ---- timing and stats ----
+//
+// `time cmd` prints real/user/sys time of a command line. With
+// SHELLISH_STATS set, every foreground command line (and each stage of a
+// pipe chain) is recorded: wall time, user/sys CPU from the wait4() rusage,
+// max RSS and exit status. Records are kept in a ring for the `stats`
+// builtin. If SHELLISH_STATS is a file name (not "1"), each record is also
+// appended to that file as one JSON line.
+
+#define STATS_RING_SIZE 4096
+
+struct stats_rec {
+  struct timespec when; // start, wall clock
+  double wall;
+  double user;
+  double sys;
+  long maxrss;          // kB
+  int status;           // exit code
+  int stage;            // -1: whole command line
+  int nstages;
+  pid_t pid;            // 0: ran in the shell process
+  char *cmd;
+};
+
+static struct {
+  bool enabled;
+  struct stats_rec *ring;
+  size_t next;          // total records added so far
+  struct out_buf log;   // fd == -1: no log file
+  char *log_path;
+} stats = {.log = {.fd = -1}};
+
+// usage of the command line that is running now, summed over its children
+static struct {
+  bool active;
+  struct timespec start;
+  double user;
+  double sys;
+  long maxrss;
+  bool has_children;
+} stats_line;
+
+static void stats_init(void) {
+  const char *v = getenv("SHELLISH_STATS");
+  if (v == NULL || *v == '\0' || strcmp(v, "0") == 0)
+    return;
+  stats.enabled = true;
+  if (strcmp(v, "1") == 0)
+    return;
+  int fd = open(v, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "-%s: SHELLISH_STATS: %s: %s\n", sysname, v, strerror(errno));
+    return;
+  }
+  stats.log.fd = fd;
+  stats.log_path = strdup(v);
+  stats.log.cap = 4096;
+  stats.log.data = malloc(stats.log.cap);
+}
+
+// one JSON line for r (also used for the job log of parallel)
+static void stats_log(struct out_buf *ob, const struct stats_rec *r) {
+  out_printf(ob, "{\"time\":%lld.%03ld,\"pid\":%d,\"cmd\":", (long long)r->when.tv_sec,
+             r->when.tv_nsec / 1000000, (int)r->pid);
+  out_json_str(ob, r->cmd, strlen(r->cmd));
+  if (r->stage >= 0)
+    out_printf(ob, ",\"stage\":%d,\"stages\":%d", r->stage, r->nstages);
+  out_printf(ob, ",\"status\":%d,\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld}\n",
+             r->status, r->wall, r->user, r->sys, r->maxrss);
+  out_flush(ob); // one O_APPEND write per record: lines of shells sharing the file don't mix
+}
+
+static void stats_add(const struct stats_rec *r, const char *cmd) {
+  if (stats.ring == NULL)
+    stats.ring = calloc(STATS_RING_SIZE, sizeof(struct stats_rec));
+  struct stats_rec *slot = &stats.ring[stats.next % STATS_RING_SIZE];
+  free(slot->cmd); // oldest record is overwritten
+  *slot = *r;
+  slot->cmd = strdup(cmd);
+  stats.next++;
+  if (stats.log.fd != -1)
+    stats_log(&stats.log, slot);
+}
+
+// start time of a stage that started monotonic_start, in wall clock time
+static struct timespec stats_wall_time(struct timespec monotonic_start) {
+  struct timespec now, mono;
+  clock_gettime(CLOCK_REALTIME, &now);
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  double ago = timespec_diff(monotonic_start, mono);
+  long long ns = (long long)now.tv_sec * 1000000000LL + now.tv_nsec - (long long)(ago * 1e9);
+  struct timespec t = {(time_t)(ns / 1000000000LL), (long)(ns % 1000000000LL)};
+  return t;
+}
+
+// record one pipe stage (a child process or a builtin thread)
+static void stats_add_stage(const char *name, int stage, int nstages, pid_t pid,
+                            struct timespec start, struct timespec end,
+                            const struct rusage *ru, int status) {
+  struct stats_rec r = {
+      .when = stats_wall_time(start),
+      .wall = timespec_diff(start, end),
+      .user = timeval_sec(ru->ru_utime),
+      .sys = timeval_sec(ru->ru_stime),
+      .maxrss = ru->ru_maxrss,
+      .status = status,
+      .stage = stage,
+      .nstages = nstages,
+      .pid = pid,
+  };
+  stats_add(&r, name);
+}
+
+// called by job_wait_fg(): add up the children of the foreground job
+static void stats_job_waited(struct job *j) {
+  if (!stats_line.active || j->state != JOB_DONE)
+    return;
+  for (int i = 0; i < j->nprocs; i++) {
+    struct job_proc *p = &j->procs[i];
+    stats_line.user += timeval_sec(p->ru.ru_utime);
+    stats_line.sys += timeval_sec(p->ru.ru_stime);
+    if (p->ru.ru_maxrss > stats_line.maxrss)
+      stats_line.maxrss = p->ru.ru_maxrss;
+    stats_line.has_children = true;
+    if (stats.enabled && j->nstages > 1)
+      stats_add_stage(p->name, p->stage, j->nstages, p->pid, j->start, p->end, &p->ru,
+                      status_code(p->status));
+  }
+}
+
+static void stats_line_begin(void) {
+  memset(&stats_line, 0, sizeof(stats_line));
+  stats_line.active = true;
+  clock_gettime(CLOCK_MONOTONIC, &stats_line.start);
+}
+
+// End of a command line. self_before is the shell's own usage at the start
+// (builtins run in the shell process or on its threads).
+static void stats_line_end(struct command_t *command, const struct rusage *self_before,
+                           bool print) {
+  struct timespec end;
+  struct rusage self;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  getrusage(RUSAGE_SELF, &self);
+  stats_line.active = false;
+
+  struct stats_rec r = {
+      .when = stats_wall_time(stats_line.start),
+      .wall = timespec_diff(stats_line.start, end),
+      .user = stats_line.user + timeval_sec(self.ru_utime) - timeval_sec(self_before->ru_utime),
+      .sys = stats_line.sys + timeval_sec(self.ru_stime) - timeval_sec(self_before->ru_stime),
+      .maxrss = stats_line.has_children ? stats_line.maxrss : self.ru_maxrss,
+      .status = last_status,
+      .stage = -1,
+      .nstages = 1,
+  };
+  if (print) {
+    // like bash: real 0m1.234s
+    int wm = (int)(r.wall / 60), um = (int)(r.user / 60), sm = (int)(r.sys / 60);
+    fprintf(stderr, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\nmaxrss\t%ld kB\n",
+            wm, r.wall - wm * 60, um, r.user - um * 60, sm, r.sys - sm * 60, r.maxrss);
+  }
+
+  char *cmd = command_to_string(command);
+  stats_add(&r, cmd);
+  free(cmd);
+}
+
+static int stats_wall_cmp(const void *a, const void *b) {
+  const struct stats_rec *x = *(const struct stats_rec *const *)a;
+  const struct stats_rec *y = *(const struct stats_rec *const *)b;
+  return (x->wall < y->wall) - (x->wall > y->wall); // slowest first
+}
+
+static void stats_print_rec(const struct stats_rec *r) {
+  printf("  %9.3fs  user %8.3fs  sys %8.3fs  %8ld kB  exit %-3d %s", r->wall, r->user,
+         r->sys, r->maxrss, r->status, r->cmd);
+  if (r->stage >= 0)
+    printf("  [stage %d/%d]", r->stage + 1, r->nstages);
+  printf("\n");
+}
+
+// Builtin command: stats [-n count] [-c]
+// Summary of the recorded command lines: count, percentiles of wall time and
+// the slowest command lines and pipe stages.
+static int builtin_stats(struct command_t *command) {
+  long top = 10;
+  for (int i = 1; command->args[i] != NULL; i++) {
+    if (strcmp(command->args[i], "-c") == 0) {
+      for (size_t k = 0; stats.ring != NULL && k < STATS_RING_SIZE; k++)
+        free(stats.ring[k].cmd);
+      free(stats.ring);
+      stats.ring = NULL;
+      stats.next = 0;
+      return SUCCESS;
+    }
+    if (strcmp(command->args[i], "-n") == 0 && command->args[i + 1] != NULL) {
+      top = strtol(command->args[++i], NULL, 10);
+      continue;
+    }
+    fprintf(stderr, "-%s: stats: usage: stats [-n count] [-c]\n", sysname);
+    pipe_status[0] = 2;
+    return SUCCESS;
+  }
+
+  size_t n = stats.next < STATS_RING_SIZE ? stats.next : STATS_RING_SIZE;
+  if (n == 0) {
+    printf("no commands recorded%s\n",
+           stats.enabled ? "" : " (set SHELLISH_STATS=1, or use time cmd)");
+    return SUCCESS;
+  }
+
+  // split into command lines and pipe stages, both sorted slowest first
+  struct stats_rec **lines = malloc(n * sizeof(*lines));
+  struct stats_rec **stages = malloc(n * sizeof(*stages));
+  size_t nlines = 0, nstages = 0;
+  double total = 0;
+  for (size_t k = 0; k < n; k++) {
+    struct stats_rec *r = &stats.ring[k];
+    if (r->stage < 0) {
+      lines[nlines++] = r;
+      total += r->wall;
+    } else {
+      stages[nstages++] = r;
+    }
+  }
+  qsort(lines, nlines, sizeof(*lines), stats_wall_cmp);
+  qsort(stages, nstages, sizeof(*stages), stats_wall_cmp);
+
+  printf("%zu command lines, %zu pipe stages, %.3fs total wall time", nlines, nstages, total);
+  if (stats.next > n)
+    printf(" (last %zu records)", n);
+  printf("\n");
+  if (nlines > 0) {
+    // sorted slowest first: the p-th percentile is counted from the end
+    #define STATS_PCT(p) lines[(nlines - 1) - (size_t)((nlines - 1) * (p) / 100)]->wall
+    printf("wall  p50 %.3fs  p90 %.3fs  p99 %.3fs  max %.3fs\n", STATS_PCT(50),
+           STATS_PCT(90), STATS_PCT(99), lines[0]->wall);
+    #undef STATS_PCT
+    printf("slowest command lines:\n");
+    for (size_t k = 0; k < nlines && (long)k < top; k++)
+      stats_print_rec(lines[k]);
+  }
+  if (nstages > 0) {
+    printf("slowest pipe stages:\n");
+    for (size_t k = 0; k < nstages && (long)k < top; k++)
+      stats_print_rec(stages[k]);
+  }
+  free(lines);
+  free(stages);
+  return SUCCESS;
+}
+
+// create room directory if it does not exist
+static int ensure_dir_exists(const char *dir) {
+  struct stat st;
+  if (stat(dir, &st) == 0) {
+    if (S_ISDIR(st.st_mode)) return 0;
+    return -1;
+  }
+  if (mkdir(dir, 0777) == 0) return 0;
+  return -1;
+}
+
+// create fifo if it does not exist
+static int ensure_fifo_exists(const char *path) {
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    if (S_ISFIFO(st.st_mode)) return 0;
+    return -1;
+  }
+  if (mkfifo(path, 0666) == 0) return 0;
+  if (errno == EEXIST) return 0;
+  return -1;
+}
+
+// Members of a chat room. The list is read once and then kept up to date
+// with inotify on the room directory. Each member has a persistent
+// non-blocking write fd to its fifo and a queue of messages it could not
+// take yet, so a slow reader only delays itself. Messages are shared
+// between the queues (reference counted).
+struct chat_msg {
+  int refs;
+  int len;
+  char data[];
+};
+
+struct chat_member {
+  char name[NAME_MAX + 1];
+  int fd;                    // -1 until the fifo has a reader
+  bool not_fifo;             // some other file in the room directory
+  struct chat_msg **queue;   // ring of pending messages
+  int head, count, cap;
+  struct chat_member *next;
+};
+
+struct chat_room {
+  const char *dir;
+  const char *self;
+  struct chat_member *members;
+  int inotify_fd;
+};
+
+static void chat_msg_unref(struct chat_msg *msg) {
+  if (--msg->refs == 0)
+    free(msg);
+}
+
+static void chat_member_drop_queue(struct chat_member *m) {
+  for (int i = 0; i < m->count; i++)
+    chat_msg_unref(m->queue[(m->head + i) % m->cap]);
+  m->head = m->count = 0;
+}
+
+static void chat_member_add(struct chat_room *r, const char *name) {
+  if (strcmp(name, r->self) == 0 || strlen(name) > NAME_MAX)
+    return;
+  for (struct chat_member *m = r->members; m != NULL; m = m->next)
+    if (strcmp(m->name, name) == 0)
+      return;
+  struct chat_member *m = calloc(1, sizeof(struct chat_member));
+  strcpy(m->name, name);
+  m->fd = -1;
+  m->next = r->members;
+  r->members = m;
+}
+
+static void chat_member_remove(struct chat_room *r, const char *name) {
+  for (struct chat_member **link = &r->members; *link != NULL; link = &(*link)->next) {
+    struct chat_member *m = *link;
+    if (strcmp(m->name, name) != 0)
+      continue;
+    *link = m->next;
+    chat_member_drop_queue(m);
+    if (m->fd >= 0)
+      close(m->fd);
+    free(m->queue);
+    free(m);
+    return;
+  }
+}
+
+static void chat_room_open(struct chat_room *r, const char *dir, const char *self) {
+  memset(r, 0, sizeof(*r));
+  r->dir = dir;
+  r->self = self;
+  // watch first, then list, so no member can slip in between
+  r->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (r->inotify_fd >= 0)
+    inotify_add_watch(r->inotify_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+  DIR *d = opendir(dir);
+  if (d != NULL) {
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+      if (ent->d_name[0] != '.')
+        chat_member_add(r, ent->d_name);
+    closedir(d);
+  }
+}
+
+static void chat_room_close(struct chat_room *r) {
+  while (r->members != NULL)
+    chat_member_remove(r, r->members->name);
+  if (r->inotify_fd >= 0)
+    close(r->inotify_fd);
+}
+
+// apply pending inotify events to the member list
+static void chat_room_update(struct chat_room *r) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(r->inotify_fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->len > 0 && ev->name[0] != '.') {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+          chat_member_add(r, ev->name);
+        else
+          chat_member_remove(r, ev->name);
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+}
+
+// Write as much of m's queue as the fifo takes. Every writev() carries
+// whole messages and at most PIPE_BUF bytes, so it is atomic: it either
+// goes in completely or fails with EAGAIN, and never interleaves with
+// other senders.
+static void chat_member_flush(struct chat_member *m) {
+  while (m->count > 0 && m->fd >= 0) {
+    struct iovec iov[64];
+    int k = 0;
+    size_t total = 0;
+    while (k < m->count && k < 64) {
+      struct chat_msg *msg = m->queue[(m->head + k) % m->cap];
+      if (k > 0 && total + msg->len > PIPE_BUF)
+        break;
+      iov[k].iov_base = msg->data;
+      iov[k].iov_len = msg->len;
+      total += msg->len;
+      k++;
+    }
+    ssize_t w = writev(m->fd, iov, k);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0 && errno == EAGAIN)
+      return; // fifo is full, poll() tells us when to go on
+    if (w < 0) {
+      // reader is gone (EPIPE): forget the fd and what was queued for it
+      close(m->fd);
+      m->fd = -1;
+      chat_member_drop_queue(m);
+      return;
+    }
+    for (int i = 0; i < k; i++)
+      chat_msg_unref(m->queue[(m->head + i) % m->cap]);
+    m->head = (m->head + k) % m->cap;
+    m->count -= k;
+  }
+}
+
+static void chat_broadcast(struct chat_room *r, struct chat_msg *msg) {
+  char path[PATH_MAX];
+  for (struct chat_member *m = r->members; m != NULL; m = m->next) {
+    if (m->not_fifo)
+      continue;
+    if (m->fd < 0) {
+      snprintf(path, sizeof(path), "%s/%s", r->dir, m->name);
+      m->fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+      if (m->fd < 0)
+        continue; // no reader (ENXIO): nobody to tell
+      struct stat st;
+      if (fstat(m->fd, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+        close(m->fd);
+        m->fd = -1;
+        m->not_fifo = true;
+        continue;
+      }
+    }
+    if (m->count == m->cap) {
+      int cap = m->cap ? m->cap * 2 : 16;
+      struct chat_msg **q = malloc(sizeof(struct chat_msg *) * cap);
+      for (int i = 0; i < m->count; i++)
+        q[i] = m->queue[(m->head + i) % m->cap];
+      free(m->queue);
+      m->queue = q;
+      m->cap = cap;
+      m->head = 0;
+    }
+    m->queue[(m->head + m->count++) % m->cap] = msg;
+    msg->refs++;
+    chat_member_flush(m);
+  }
+}
+
+// Shared-memory room (chatroom -s): /tmp/chatroom-<room>/.ring is mapped by
+// every member and holds a ring of message slots. A sender claims a sequence
+// number with one atomic add, fills the slot and publishes it; every member
+// keeps its own read cursor. Readers sleep on a futex word in the mapping
+// that senders bump after each message, so one message costs one write no
+// matter how many members there are.
+#define CHAT_RING_MAGIC 0x53484352u // "SHCR"
+#define CHAT_RING_SLOTS 4096
+#define CHAT_SLOT_DATA 1000
+// a claimed slot still unpublished after this long, while later ones are
+// claimed too, belongs to a sender that died: readers skip it
+#define CHAT_SLOT_TIMEOUT_MS 500
+
+struct chat_slot {
+  _Atomic uint64_t seq; // n + 1 once message n is in the slot, 0 while written
+  int32_t pid;          // sender, so members skip their own messages
+  uint32_t len;
+  char data[CHAT_SLOT_DATA];
+};
+
+struct chat_ring {
+  _Atomic uint32_t magic; // set last by the member that created the room
+  uint32_t slots;
+  _Atomic uint64_t head;  // next sequence number to hand out
+  _Atomic uint32_t futex; // bumped after every message
+  _Atomic uint32_t waiters;
+  struct chat_slot slot[CHAT_RING_SLOTS];
+};
+
+static long chat_futex(_Atomic uint32_t *addr, int op, uint32_t val,
+                       const struct timespec *timeout) {
+  return syscall(SYS_futex, (uint32_t *)addr, op, val, timeout, NULL, 0);
+}
+
+static struct chat_ring *chat_ring_open(const char *roomdir) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/.ring", roomdir) >= (int)sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  bool created = true;
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0 && errno == EEXIST) {
+    created = false;
+    fd = open(path, O_RDWR | O_CLOEXEC);
+  }
+  if (fd < 0)
+    return NULL;
+  if (created && ftruncate(fd, sizeof(struct chat_ring)) != 0) {
+    close(fd);
+    unlink(path);
+    return NULL;
+  }
+  // the creator may still be sizing the file
+  struct stat st;
+  for (int i = 0; i < 1000 && fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(struct chat_ring); i++)
+    usleep(1000);
+  struct chat_ring *ring = mmap(NULL, sizeof(struct chat_ring), PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED)
+    return NULL;
+  if (created) {
+    ring->slots = CHAT_RING_SLOTS;
+    atomic_store(&ring->magic, CHAT_RING_MAGIC);
+  }
+  for (int i = 0; i < 1000 && atomic_load(&ring->magic) != CHAT_RING_MAGIC; i++)
+    usleep(1000);
+  if (atomic_load(&ring->magic) != CHAT_RING_MAGIC) {
+    munmap(ring, sizeof(struct chat_ring));
+    errno = EPROTO;
+    return NULL;
+  }
+  return ring;
+}
+
+static void chat_ring_send(struct chat_ring *ring, const char *msg, size_t len) {
+  uint64_t n = atomic_fetch_add(&ring->head, 1);
+  struct chat_slot *s = &ring->slot[n % ring->slots];
+  atomic_store(&s->seq, 0);
+  if (len > CHAT_SLOT_DATA)
+    len = CHAT_SLOT_DATA;
+  s->pid = getpid();
+  s->len = len;
+  memcpy(s->data, msg, len);
+  // a cut message still ends its line, readers only show complete lines
+  if (len > 0 && s->data[len - 1] != '\n')
+    s->data[len - 1] = '\n';
+  atomic_store(&s->seq, n + 1);
+
+  atomic_fetch_add(&ring->futex, 1);
+  if (atomic_load(&ring->waiters) > 0)
+    chat_futex(&ring->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+// a member's reader: copies new messages from the ring into a local pipe
+// that the chatroom poll() loop reads like the fifo
+struct chat_ring_reader {
+  struct chat_ring *ring;
+  int out_fd;
+  _Atomic bool stop;
+  pthread_t thread;
+};
+
+static void *chat_ring_reader_main(void *arg) {
+  struct chat_ring_reader *r = arg;
+  struct chat_ring *ring = r->ring;
+  uint64_t cursor = atomic_load(&ring->head); // only messages from now on
+  pid_t self = getpid();
+  char buf[CHAT_SLOT_DATA + 64];
+  uint64_t stalled = UINT64_MAX; // slot we have been waiting on since stall_start
+  struct timespec stall_start = {0}, now;
+  const struct timespec timeout = {0, CHAT_SLOT_TIMEOUT_MS * 1000000L};
+
+  while (!atomic_load(&r->stop)) {
+    atomic_fetch_add(&ring->waiters, 1);
+    uint32_t v = atomic_load(&ring->futex);
+    struct chat_slot *s = &ring->slot[cursor % ring->slots];
+    uint64_t seq = atomic_load(&s->seq);
+    uint64_t claimed = atomic_load(&ring->head);
+    if (seq != cursor + 1 && claimed <= cursor + ring->slots && !atomic_load(&r->stop)) {
+      if (claimed <= cursor + 1) {
+        // nothing new (or the last one is still being written): sleep until
+        // a sender bumps the futex word
+        chat_futex(&ring->futex, FUTEX_WAIT, v, NULL);
+        atomic_fetch_sub(&ring->waiters, 1);
+        continue;
+      }
+      // later messages come in but this one is not published: its sender
+      // may have died after claiming the slot, so don't wait forever
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (stalled != cursor) {
+        stalled = cursor;
+        stall_start = now;
+      } else if (timespec_diff(stall_start, now) * 1000 >= CHAT_SLOT_TIMEOUT_MS) {
+        atomic_fetch_sub(&ring->waiters, 1);
+        int n = snprintf(buf, sizeof(buf), "[missed 1 message]\n");
+        if (write(r->out_fd, buf, n) < 0)
+          break;
+        cursor++;
+        continue;
+      }
+      chat_futex(&ring->futex, FUTEX_WAIT, v, &timeout);
+      atomic_fetch_sub(&ring->waiters, 1);
+      continue;
+    }
+    atomic_fetch_sub(&ring->waiters, 1);
+    if (atomic_load(&r->stop))
+      break;
+
+    uint64_t head = atomic_load(&ring->head);
+    if (head > cursor + ring->slots || (seq > cursor + 1 && seq != 0)) {
+      // we were lapped: the slots we still wanted are overwritten
+      uint64_t next = head > ring->slots ? head - ring->slots + 1 : 0;
+      int n = snprintf(buf, sizeof(buf), "[missed %llu messages]\n",
+                       (unsigned long long)(next - cursor));
+      if (write(r->out_fd, buf, n) < 0)
+        break;
+      cursor = next;
+      continue;
+    }
+
+    // copy, then check the slot was not reused meanwhile
+    uint32_t len = s->len < CHAT_SLOT_DATA ? s->len : CHAT_SLOT_DATA;
+    pid_t from = s->pid;
+    memcpy(buf, s->data, len);
+    if (atomic_load(&s->seq) != cursor + 1)
+      continue; // overwritten while copying, handled as lapped above
+    cursor++;
+    if (from != self && write(r->out_fd, buf, len) < 0)
+      break; // the room is closing
+  }
+  return NULL;
+}
+
+static void chat_ring_reader_stop(struct chat_ring_reader *r) {
+  atomic_store(&r->stop, true);
+  atomic_fetch_add(&r->ring->futex, 1);
+  chat_futex(&r->ring->futex, FUTEX_WAKE, INT_MAX, NULL);
+  pthread_join(r->thread, NULL);
+}
+
+// Builtin command: chatroom [-s] <roomname> <username>
+// Uses /tmp/chatroom-<roomname>/ and named pipes for each user, or with -s
+// the shared-memory ring in that directory.
+// One poll() loop waits on stdin, our own fifo, the room directory
+// (inotify) and members that still have queued messages, so messages show
+// up as soon as they are written and nothing runs while the room is idle.
+static int builtin_chatroom(struct command_t *command) {
+  int a = 1;
+  bool use_ring = false;
+  if (command->args[1] != NULL &&
+      (strcmp(command->args[1], "-s") == 0 || strcmp(command->args[1], "--shm") == 0)) {
+    use_ring = true;
+    a = 2;
+  }
+  if (command->args[a] == NULL || command->args[a + 1] == NULL) {
+    fprintf(stderr, "-%s: chatroom: usage: chatroom [-s] <roomname> <username>\n", sysname);
+    return 2;
+  }
+
+  const char *room = command->args[a];
+  const char *user = command->args[a + 1];
+
+  char roomdir[PATH_MAX];
   snprintf(roomdir, sizeof(roomdir), "/tmp/chatroom-%s", room);
 
-  // create room directory if needed
-  if (ensure_dir_exists(roomdir) != 0) {
-    fprintf(stderr, "-%s: chatroom: %s\n", sysname, strerror(errno));
+  // create room directory if needed
+  if (ensure_dir_exists(roomdir) != 0) {
+    fprintf(stderr, "-%s: chatroom: %s\n", sysname, strerror(errno));
+    return 1;
+  }
+
+  // a member that left must not kill us with SIGPIPE (forked builtins run
+  // with the default action)
+  struct sigaction ignore_pipe = {.sa_handler = SIG_IGN}, old_pipe;
+  sigaction(SIGPIPE, &ignore_pipe, &old_pipe);
+
+  char myfifo[PATH_MAX];
+  snprintf(myfifo, sizeof(myfifo), "%s/%s", roomdir, user);
+  int in_fd = -1, keep_fd = -1;
+  struct chat_ring_reader reader = {0};
+
+  if (use_ring) {
+    // messages come from the ring through a reader thread and a local pipe
+    int p[2];
+    reader.ring = chat_ring_open(roomdir);
+    if (reader.ring == NULL || pipe2(p, O_CLOEXEC) != 0) {
+      fprintf(stderr, "-%s: chatroom: %s/.ring: %s\n", sysname, roomdir, strerror(errno));
+      if (reader.ring != NULL) munmap(reader.ring, sizeof(struct chat_ring));
+      sigaction(SIGPIPE, &old_pipe, NULL);
+      return 1;
+    }
+    in_fd = p[0];
+    reader.out_fd = p[1];
+    pthread_create(&reader.thread, NULL, chat_ring_reader_main, &reader);
+  } else {
+    // create our fifo if needed
+    if (ensure_fifo_exists(myfifo) != 0) {
+      fprintf(stderr, "-%s: chatroom: %s\n", sysname, strerror(errno));
+      sigaction(SIGPIPE, &old_pipe, NULL);
+      return 1;
+    }
+
+    // we also hold a write end of our own fifo, so it never reports EOF
+    // (POLLHUP) when no other member has it open
+    in_fd = open(myfifo, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    keep_fd = open(myfifo, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (in_fd < 0 || keep_fd < 0) {
+      fprintf(stderr, "-%s: chatroom: %s: %s\n", sysname, myfifo, strerror(errno));
+      if (in_fd >= 0) close(in_fd);
+      if (keep_fd >= 0) close(keep_fd);
+      sigaction(SIGPIPE, &old_pipe, NULL);
+      return 1;
+    }
+  }
+
+  printf("Welcome to %s!\n", room);
+
+  char prompt_str[PATH_MAX];
+  int prompt_len = snprintf(prompt_str, sizeof(prompt_str), "[%s] %s > ", room, user);
+  if (prompt_len >= (int)sizeof(prompt_str)) prompt_len = sizeof(prompt_str) - 1;
+  fputs(prompt_str, stdout);
+  fflush(stdout);
+
+  struct chat_room room_state;
+  if (use_ring) {
+    memset(&room_state, 0, sizeof(room_state));
+    room_state.inotify_fd = -1;
+  } else {
+    chat_room_open(&room_state, roomdir, user);
+  }
+
+  char line[512], inbuf[8192];
+  size_t line_len = 0, in_len = 0;
+  bool done = false;
+  int status = 0;
+  struct pollfd *pfd = NULL;
+  int pfd_cap = 0;
+  while (!done) {
+    // stdin, our fifo, member list changes, and members with a backlog
+    int npfd = 3;
+    for (struct chat_member *mb = room_state.members; mb != NULL; mb = mb->next)
+      npfd++;
+    if (npfd > pfd_cap) {
+      pfd_cap = npfd * 2;
+      pfd = realloc(pfd, sizeof(struct pollfd) * pfd_cap);
+    }
+    pfd[0] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+    pfd[1] = (struct pollfd){.fd = in_fd, .events = POLLIN};
+    pfd[2] = (struct pollfd){.fd = room_state.inotify_fd, .events = POLLIN};
+    npfd = 3;
+    for (struct chat_member *mb = room_state.members; mb != NULL; mb = mb->next)
+      if (mb->count > 0 && mb->fd >= 0)
+        pfd[npfd++] = (struct pollfd){.fd = mb->fd, .events = POLLOUT};
+
+    if (poll(pfd, npfd, -1) < 0) {
+      if (errno != EINTR)
+        break;
+      if (interrupted) { // Ctrl-C leaves the room like /exit
+        write(STDOUT_FILENO, "\n", 1);
+        status = 130;
+        break;
+      }
+      continue;
+    }
+    if (pfd[2].revents & POLLIN)
+      chat_room_update(&room_state);
+    if (npfd > 3)
+      for (struct chat_member *mb = room_state.members; mb != NULL; mb = mb->next)
+        chat_member_flush(mb);
+
+    // incoming messages: show the complete lines above a fresh prompt
+    if (pfd[1].revents & POLLIN) {
+      ssize_t n = read(in_fd, inbuf + in_len, sizeof(inbuf) - in_len);
+      if (n > 0) {
+        in_len += (size_t)n;
+        char *last = memrchr(inbuf, '\n', in_len);
+        if (last == NULL && in_len == sizeof(inbuf))
+          last = inbuf + in_len - 1;
+        if (last != NULL) {
+          size_t shown = (size_t)(last + 1 - inbuf);
+          write(STDOUT_FILENO, "\r\033[K", 4);
+          write(STDOUT_FILENO, inbuf, shown);
+          write(STDOUT_FILENO, prompt_str, (size_t)prompt_len);
+          in_len -= shown;
+          memmove(inbuf, inbuf + shown, in_len);
+        }
+      }
+    }
+
+    if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+      continue;
+    ssize_t n = read(STDIN_FILENO, line + line_len, sizeof(line) - 1 - line_len);
+    if (n <= 0) break; // EOF on stdin
+    line_len += (size_t)n;
+
+    // handle every complete line we have (a long line is cut at 511 bytes)
+    char *start = line, *nl;
+    while ((nl = memchr(start, '\n', line + line_len - start)) != NULL ||
+           (start == line && line_len == sizeof(line) - 1)) {
+      size_t len = nl ? (size_t)(nl - start) : line_len;
+      if (len == 5 && memcmp(start, "/exit", 5) == 0) {
+        done = true;
+        break;
+      }
+
+      // format message like [room] user: msg
+      char msg[1024];
+      int m = snprintf(msg, sizeof(msg), "[%s] %s: %.*s\n", room, user, (int)len, start);
+      start += nl ? len + 1 : len;
+      if (m <= 0) continue;
+      if (m >= (int)sizeof(msg)) m = sizeof(msg) - 1;
+
+      struct chat_msg *cm = malloc(sizeof(struct chat_msg) + m);
+      cm->refs = 1;
+      cm->len = m;
+      memcpy(cm->data, msg, m);
+      if (use_ring)
+        chat_ring_send(reader.ring, cm->data, cm->len);
+      else
+        chat_broadcast(&room_state, cm);
+      chat_msg_unref(cm);
+      write(STDOUT_FILENO, prompt_str, (size_t)prompt_len);
+    }
+    line_len -= (size_t)(start - line);
+    memmove(line, start, line_len);
+  }
+
+  // whatever slow members did not take yet is dropped with the room
+  chat_room_close(&room_state);
+  free(pfd);
+  close(in_fd);
+  if (use_ring) {
+    // the reader may be blocked writing to the pipe we just closed (EPIPE)
+    chat_ring_reader_stop(&reader);
+    close(reader.out_fd);
+    munmap(reader.ring, sizeof(struct chat_ring));
+  } else {
+    close(keep_fd);
+    // remove our fifo when leaving
+    unlink(myfifo);
+  }
+  sigaction(SIGPIPE, &old_pipe, NULL);
+  return status;
+}
+
+// ---- parallel ----
+//
+// parallel [-j N] [-k] [--joblog file] command [arg ...] [::: item ...]
+// Runs command once for every item (the lines of stdin, or the words after
+// :::) with at most N commands running at a time. {} in an argument is
+// replaced by the item, {.} by the item without its extension and {/} by
+// its base name; without any of them the item is added as the last
+// argument. The output of every command is collected and written in one
+// piece when it ends, so lines of different commands never mix.
+//
+// parallel always runs in a forked child of the shell (it is one job, so
+// Ctrl-C and Ctrl-Z reach all its commands). There it can wait4() its own
+// commands, which the SIGCHLD handler of the shell would otherwise reap.
+
+struct par_job {
+  long seq;           // item number
+  pid_t pid;
+  int pidfd;          // -1 after the exit was collected, PAR_NO_PIDFD: no pidfd
+  int out_fd;         // read ends of the command's stdout/stderr, -1 at EOF
+  int err_fd;
+  struct out_buf out;
+  struct out_buf err;
+  struct timespec start;
+  struct timespec end;
+  int status;
+  struct rusage ru;
+  char *cmd;          // command line with the item, for the job log
+};
+
+// pidfd_open() needs Linux 5.3; without a pidfd the exit is collected with
+// wait4(WNOHANG), polling every PAR_REAP_MS once the job's output is closed
+#define PAR_NO_PIDFD -2
+#define PAR_REAP_MS 10
+
+// where items come from: the words after ::: or the lines of a fd
+struct par_items {
+  char **words;
+  int nwords;
+  int next_word;
+  int fd;
+  struct out_buf buf; // lines read but not used yet, from pos
+  size_t pos;
+  bool eof;
+};
+
+// next item, or NULL if there is none now (at the end, or more has to be read)
+static char *par_next_item(struct par_items *src) {
+  if (src->words != NULL)
+    return src->next_word < src->nwords ? strdup(src->words[src->next_word++]) : NULL;
+  while (1) {
+    char *start = src->buf.data + src->pos;
+    size_t avail = src->buf.len - src->pos;
+    char *nl = memchr(start, '\n', avail);
+    if (nl == NULL && !src->eof)
+      return NULL;
+    size_t n = nl != NULL ? (size_t)(nl - start) : avail;
+    if (nl == NULL && n == 0)
+      return NULL; // end of input
+    src->pos += n + (nl != NULL);
+    if (n > 0)
+      return strndup(start, n); // empty lines are skipped
+  }
+}
+
+// read more lines from the item fd; sets eof at the end
+static void par_read_items(struct par_items *src) {
+  struct out_buf *b = &src->buf;
+  if (src->pos > 0) {
+    memmove(b->data, b->data + src->pos, b->len - src->pos);
+    b->len -= src->pos;
+    src->pos = 0;
+  }
+  if (b->cap - b->len < 4096) {
+    b->cap *= 2;
+    b->data = realloc(b->data, b->cap);
+  }
+  ssize_t n = read(src->fd, b->data + b->len, b->cap - b->len);
+  if (n > 0)
+    b->len += (size_t)n;
+  else if (n == 0 || errno != EINTR)
+    src->eof = true;
+}
+
+// one argument of the command with {}, {.} and {/} replaced
+static char *par_subst(const char *arg, const char *item, bool *used) {
+  const char *base = strrchr(item, '/') ? strrchr(item, '/') + 1 : item;
+  const char *dot = strrchr(base, '.');
+  size_t noext = dot != NULL && dot != base ? (size_t)(dot - item) : strlen(item);
+
+  struct out_buf ob = {.data = malloc(64), .cap = 64, .fd = -1};
+  for (const char *p = arg; *p != '\0';) {
+    if (strncmp(p, "{}", 2) == 0) {
+      out_put(&ob, item, strlen(item));
+      p += 2;
+    } else if (strncmp(p, "{.}", 3) == 0) {
+      out_put(&ob, item, noext);
+      p += 3;
+    } else if (strncmp(p, "{/}", 3) == 0) {
+      out_put(&ob, base, strlen(base));
+      p += 3;
+    } else {
+      out_put(&ob, p++, 1);
+      continue;
+    }
+    *used = true;
+  }
+  out_put(&ob, "", 1);
+  return ob.data;
+}
+
+// read what is there from one of the job's pipes; closes it at EOF
+static void par_drain(int *fd, struct out_buf *ob) {
+  if (ob->cap - ob->len < 4096) {
+    ob->cap *= 2;
+    ob->data = realloc(ob->data, ob->cap);
+  }
+  ssize_t n = read(*fd, ob->data + ob->len, ob->cap - ob->len);
+  if (n > 0) {
+    ob->len += (size_t)n;
+  } else if (n == 0 || errno != EINTR) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+// start the command for item in pj; returns -1 (after printing why) on error
+static int par_start(struct par_job *pj, const char *path, char **tmpl, int ntmpl,
+                     const char *item, bool log) {
+  // argv of the command; the item goes last if no argument has {}
+  char **argv = calloc(ntmpl + 2, sizeof(char *));
+  bool used = false;
+  for (int i = 0; i < ntmpl; i++)
+    argv[i] = par_subst(tmpl[i], item, &used);
+  if (!used)
+    argv[ntmpl] = strdup(item);
+
+  int out[2], err[2];
+  if (pipe2(out, O_CLOEXEC) < 0) {
+    fprintf(stderr, "-%s: parallel: %s\n", sysname, strerror(errno));
+    for (int i = 0; argv[i] != NULL; i++) free(argv[i]);
+    free(argv);
+    return -1;
+  }
+  if (pipe2(err, O_CLOEXEC) < 0) {
+    fprintf(stderr, "-%s: parallel: %s\n", sysname, strerror(errno));
+    close(out[0]);
+    close(out[1]);
+    for (int i = 0; argv[i] != NULL; i++) free(argv[i]);
+    free(argv);
+    return -1;
+  }
+
+  // the command gets the default signals back, /dev/null as stdin (the
+  // items are ours) and nothing but fds 0-2
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+#if __GLIBC_PREREQ(2, 34)
+  posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#endif
+  posix_spawnattr_t attr;
+  sigset_t sigdef;
+  posix_spawnattr_init(&attr);
+  sigemptyset(&sigdef);
+  for (int i = 0; i < JOB_SIGNALS_N; i++)
+    sigaddset(&sigdef, job_signals[i]);
+  posix_spawnattr_setsigdefault(&attr, &sigdef);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+  pid_t pid;
+  int perr = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  int pidfd = -1;
+  if (perr != 0) {
+    errno = perr;
+    pid = -1;
+  } else if ((pidfd = (int)syscall(SYS_pidfd_open, pid, 0)) < 0) {
+    pidfd = PAR_NO_PIDFD;
+  }
+  close(out[1]);
+  close(err[1]);
+
+  if (pid < 0) {
+    fprintf(stderr, "-%s: parallel: %s: %s\n", sysname, argv[0], strerror(errno));
+    close(out[0]);
+    close(err[0]);
+  } else {
+    memset(pj, 0, sizeof(*pj));
+    pj->pid = pid;
+    pj->pidfd = pidfd;
+    pj->out_fd = out[0];
+    pj->err_fd = err[0];
+    pj->out = (struct out_buf){.data = malloc(4096), .cap = 4096, .fd = -1};
+    pj->err = (struct out_buf){.data = malloc(4096), .cap = 4096, .fd = -1};
+    clock_gettime(CLOCK_MONOTONIC, &pj->start);
+
+    // the command line is only kept for the job log
+    if (log) {
+      struct out_buf cmd = {.data = malloc(256), .cap = 256, .fd = -1};
+      for (int i = 0; argv[i] != NULL; i++) {
+        if (i > 0) out_put(&cmd, " ", 1);
+        out_put(&cmd, argv[i], strlen(argv[i]));
+      }
+      out_put(&cmd, "", 1);
+      pj->cmd = cmd.data;
+    }
+  }
+  for (int i = 0; argv[i] != NULL; i++) free(argv[i]);
+  free(argv);
+  return pid < 0 ? -1 : 0;
+}
+
+// write the collected output of a finished job; false if out_fd is gone
+static bool par_emit(struct par_job *pj, int out_fd) {
+  pj->out.fd = out_fd;
+  out_flush(&pj->out);
+  pj->err.fd = STDERR_FILENO;
+  out_flush(&pj->err);
+  bool ok = !pj->out.failed;
+  free(pj->out.data);
+  free(pj->err.data);
+  free(pj->cmd);
+  return ok;
+}
+
+// Builtin command: parallel [-j N] [-k] [--joblog file] command [arg ...] [::: item ...]
+// Exit status is the number of failed commands (at most 101).
+static int builtin_parallel(struct command_t *command, int in_fd, int out_fd) {
+  long njobs = sysconf(_SC_NPROCESSORS_ONLN);
+  bool keep_order = false;
+  const char *joblog_path = NULL;
+  int i = 1;
+  for (; command->args[i] != NULL && command->args[i][0] == '-'; i++) {
+    const char *a = command->args[i];
+    if (strcmp(a, "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(a, "-k") == 0) {
+      keep_order = true;
+    } else if (strcmp(a, "--joblog") == 0 && command->args[i + 1] != NULL) {
+      joblog_path = command->args[++i];
+    } else if (strncmp(a, "-j", 2) == 0 && (a[2] != '\0' || command->args[i + 1] != NULL)) {
+      njobs = parse_positive_int(a[2] != '\0' ? a + 2 : command->args[++i]);
+      if (njobs <= 0) {
+        fprintf(stderr, "-%s: parallel: -j needs a positive number\n", sysname);
+        return 2;
+      }
+    } else {
+      break; // e.g. a command starting with '-'
+    }
+  }
+
+  char **tmpl = &command->args[i];
+  int ntmpl = 0;
+  while (tmpl[ntmpl] != NULL && strcmp(tmpl[ntmpl], ":::") != 0)
+    ntmpl++;
+  if (ntmpl == 0) {
+    fprintf(stderr, "-%s: parallel: usage: parallel [-j N] [-k] command [arg ...] [::: item ...]\n",
+            sysname);
+    return 2;
+  }
+
+  struct par_items src = {.fd = in_fd};
+  if (tmpl[ntmpl] != NULL) {
+    src.words = &tmpl[ntmpl + 1];
+    while (src.words[src.nwords] != NULL)
+      src.nwords++;
+    src.eof = true;
+  } else {
+    src.buf = (struct out_buf){.data = malloc(64 * 1024), .cap = 64 * 1024, .fd = -1};
+  }
+
+  char *path = resolve_path(tmpl[0]);
+  if (path == NULL) {
+    fprintf(stderr, "-%s: parallel: %s: command not found\n", sysname, tmpl[0]);
+    free(src.buf.data);
+    return 127;
+  }
+
+  // a record for every command goes to --joblog and the SHELLISH_STATS file
+  // (the shell's own record ring is in the parent process)
+  struct out_buf logs[2] = {{.fd = -1}, {.fd = -1}};
+  const char *log_paths[2] = {joblog_path, stats.log_path};
+  for (int k = 0; k < 2; k++) {
+    if (log_paths[k] == NULL) continue;
+    logs[k].fd = open(log_paths[k], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (logs[k].fd < 0) {
+      fprintf(stderr, "-%s: parallel: %s: %s\n", sysname, log_paths[k], strerror(errno));
+      continue;
+    }
+    logs[k].cap = 4096;
+    logs[k].data = malloc(logs[k].cap);
+  }
+  bool log = logs[0].fd != -1 || logs[1].fd != -1;
+
+  // running jobs; with -k finished jobs wait in held[] (by item number)
+  // until all earlier ones were written
+  struct par_job *slots = calloc(njobs, sizeof(struct par_job));
+  struct par_job **held = NULL;
+  long held_cap = 0, next_out = 0, seq = 0;
+  int nrunning = 0, failed = 0;
+  bool stop = false; // Ctrl-C, or nobody reads our output any more
+  struct pollfd *pfd = calloc(3 * njobs + 1, sizeof(struct pollfd));
+  int *owner = calloc(3 * njobs + 1, sizeof(int));
+
+  while (1) {
+    // keep all slots busy: a slot that frees up takes the next item
+    while (!stop && nrunning < njobs) {
+      char *item = par_next_item(&src);
+      if (item == NULL)
+        break;
+      struct par_job *pj = &slots[nrunning];
+      if (par_start(pj, path, tmpl, ntmpl, item, log) == 0) {
+        pj->seq = seq++;
+        nrunning++;
+      } else {
+        failed++; // e.g. EAGAIN: counted, the other items still run
+      }
+      free(item);
+    }
+    if (nrunning == 0 && (src.eof || stop))
+      break;
+
+    int n = 0;
+    if (!src.eof && !stop && nrunning < njobs) {
+      pfd[n] = (struct pollfd){src.fd, POLLIN, 0};
+      owner[n++] = -1;
+    }
+    int timeout = -1;
+    for (int k = 0; k < nrunning; k++) {
+      int fds[3] = {slots[k].pidfd, slots[k].out_fd, slots[k].err_fd};
+      for (int f = 0; f < 3; f++) {
+        if (fds[f] < 0) continue;
+        pfd[n] = (struct pollfd){fds[f], POLLIN, 0};
+        owner[n++] = k;
+      }
+      if (fds[0] == PAR_NO_PIDFD && fds[1] < 0 && fds[2] < 0)
+        timeout = PAR_REAP_MS; // only its exit is missing
+    }
+    if (poll(pfd, n, timeout) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "-%s: parallel: %s\n", sysname, strerror(errno));
+      break;
+    }
+
+    for (int p = 0; p < n; p++) {
+      if (pfd[p].revents == 0) continue;
+      if (owner[p] < 0) {
+        par_read_items(&src);
+        continue;
+      }
+      struct par_job *pj = &slots[owner[p]];
+      if (pfd[p].fd == pj->out_fd) {
+        par_drain(&pj->out_fd, &pj->out);
+      } else if (pfd[p].fd == pj->err_fd) {
+        par_drain(&pj->err_fd, &pj->err);
+      } else {
+        wait4(pj->pid, &pj->status, 0, &pj->ru);
+        clock_gettime(CLOCK_MONOTONIC, &pj->end);
+        close(pj->pidfd);
+        pj->pidfd = -1;
+      }
+    }
+
+    // jobs that exited and closed their output are done
+    for (int k = 0; k < nrunning; k++) {
+      struct par_job *pj = &slots[k];
+      if (pj->pidfd == PAR_NO_PIDFD && wait4(pj->pid, &pj->status, WNOHANG, &pj->ru) == pj->pid) {
+        clock_gettime(CLOCK_MONOTONIC, &pj->end);
+        pj->pidfd = -1;
+      }
+      if (pj->pidfd != -1 || pj->out_fd >= 0 || pj->err_fd >= 0)
+        continue;
+      if (pj->status != 0)
+        failed++;
+      if (WIFSIGNALED(pj->status) && WTERMSIG(pj->status) == SIGINT)
+        stop = true;
+      if (pj->cmd != NULL) {
+        struct stats_rec r = {
+            .when = stats_wall_time(pj->start),
+            .wall = timespec_diff(pj->start, pj->end),
+            .user = timeval_sec(pj->ru.ru_utime),
+            .sys = timeval_sec(pj->ru.ru_stime),
+            .maxrss = pj->ru.ru_maxrss,
+            .status = status_code(pj->status),
+            .stage = -1,
+            .nstages = 1,
+            .pid = pj->pid,
+            .cmd = pj->cmd,
+        };
+        for (int l = 0; l < 2; l++)
+          if (logs[l].fd != -1) stats_log(&logs[l], &r);
+      }
+
+      if (!keep_order) {
+        if (!par_emit(pj, out_fd)) stop = true;
+      } else {
+        if (pj->seq >= held_cap) {
+          long cap = held_cap ? held_cap : 64;
+          while (cap <= pj->seq) cap *= 2;
+          held = realloc(held, cap * sizeof(*held));
+          memset(held + held_cap, 0, (cap - held_cap) * sizeof(*held));
+          held_cap = cap;
+        }
+        held[pj->seq] = malloc(sizeof(struct par_job));
+        *held[pj->seq] = *pj;
+        for (; next_out < held_cap && held[next_out] != NULL; next_out++) {
+          if (!par_emit(held[next_out], out_fd)) stop = true;
+          free(held[next_out]);
+          held[next_out] = NULL;
+        }
+      }
+      // the last running job moves into the free slot
+      slots[k--] = slots[--nrunning];
+    }
+  }
+
+  free(held); // empty: items get a number only when their command started
+  for (int k = 0; k < 2; k++) {
+    if (logs[k].fd != -1) close(logs[k].fd);
+    free(logs[k].data);
+  }
+  free(pfd);
+  free(owner);
+  free(slots);
+  free(path);
+  free(src.buf.data);
+  return failed > 101 ? 101 : failed;
+}
+
+// ---- helpers for cut ----
+
+// Delimiter scanner: returns first byte in [p, end) that is delim or '\n',
+// or end if there is none. The best version for the CPU is picked at runtime.
+typedef const char *(*cut_scan_fn)(const char *p, const char *end, char delim);
+
+static const char *cut_scan_scalar(const char *p, const char *end, char delim) {
+  while (p < end && *p != delim && *p != '\n')
+    p++;
+  return p;
+}
+
+#ifdef CUT_SIMD_X86
+// 16 bytes per step: compare with delim and '\n', take the first match
+static const char *cut_scan_sse2(const char *p, const char *end, char delim) {
+  const __m128i vd = _mm_set1_epi8(delim);
+  const __m128i vn = _mm_set1_epi8('\n');
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, vd), _mm_cmpeq_epi8(v, vn)));
+    if (mask != 0)
+      return p + __builtin_ctz((unsigned int)mask);
+    p += 16;
+  }
+  return cut_scan_scalar(p, end, delim);
+}
+
+// same with 32 bytes per step
+__attribute__((target("avx2")))
+static const char *cut_scan_avx2(const char *p, const char *end, char delim) {
+  const __m256i vd = _mm256_set1_epi8(delim);
+  const __m256i vn = _mm256_set1_epi8('\n');
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    int mask = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, vd), _mm256_cmpeq_epi8(v, vn)));
+    if (mask != 0)
+      return p + __builtin_ctz((unsigned int)mask);
+    p += 32;
+  }
+  return cut_scan_sse2(p, end, delim);
+}
+#endif
+
+static cut_scan_fn cut_select_scanner(void) {
+#ifdef CUT_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return cut_scan_avx2;
+  return cut_scan_sse2;
+#else
+  return cut_scan_scalar;
+#endif
+}
+
+#define CUT_BLOCK_SIZE (1024 * 1024)
+
+enum cut_mode { CUT_FIELDS, CUT_BYTES, CUT_CHARS };
+
+// selected positions lo..hi (1-based, inclusive; hi = SIZE_MAX for "N-")
+struct cut_range {
+  size_t lo;
+  size_t hi;
+};
+
+// Compiled cut options. The list (-f/-b/-c) is turned into sorted,
+// non-overlapping ranges once (already inverted for --complement), so each
+// line is walked left to right only up to max_pos.
+struct cut_opts {
+  enum cut_mode mode;
+  char delim;
+  const char *out_delim;
+  size_t out_delim_len;
+  bool out_delim_set;  // --output-delimiter given (used by -b/-c too)
+  bool only_delimited; // -s: skip lines without delimiter
+  bool complement;
+  struct cut_range *ranges;
+  size_t ranges_n;
+  size_t max_pos; // highest selected position, SIZE_MAX if open-ended
+  cut_scan_fn scan;
+};
+
+static int cut_range_cmp(const void *a, const void *b) {
+  const struct cut_range *x = a, *y = b;
+  if (x->lo != y->lo) return x->lo < y->lo ? -1 : 1;
+  return 0;
+}
+
+// parse a number of a list, returns 0 if not valid
+static size_t cut_parse_pos(const char *s, size_t len) {
+  if (len == 0) return 0;
+  size_t x = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] < '0' || s[i] > '9') return 0;
+    if (x > (SIZE_MAX - 9) / 10) return 0;
+    x = x * 10 + (size_t)(s[i] - '0');
+  }
+  return x;
+}
+
+// Compile a list like "1,3-5,7-" (also "-3") into opts->ranges.
+// Returns -1 (after printing the error) if the list is not valid.
+static int cut_compile_list(struct cut_opts *opts, const char *list) {
+  struct cut_range *r = NULL;
+  size_t n = 0;
+
+  for (const char *p = list; *p != '\0';) {
+    const char *comma = strchr(p, ',');
+    size_t len = comma ? (size_t)(comma - p) : strlen(p);
+    const char *dash = memchr(p, '-', len);
+    struct cut_range cr;
+
+    if (dash == NULL) {
+      cr.lo = cr.hi = cut_parse_pos(p, len);
+    } else {
+      size_t left = (size_t)(dash - p), right = len - left - 1;
+      cr.lo = left == 0 ? 1 : cut_parse_pos(p, left);
+      cr.hi = right == 0 ? SIZE_MAX : cut_parse_pos(dash + 1, right);
+      if (left == 0 && right == 0) cr.lo = 0; // just "-"
+    }
+    if (cr.lo == 0 || cr.hi == 0) {
+      fprintf(stderr, "-%s: cut: invalid list: '%s' (positions start at 1)\n", sysname, list);
+      free(r);
+      return -1;
+    }
+    if (cr.hi < cr.lo) {
+      fprintf(stderr, "-%s: cut: invalid decreasing range in '%s'\n", sysname, list);
+      free(r);
+      return -1;
+    }
+    r = realloc(r, sizeof(struct cut_range) * (n + 1));
+    r[n++] = cr;
+
+    if (comma == NULL) break;
+    p = comma + 1;
+  }
+  if (n == 0) {
+    fprintf(stderr, "-%s: cut: empty list\n", sysname);
+    return -1;
+  }
+
+  // sort and merge overlapping / touching ranges
+  qsort(r, n, sizeof(struct cut_range), cut_range_cmp);
+  size_t m = 0;
+  for (size_t i = 1; i < n; i++) {
+    if (r[m].hi == SIZE_MAX || r[i].lo <= r[m].hi + 1) {
+      if (r[i].hi > r[m].hi) r[m].hi = r[i].hi;
+    } else {
+      r[++m] = r[i];
+    }
+  }
+  n = m + 1;
+
+  // --complement: keep the gaps between the ranges instead
+  if (opts->complement) {
+    struct cut_range *c = malloc(sizeof(struct cut_range) * (n + 1));
+    size_t cn = 0, next = 1;
+    bool open_end = false;
+    for (size_t i = 0; i < n; i++) {
+      if (r[i].lo > next) {
+        c[cn].lo = next;
+        c[cn++].hi = r[i].lo - 1;
+      }
+      if (r[i].hi == SIZE_MAX) {
+        open_end = true;
+        break;
+      }
+      next = r[i].hi + 1;
+    }
+    if (!open_end) {
+      c[cn].lo = next;
+      c[cn++].hi = SIZE_MAX;
+    }
+    free(r);
+    r = c;
+    n = cn;
+  }
+
+  opts->ranges = r;
+  opts->ranges_n = n;
+  opts->max_pos = n > 0 ? r[n - 1].hi : 0;
+  return 0;
+}
+
+static void cut_put_out_delim(const struct cut_opts *opts, struct out_buf *ob) {
+  out_put(ob, opts->out_delim, opts->out_delim_len);
+}
+
+// Cut fields of the line starting at p. Fields are printed while scanning
+// and scanning stops after max_pos (the rest is skipped with memchr).
+// Returns the start of the next line.
+static const char *cut_fields_line(const struct cut_opts *opts, const char *p,
+                                   const char *end, struct out_buf *ob) {
+  const char *line = p;
+  const char *q = opts->scan(p, end, opts->delim);
+
+  if (q == end || *q == '\n') {
+    // no delimiter: print the whole line (unless -s)
+    if (!opts->only_delimited) {
+      out_put(ob, line, (size_t)(q - line));
+      if (q != end) out_put(ob, "\n", 1);
+    }
+    return q == end ? end : q + 1;
+  }
+
+  size_t field = 1, r = 0;
+  bool first_out = true;
+  while (1) {
+    // field is [p, q)
+    while (r < opts->ranges_n && opts->ranges[r].hi < field) r++;
+    if (r < opts->ranges_n && opts->ranges[r].lo <= field) {
+      if (!first_out) cut_put_out_delim(opts, ob);
+      out_put(ob, p, (size_t)(q - p));
+      first_out = false;
+    }
+    if (q == end || *q == '\n')
+      break;
+    if (field >= opts->max_pos) {
+      // nothing else selected in this line
+      q = memchr(q, '\n', (size_t)(end - q));
+      if (q == NULL) q = end;
+      break;
+    }
+    p = q + 1;
+    field++;
+    q = opts->scan(p, end, opts->delim);
+  }
+
+  if (q != end) out_put(ob, "\n", 1);
+  return q == end ? end : q + 1;
+}
+
+// move forward n UTF-8 characters (not past eol)
+static const char *cut_utf8_skip(const char *c, const char *eol, size_t n) {
+  while (n > 0 && c < eol) {
+    c++;
+    while (c < eol && ((unsigned char)*c & 0xC0) == 0x80)
+      c++;
+    n--;
+  }
+  return c;
+}
+
+// Cut bytes (-b) or characters (-c, UTF-8) of the line starting at p.
+// Every range is copied as one slice. Returns the start of the next line.
+static const char *cut_bytes_line(const struct cut_opts *opts, const char *p,
+                                  const char *end, struct out_buf *ob) {
+  const char *eol = memchr(p, '\n', (size_t)(end - p));
+  if (eol == NULL) eol = end;
+
+  const char *c = p; // -c: position of character number pos
+  size_t pos = 1;
+  bool first_out = true;
+
+  for (size_t i = 0; i < opts->ranges_n; i++) {
+    const struct cut_range *r = &opts->ranges[i];
+    const char *from, *to;
+
+    if (opts->mode == CUT_BYTES) {
+      size_t len = (size_t)(eol - p);
+      if (r->lo > len) break;
+      from = p + r->lo - 1;
+      to = r->hi >= len ? eol : p + r->hi;
+    } else {
+      from = cut_utf8_skip(c, eol, r->lo - pos);
+      to = cut_utf8_skip(from, eol, r->hi - r->lo + 1);
+      if (from == eol) break;
+      c = to;
+      pos = r->hi == SIZE_MAX ? SIZE_MAX : r->hi + 1;
+    }
+
+    if (!first_out && opts->out_delim_set) cut_put_out_delim(opts, ob);
+    out_put(ob, from, (size_t)(to - from));
+    first_out = false;
+  }
+
+  if (eol != end) out_put(ob, "\n", 1);
+  return eol == end ? end : eol + 1;
+}
+
+// Cut all complete lines in [p, end). If at_eof is true, a last line
+// without '\n' is cut too. Returns where the unprocessed part begins.
+static const char *cut_process(const struct cut_opts *opts, const char *p,
+                               const char *end, bool at_eof, struct out_buf *ob) {
+  if (!at_eof) {
+    // only up to the last newline, the rest waits for more data
+    const char *last = memrchr(p, '\n', (size_t)(end - p));
+    if (last == NULL)
+      return p;
+    end = last + 1;
+  }
+
+  while (p < end) {
+    if (opts->mode == CUT_FIELDS)
+      p = cut_fields_line(opts, p, end, ob);
+    else
+      p = cut_bytes_line(opts, p, end, ob);
+  }
+  return p;
+}
+
+// When stdin is a regular file (cut <file), cut works on a mmap of the
+// file instead of read(). Big files are split into chunks that end at a
+// newline; every round, each thread cuts one chunk into its own memory
+// buffer and then the buffers are written in order.
+#define CUT_MMAP_CHUNK (8 * 1024 * 1024)
+#define CUT_MAX_THREADS 8
+
+struct cut_chunk {
+  const struct cut_opts *opts;
+  const char *begin;
+  const char *end;
+  struct out_buf ob; // fd == -1, output stays in memory
+};
+
+static void *cut_chunk_thread(void *arg) {
+  struct cut_chunk *c = arg;
+  cut_process(c->opts, c->begin, c->end, true, &c->ob);
+  return NULL;
+}
+
+// Returns -1 if stdin can't be mapped (not a regular file, empty, ...),
+// so the caller should read() it instead.
+static int cut_mmap_input(const struct cut_opts *opts, int in_fd, struct out_buf *ob) {
+  struct stat st;
+  if (fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode))
+    return -1;
+
+  // start where stdin currently is (normally 0)
+  off_t pos = lseek(in_fd, 0, SEEK_CUR);
+  if (pos < 0 || pos >= st.st_size)
+    return -1;
+
+  char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(map, (size_t)st.st_size, MADV_HUGEPAGE); // only a hint
+#endif
+
+  const char *p = map + pos;
+  const char *end = map + st.st_size;
+
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > CUT_MAX_THREADS) nthreads = CUT_MAX_THREADS;
+
+  if (nthreads <= 1 || end - p <= 2 * CUT_MMAP_CHUNK) {
+    // small file: one pass over the mapping
+    cut_process(opts, p, end, true, ob);
+  } else {
+    struct cut_chunk chunks[CUT_MAX_THREADS];
+    pthread_t threads[CUT_MAX_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    for (int i = 0; i < nthreads; i++) {
+      chunks[i].opts = opts;
+      chunks[i].ob.cap = CUT_MMAP_CHUNK;
+      chunks[i].ob.data = malloc(CUT_MMAP_CHUNK);
+      chunks[i].ob.fd = -1;
+    }
+
+    while (p < end && !ob->failed) {
+      int used = 0;
+      for (; used < nthreads && p < end; used++) {
+        // chunk ends after the first newline past CUT_MMAP_CHUNK bytes
+        const char *q = end;
+        if (end - p > CUT_MMAP_CHUNK) {
+          q = memchr(p + CUT_MMAP_CHUNK, '\n', (size_t)(end - p - CUT_MMAP_CHUNK));
+          q = q ? q + 1 : end;
+        }
+        chunks[used].begin = p;
+        chunks[used].end = q;
+        chunks[used].ob.len = 0;
+        p = q;
+      }
+
+      int started = 0;
+      for (int i = 1; i < used; i++) {
+        if (pthread_create(&threads[i], NULL, cut_chunk_thread, &chunks[i]) != 0)
+          break;
+        started = i;
+      }
+      cut_chunk_thread(&chunks[0]); // main thread takes the first chunk
+      for (int i = 1; i <= started; i++)
+        pthread_join(threads[i], NULL);
+      for (int i = started + 1; i < used; i++)
+        cut_chunk_thread(&chunks[i]); // thread could not be created
+
+      // keep output order: chunk 0 first, then 1, ...
+      for (int i = 0; i < used; i++)
+        out_put(ob, chunks[i].ob.data, chunks[i].ob.len);
+    }
+
+    for (int i = 0; i < nthreads; i++)
+      free(chunks[i].ob.data);
+  }
+
+  munmap(map, (size_t)st.st_size);
+  lseek(in_fd, 0, SEEK_END); // we consumed all of stdin
+  return 0;
+}
+
+// get the value of an option given as "-x VALUE", "-xVALUE",
+// "--long VALUE" or "--long=VALUE". Returns NULL if args[*i] is not it.
+static const char *cut_option_value(char **args, int *i, const char *shortopt,
+                                    const char *longopt) {
+  const char *a = args[*i];
+  size_t ls = strlen(shortopt), ll = strlen(longopt);
+
+  if (strcmp(a, shortopt) == 0 || strcmp(a, longopt) == 0) {
+    if (args[*i + 1] == NULL) return "";
+    return args[++*i];
+  }
+  if (strncmp(a, longopt, ll) == 0 && a[ll] == '=')
+    return a + ll + 1;
+  if (shortopt[0] != '\0' && strncmp(a, shortopt, ls) == 0 && a[1] != '-')
+    return a + ls;
+  return NULL;
+}
+
+// Builtin command: cut (like Unix cut)
+// Reads in_fd in big blocks and prints selected fields of each line to out_fd.
+//   -f/--fields LIST, -b/--bytes LIST, -c/--characters LIST
+//   LIST is like 1,3-5,7- (or -3); selected parts are printed in input order
+//   -d/--delimiter X, --output-delimiter STR, -s/--only-delimited, --complement
+static int builtin_cut(struct command_t *command, int in_fd, int out_fd) {
+  struct cut_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.delim = '\t'; // default delimiter is TAB
+
+  const char *list = NULL; // example: "1,3-10"
+  int lists = 0;
+  const char *v;
+
+  // parse options
+  for (int i = 1; command->args[i] != NULL; i++) {
+    char *a = command->args[i];
+
+    if ((v = cut_option_value(command->args, &i, "-d", "--delimiter")) != NULL) {
+      if (v[0] != '\0') opts.delim = v[0];
+    } else if ((v = cut_option_value(command->args, &i, "", "--output-delimiter")) != NULL) {
+      opts.out_delim = v;
+      opts.out_delim_len = strlen(v);
+      opts.out_delim_set = true;
+    } else if ((v = cut_option_value(command->args, &i, "-f", "--fields")) != NULL) {
+      opts.mode = CUT_FIELDS;
+      list = v;
+      lists++;
+    } else if ((v = cut_option_value(command->args, &i, "-b", "--bytes")) != NULL) {
+      opts.mode = CUT_BYTES;
+      list = v;
+      lists++;
+    } else if ((v = cut_option_value(command->args, &i, "-c", "--characters")) != NULL) {
+      opts.mode = CUT_CHARS;
+      list = v;
+      lists++;
+    } else if (strcmp(a, "-s") == 0 || strcmp(a, "--only-delimited") == 0) {
+      opts.only_delimited = true;
+    } else if (strcmp(a, "--complement") == 0) {
+      opts.complement = true;
+    } else if (strcmp(a, "-n") == 0) {
+      // accepted for compatibility, ignored
+    } else {
+      fprintf(stderr, "-%s: cut: invalid option '%s'\n", sysname, a);
+      return 1;
+    }
+  }
+
+  if (lists != 1) {
+    fprintf(stderr, "-%s: cut: specify exactly one list of bytes, characters, or fields\n",
+            sysname);
+    return 1;
+  }
+  if (opts.only_delimited && opts.mode != CUT_FIELDS) {
+    fprintf(stderr, "-%s: cut: -s only makes sense with fields\n", sysname);
+    return 1;
+  }
+  if (!opts.out_delim_set) {
+    opts.out_delim = &opts.delim;
+    opts.out_delim_len = 1;
+  }
+  if (cut_compile_list(&opts, list) != 0)
+    return 1;
+  opts.scan = cut_select_scanner();
+
+  struct out_buf ob = {malloc(CUT_BLOCK_SIZE), 0, CUT_BLOCK_SIZE, out_fd, false};
+
+  // cut <file: parse straight from a mapping of the file
+  if (cut_mmap_input(&opts, in_fd, &ob) == 0) {
+    out_flush(&ob);
+    free(ob.data);
+    free(opts.ranges);
+    return SUCCESS;
+  }
+
+  // read stdin in big blocks; a line cut at the end of a block is moved to
+  // the front and completed by the next read
+  size_t cap = CUT_BLOCK_SIZE, len = 0;
+  char *buf = malloc(cap);
+  bool tty_out = isatty(out_fd); // show each typed line right away
+  int status = 0;
+
+  while (1) {
+    if (len == cap) {
+      // a single line is bigger than the buffer
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    ssize_t n = read(in_fd, buf + len, cap - len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "-%s: cut: %s\n", sysname, strerror(errno));
+      status = 1;
+      break;
+    }
+    len += (size_t)n;
+
+    const char *rest = cut_process(&opts, buf, buf + len, n == 0, &ob);
+    if (n == 0 || ob.failed) break;
+    if (tty_out) out_flush(&ob);
+
+    len = (size_t)(buf + len - rest);
+    memmove(buf, rest, len);
+  }
+
+  out_flush(&ob);
+  free(ob.data);
+  free(opts.ranges);
+  free(buf);
+  return status;
+}
+
+// Copy everything from in_fd to out_fd without going through user space
+// when the kernel allows it:
+//  - file -> file: copy_file_range()
+//  - file -> pipe, pipe -> file, pipe -> pipe: splice()
+// Otherwise (e.g. terminal output) falls back to read()/write().
+// Returns 0 on success, -1 on error (errno is set).
+static int copy_fd(int in_fd, int out_fd) {
+  struct stat in_st, out_st;
+  if (fstat(in_fd, &in_st) != 0 || fstat(out_fd, &out_st) != 0)
+    return -1;
+
+  ssize_t n;
+  if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+    while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0) {}
+    if (n == 0)
+      return 0;
+    // EXDEV, EINVAL, ENOSYS...: try the next method
+  } else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+    while ((n = splice(in_fd, NULL, out_fd, NULL, 1 << 20,
+                       SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {}
+    if (n == 0)
+      return 0;
+    // EINVAL (e.g. O_APPEND output file): try the next method
+  }
+
+  char buf[128 * 1024];
+  while ((n = read(in_fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t off = 0; off < n;) {
+      ssize_t w = write(out_fd, buf + off, (size_t)(n - off));
+      if (w < 0)
+        return -1;
+      off += w;
+    }
+  }
+  return n < 0 ? -1 : 0;
+}
+
+// `cat` without options is done by the shell itself, so bytes between
+// files and pipeline stages are moved by copy_fd() (splice/copy_file_range)
+// instead of being copied through cat's buffers.
+static bool is_plain_cat(struct command_t *command) {
+  if (strcmp(command->name, "cat") != 0)
+    return false;
+  for (int i = 1; command->args[i] != NULL; i++)
+    if (command->args[i][0] == '-' && command->args[i][1] != '\0')
+      return false; // has options, leave it to the real cat
+  return true;
+}
+
+// Builtin command: cat [file ...] (only used when is_plain_cat() is true)
+static int builtin_cat(struct command_t *command, int in_fd, int out_fd) {
+  int status = 0;
+
+  if (command->args[1] == NULL) {
+    if (copy_fd(in_fd, out_fd) != 0 && errno != EPIPE) {
+      fprintf(stderr, "-%s: cat: %s\n", sysname, strerror(errno));
+      status = 1;
+    }
+    return status;
+  }
+
+  for (int i = 1; command->args[i] != NULL; i++) {
+    const char *file = command->args[i];
+    int fd = in_fd;
+    if (strcmp(file, "-") != 0) {
+      fd = open(file, O_RDONLY);
+      if (fd < 0) {
+        fprintf(stderr, "-%s: cat: %s: %s\n", sysname, file, strerror(errno));
+        status = 1;
+        continue;
+      }
+    }
+    int r = copy_fd(fd, out_fd);
+    if (fd != in_fd)
+      close(fd);
+    if (r != 0 && errno == EPIPE)
+      return 1; // reader is gone, stop quietly (like SIGPIPE for /bin/cat)
+    if (r != 0) {
+      fprintf(stderr, "-%s: cat: %s: %s\n", sysname, file, strerror(errno));
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// builtins of Part III (and plain cat); they don't need PATH lookup
+static bool is_builtin(struct command_t *command) {
+  return command->body != NULL || strcmp(command->name, "cut") == 0 ||
+         strcmp(command->name, "pinfo") == 0 ||
+         strcmp(command->name, "parallel") == 0 ||
+         strcmp(command->name, "chatroom") == 0 || is_plain_cat(command);
+}
+
+// Run a builtin with in_fd/out_fd as its stdin/stdout. Builtins never touch
+// fds 0 and 1 directly, so they can run in the shell process (or on a thread
+// for a pipe stage) without fork. in_pipe is true for a pipe stage.
+static int run_builtin(struct command_t *command, int in_fd, int out_fd, bool in_pipe) {
+  if (strcmp(command->name, "cut") == 0)
+    return builtin_cut(command, in_fd, out_fd);
+  if (strcmp(command->name, "pinfo") == 0)
+    return builtin_pinfo(command, out_fd);
+  if (strcmp(command->name, "cat") == 0)
+    return builtin_cat(command, in_fd, out_fd);
+  if (strcmp(command->name, "parallel") == 0)
+    return builtin_parallel(command, in_fd, out_fd);
+
+  if (in_pipe) {
+    // chatroom is interactive, so we don't allow it in a pipe
+    fprintf(stderr, "-%s: chatroom cannot be used in a pipe\n", sysname);
+    return 1;
+  }
+  return builtin_chatroom(command);
+}
+
+// A builtin that would read the terminal (like `cut -f1` typed at the
+// prompt) is forked as a normal foreground job, so Ctrl-C and Ctrl-Z work
+// on it; the shell itself ignores those signals.
+static bool builtin_reads_terminal(struct command_t *command, int in_fd) {
+  if (!job_control || in_fd != -1 || command->redirects[0] != NULL)
+    return false;
+  if (strcmp(command->name, "chatroom") == 0)
+    return false; // chatroom is made for the terminal
+  if (strcmp(command->name, "pinfo") == 0) {
+    // pinfo does not read, but pinfo -w runs until Ctrl-C
+    for (int i = 1; command->args[i] != NULL; i++)
+      if (strcmp(command->args[i], "-w") == 0) return isatty(STDIN_FILENO);
+    return false;
+  }
+  if (strcmp(command->name, "cat") == 0 && command->args[1] != NULL) {
+    bool reads_stdin = false;
+    for (int i = 1; command->args[i] != NULL; i++)
+      if (strcmp(command->args[i], "-") == 0) reads_stdin = true;
+    if (!reads_stdin) return false;
+  }
+  return isatty(STDIN_FILENO);
+}
+
+// builtins that run in a forked child: background ones, the ones reading
+// the terminal, and parallel (it waits for its own children)
+static bool builtin_needs_fork(struct command_t *command, int in_fd) {
+  return command->background || command->body != NULL || strcmp(command->name, "parallel") == 0 ||
+         builtin_reads_terminal(command, in_fd);
+}
+
+// Run a builtin in a forked child with redirections applied, and exit.
+// Used for background commands (the command line is freed as soon as
+// process_command() returns, so a thread could not keep using it), for
+// builtins reading the terminal and for parallel. Call job_child_setup() first.
+static void run_subshell(struct command_t *command);
+
+static void exec_child_builtin(struct command_t *command, bool in_pipe) {
+#if __GLIBC_PREREQ(2, 34)
+  close_range(3, ~0U, 0); // pipe ends of other stages, history, logs...
+  // forget the fds cached in globals, or the builtin would use closed
+  // (or reused) descriptors
+  proc_dirfd = -1;
+  hist.fd = -1;
+  stats.log.fd = -1;
+  sigchld_pipe[0] = sigchld_pipe[1] = -1;
+  prompt_wake[0] = prompt_wake[1] = -1;
+#endif
+  apply_redirects(command);
+  if (command->body != NULL)
+    run_subshell(command);
+  int r = run_builtin(command, STDIN_FILENO, STDOUT_FILENO, in_pipe);
+  fflush(stdout);
+  _exit(r);
+}
+
+// A builtin pipe stage running on a thread of the shell. The thread owns
+// in_fd/out_fd and closes them when done, so the next stage sees EOF.
+struct builtin_thread {
+  pthread_t tid;
+  struct command_t *command;
+  int in_fd;
+  int out_fd;
+  int stage;
+  int status;
+  struct timespec end;
+  struct rusage ru;  // of this thread, for stats
+};
+
+static void *builtin_thread_main(void *arg) {
+  struct builtin_thread *t = arg;
+  t->status = run_builtin(t->command, t->in_fd, t->out_fd, true);
+  getrusage(RUSAGE_THREAD, &t->ru);
+  clock_gettime(CLOCK_MONOTONIC, &t->end);
+  if (t->in_fd != STDIN_FILENO) close(t->in_fd);
+  if (t->out_fd != STDOUT_FILENO) close(t->out_fd);
+  return NULL;
+}
+
+// Pipes between stages are enlarged (default is 64 KiB) so big streams need
+// fewer context switches. 1 MiB is the default /proc/sys/fs/pipe-max-size.
+#define PIPELINE_PIPE_SIZE (1024 * 1024)
+
+// Run a pipe chain like: cmd1 | cmd2 | cmd3
+// External commands are started with posix_spawn, builtins run on threads
+// of the shell (forked in background pipe chains).
+// Stages are connected with pipe() and dup2(). There is no limit on the
+// number of stages: the shell holds at most two pipe ends at a time, and
+// the SIGCHLD handler reaps the stages in whatever order they finish.
+static int run_pipeline(struct command_t *command) {
+  int prev_read = -1;     // read end of previous pipe
+  struct job *job = job_new(command);
+  struct builtin_thread *threads = calloc(job->nstages, sizeof(struct builtin_thread));
+  int thread_count = 0;
+  pipe_status_reset(job->nstages);
+
+  struct command_t *cur = command;
+  int stage = 0;
+
+  while (cur != NULL) {
+    int pipefd[2] = {-1, -1};
+
+    // create pipe only if there is a next command
+    // (O_CLOEXEC: spawned commands only keep the ends dup'ed to 0 and 1)
+    if (cur->next != NULL) {
+      if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
+        if (prev_read != -1) close(prev_read);
+        break;
+      }
+      // bigger pipe buffer; if not allowed we just keep the default
+      fcntl(pipefd[1], F_SETPIPE_SZ, PIPELINE_PIPE_SIZE);
+    }
+
+    pid_t pid = -1;
+    bool fork_builtin = builtin_needs_fork(cur, prev_read);
+    if (is_builtin(cur) && !fork_builtin) {
+      // builtin stage: run on a thread with its own stdin/stdout fds
+      int redir[2];
+      pipe_status[stage] = 1; // unless the thread starts
+      if (open_redirects(cur, redir) == 0) {
+        struct builtin_thread *t = &threads[thread_count];
+        t->command = cur;
+        t->stage = stage;
+        t->in_fd = STDIN_FILENO;
+        t->out_fd = STDOUT_FILENO;
+
+        // the thread takes over the fds it uses (parent must not close them)
+        if (redir[0] != -1) {
+          t->in_fd = redir[0];
+        } else if (prev_read != -1) {
+          t->in_fd = prev_read;
+          prev_read = -1;
+        }
+        if (redir[1] != -1) {
+          t->out_fd = redir[1];
+        } else if (pipefd[1] != -1) {
+          t->out_fd = pipefd[1];
+          pipefd[1] = -1;
+        }
+
+        if (pthread_create(&t->tid, NULL, builtin_thread_main, t) == 0) {
+          thread_count++;
+        } else {
+          fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
+          if (t->in_fd != STDIN_FILENO) close(t->in_fd);
+          if (t->out_fd != STDOUT_FILENO) close(t->out_fd);
+        }
+      }
+    } else if (is_builtin(cur)) {
+      pid = fork();
+      if (pid == 0) {
+        // child: join the process group of the job
+        job_child_setup(job->pgid, !command->background);
+
+        // child: connect stdin from prev pipe if exists
+        if (prev_read != -1) {
+          dup2(prev_read, STDIN_FILENO);
+        }
+        // child: connect stdout to next pipe if exists
+        if (cur->next != NULL) {
+          dup2(pipefd[1], STDOUT_FILENO);
+        }
+
+        // support builtin commands in pipes (closes all other fds)
+        exec_child_builtin(cur, true);
+      }
+      if (pid < 0) {
+        fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
+        pipe_status[stage] = 1;
+      } else if (job_control) {
+        setpgid(pid, job->pgid ? job->pgid : pid); // also here, no race
+      }
+    } else {
+      // external command: PATH lookup is cached in the parent
+      char *full_path = resolve_path(cur->name);
+      if (full_path != NULL) {
+        pid = spawn_command(cur, full_path, prev_read, pipefd[1], job->pgid,
+                            !command->background);
+        free(full_path);
+        if (pid < 0) pipe_status[stage] = 1;
+      } else {
+        fprintf(stderr, "-%s: %s: command not found\n", sysname, cur->name);
+        pipe_status[stage] = 127;
+      }
+    }
+
+    // save pid to wait later
+    // (a failed stage is skipped, its neighbours see EOF / broken pipe)
+    if (pid > 0) {
+      job_add_proc(job, pid, stage, cur->name);
+    }
+
+    // parent closes ends that it does not need
+    if (prev_read != -1) close(prev_read);
+    if (pipefd[1] != -1) close(pipefd[1]);
+
+    // next command reads from current pipe read end
+    prev_read = pipefd[0];
+
+    cur = cur->next;
+    stage++;
+  }
+
+  if (prev_read != -1) close(prev_read);
+
+  // only builtin threads (or nothing) were started: no job
+  if (job->nprocs == 0) {
+    job_remove(job);
+    job = NULL;
+  }
+
+  // if background, do not wait (the job table reports when it is done)
+  if (command->background) {
+    if (job != NULL) {
+      last_bg_pid = job->procs[job->nprocs - 1].pid;
+      if (job_control)
+        printf("[%d] %d\n", job->id, last_bg_pid);
+    }
+    free(threads);
+    pipe_status_reset(1); // $? of a background command is 0
     return SUCCESS;
   }
 
-  char myfifo[PATH_MAX];
-  snprintf(myfifo, sizeof(myfifo), "%s/%s", roomdir, user);
+  // foreground: wait all commands in pipe chain
+  if (job != NULL) {
+    job_wait_fg(job);
+    while (job->state == JOB_STOPPED && thread_count > 0) {
+      // builtin stages are threads of the shell and can't be stopped
+      fprintf(stderr, "-%s: pipe chain with builtin stages cannot be stopped\n", sysname);
+      job_continue(job);
+      job_wait_fg(job);
+    }
+  }
+  struct timespec start = job != NULL ? job->start : stats_line.start;
+  for (int i = 0; i < thread_count; i++) {
+    struct builtin_thread *t = &threads[i];
+    pthread_join(t->tid, NULL);
+    pipe_status[t->stage] = t->status;
+    if (stats.enabled)
+      stats_add_stage(t->command->name, t->stage, stage, 0, start, t->end, &t->ru, t->status);
+  }
+  free(threads);
+  if (job != NULL) {
+    job_pipe_status(job);
+    if (job->state == JOB_DONE)
+      job_remove(job);
+  }
+  return SUCCESS;
+}
 
-  // create our fifo if needed
-  if (ensure_fifo_exists(myfifo) != 0) {
-    fprintf(stderr, "-%s: chatroom: %s\n", sysname, strerror(errno));
+// ---- shell variables ----
+//
+// Exported variables live in the environment (setenv), so posix_spawn()
+// passes them on to commands. The others are kept in a hash table of the
+// shell. A name is looked up in the table first, then in the environment.
+
+struct shell_var {
+  char *name;
+  char *value;
+  struct shell_var *next;
+};
+
+#define VAR_BUCKETS 256
+
+static struct shell_var *shell_vars[VAR_BUCKETS];
+static char **script_args = NULL; // $0 $1 ... of a script or -c
+static int script_argc = 0;
+static pid_t shell_pid;           // $$
+
+static unsigned var_hash(const char *name, size_t len) {
+  unsigned h = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  return h % VAR_BUCKETS;
+}
+
+static bool var_name_char(char c, bool first) {
+  return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (!first && c >= '0' && c <= '9');
+}
+
+// length of the variable name at the start of s (0 if there is none)
+static size_t var_name_len(const char *s) {
+  size_t n = 0;
+  while (var_name_char(s[n], n == 0))
+    n++;
+  return n;
+}
+
+// link to the table entry of name, or to the NULL at the end of its chain
+static struct shell_var **var_find(const char *name, size_t len) {
+  struct shell_var **v = &shell_vars[var_hash(name, len)];
+  while (*v != NULL && (strncmp((*v)->name, name, len) != 0 || (*v)->name[len] != '\0'))
+    v = &(*v)->next;
+  return v;
+}
+
+// value of a variable (name is len bytes), NULL if it is not set
+static const char *var_get(const char *name, size_t len) {
+  struct shell_var *v = *var_find(name, len);
+  if (v != NULL)
+    return v->value;
+  char key[256];
+  if (len >= sizeof(key))
+    return NULL;
+  memcpy(key, name, len);
+  key[len] = '\0';
+  return getenv(key);
+}
+
+static void var_remove(struct shell_var **link) {
+  struct shell_var *v = *link;
+  *link = v->next;
+  free(v->name);
+  free(v->value);
+  free(v);
+}
+
+// name=value; a variable that is exported (or export is true) is set in
+// the environment
+static void var_set(const char *name, const char *value, bool export) {
+  struct shell_var **link = var_find(name, strlen(name));
+  if (export || getenv(name) != NULL) {
+    if (*link != NULL)
+      var_remove(link);
+    setenv(name, value, 1);
+    return;
+  }
+  if (*link != NULL) {
+    free((*link)->value);
+    (*link)->value = strdup(value);
+    return;
+  }
+  struct shell_var *v = malloc(sizeof(struct shell_var));
+  v->name = strdup(name);
+  v->value = strdup(value);
+  v->next = NULL;
+  *link = v;
+}
+
+static void var_unset(const char *name) {
+  struct shell_var **link = var_find(name, strlen(name));
+  if (*link != NULL)
+    var_remove(link);
+  unsetenv(name);
+}
+
+// "NAME=value" word? Returns the length of NAME, 0 if not.
+static size_t assignment_name_len(const char *word) {
+  size_t n = var_name_len(word);
+  return n > 0 && word[n] == '=' ? n : 0;
+}
+
+// Builtin command: export [NAME[=value] ...]
+// Without arguments lists the environment.
+static int builtin_export(struct command_t *command) {
+  if (command->args[1] == NULL) {
+    for (char **e = environ; *e != NULL; e++) {
+      const char *eq = strchr(*e, '=');
+      if (eq != NULL)
+        printf("export %.*s=\"%s\"\n", (int)(eq - *e), *e, eq + 1);
+    }
     return SUCCESS;
   }
+  for (int i = 1; command->args[i] != NULL; i++) {
+    const char *arg = command->args[i];
+    size_t n = var_name_len(arg);
+    if (n == 0 || (arg[n] != '\0' && arg[n] != '=')) {
+      fprintf(stderr, "-%s: export: `%s': not a valid identifier\n", sysname, arg);
+      pipe_status[0] = 1;
+      continue;
+    }
+    if (arg[n] == '=') {
+      char *name = strndup(arg, n);
+      var_set(name, arg + n + 1, true);
+      free(name);
+    } else {
+      // export NAME: a shell variable moves to the environment
+      struct shell_var **link = var_find(arg, n);
+      if (*link != NULL) {
+        setenv(arg, (*link)->value, 1);
+        var_remove(link);
+      }
+    }
+  }
+  return SUCCESS;
+}
 
-  printf("Welcome to %s!\n", room);
+// Builtin command: unset NAME ...
+static int builtin_unset(struct command_t *command) {
+  for (int i = 1; command->args[i] != NULL; i++) {
+    const char *arg = command->args[i];
+    if (var_name_len(arg) != strlen(arg)) {
+      fprintf(stderr, "-%s: unset: `%s': not a valid identifier\n", sysname, arg);
+      pipe_status[0] = 1;
+      continue;
+    }
+    var_unset(arg);
+  }
+  return SUCCESS;
+}
+
+// Builtin command: set [-o | +o pipefail]
+static int builtin_set(struct command_t *command) {
+  const char *flag = command->args[1], *name = command->args[1] ? command->args[2] : NULL;
+  if (flag == NULL || (strcmp(flag, "-o") == 0 && name == NULL)) {
+    printf("pipefail\t%s\n", pipefail ? "on" : "off");
+    return SUCCESS;
+  }
+  if ((strcmp(flag, "-o") == 0 || strcmp(flag, "+o") == 0) && strcmp(name, "pipefail") == 0) {
+    pipefail = flag[0] == '-';
+    return SUCCESS;
+  }
+  fprintf(stderr, "-%s: set: usage: set [-o | +o] pipefail\n", sysname);
+  pipe_status[0] = 2;
+  return SUCCESS;
+}
+
+// ---- expansion ----
+//
+// Runs on each command line just before it is executed. The parser leaves
+// markers in the words (see EXPAND_MARK): parameters are replaced, the
+// results of unquoted ones are split on spaces, tabs and newlines, a leading
+// ~ becomes $HOME, and words with unquoted *, ? or [...] are replaced by the
+// matching file names (or kept as they are if nothing matches).
+//
+// A glob pattern is compiled once into a list of tokens per path component
+// and then matched against the sorted listings of the dir cache, which
+// also serves tab completion. Within one command line each directory is
+// checked (stat) at most once, and a literal prefix of a pattern is found
+// with a binary search, so `ls big/ab*` does not walk all of big/.
+
+// fields of a word being expanded
+struct fields {
+  char **v;
+  int n;
+  int cap;
+  struct out_buf cur; // field being built; quoted glob chars have QUOTE_ESC
+  bool started;       // cur is a field even if empty ("" or "$empty")
+};
+
+static void fields_end(struct fields *f) {
+  if (!f->started)
+    return;
+  if (f->n == f->cap) {
+    f->cap = f->cap ? 2 * f->cap : 8;
+    f->v = realloc(f->v, f->cap * sizeof(char *));
+  }
+  f->v[f->n++] = strndup(f->cur.data, f->cur.len);
+  f->cur.len = 0;
+  f->started = false;
+}
+
+static bool is_glob_char(char c) { return c == '*' || c == '?' || c == '['; }
+
+// add the value of an expansion; unquoted values are split into fields
+static void fields_add_value(struct fields *f, const char *s, size_t n, bool quoted) {
+  if (quoted)
+    f->started = true;
+  for (size_t i = 0; i < n; i++) {
+    char c = s[i];
+    if (!quoted && (c == ' ' || c == '\t' || c == '\n')) {
+      fields_end(f);
+      continue;
+    }
+    if (quoted && is_glob_char(c))
+      out_put(&f->cur, &(char){QUOTE_ESC}, 1);
+    out_put(&f->cur, &c, 1);
+    f->started = true;
+  }
+}
+
+// Value of the parameter s (n bytes: a name or one of ? $ ! # @ * 0-9)
+// appended to val; returns false if it is not set.
+static bool param_value(const char *s, size_t n, struct out_buf *val) {
+  if (var_name_char(*s, true)) {
+    if (n == 10 && strncmp(s, "PIPESTATUS", 10) == 0) {
+      out_printf(val, "%d", pipe_status_n > 0 ? pipe_status[0] : 0);
+      return true;
+    }
+    const char *v = var_get(s, n);
+    if (v != NULL)
+      out_put(val, v, strlen(v));
+    return v != NULL;
+  }
+  switch (*s) {
+  case '?':
+    out_printf(val, "%d", last_status);
+    return true;
+  case '$':
+    out_printf(val, "%d", (int)shell_pid);
+    return true;
+  case '!':
+    if (last_bg_pid > 0)
+      out_printf(val, "%d", (int)last_bg_pid);
+    return last_bg_pid > 0;
+  case '#':
+    out_printf(val, "%d", script_argc > 0 ? script_argc - 1 : 0);
+    return true;
+  case '@':
+  case '*':
+    for (int i = 1; i < script_argc; i++)
+      out_printf(val, i > 1 ? " %s" : "%s", script_args[i]);
+    return script_argc > 1;
+  }
+  int i = *s - '0';
+  if (i < script_argc)
+    out_put(val, script_args[i], strlen(script_args[i]));
+  else if (i == 0)
+    out_put(val, sysname, strlen(sysname));
+  return i < script_argc || i == 0;
+}
+
+// length of the parameter name at s: a variable name or one special char
+static size_t param_len(const char *s) {
+  size_t n = var_name_len(s);
+  if (n == 0 && *s != '\0' && strchr("?$!#@*0123456789", *s) != NULL)
+    n = 1;
+  return n;
+}
+
+static void expand_scalar(const char *s, size_t n, struct out_buf *ob);
+
+// ${name}, ${#name}, ${name:-word}, ${name-word}, ${name:+word},
+// ${name+word} and ${PIPESTATUS[n|@]} into val. s points after "${", end
+// at the closing '}'. Returns false if it can't be parsed (it is kept as
+// it is then).
+static bool expand_braced(const char *s, const char *end, struct out_buf *val) {
+  bool length = *s == '#' && s + 1 < end;
+  if (length)
+    s++;
+  size_t n = param_len(s);
+  if (n == 0)
+    return false;
+  const char *op = s + n;
+
+  if (!length && n == 10 && strncmp(s, "PIPESTATUS", 10) == 0 && *op == '[') {
+    const char *idx = op + 1, *close = memchr(idx, ']', end - idx);
+    if (close == NULL || close + 1 != end)
+      return false;
+    if (close - idx == 1 && (*idx == '@' || *idx == '*')) {
+      for (int i = 0; i < pipe_status_n; i++)
+        out_printf(val, i ? " %d" : "%d", pipe_status[i]);
+    } else {
+      char *e;
+      long i = strtol(idx, &e, 10);
+      if (e == close && i >= 0 && i < pipe_status_n)
+        out_printf(val, "%d", pipe_status[i]);
+    }
+    return true;
+  }
+
+  if (op == end && !length) {
+    param_value(s, n, val);
+    return true;
+  }
+  struct out_buf v = {.data = malloc(64), .cap = 64, .fd = -1};
+  bool set = param_value(s, n, &v);
+  bool ok = true;
+  if (length) {
+    ok = op == end;
+    if (ok)
+      out_printf(val, "%zu", v.len);
+  } else {
+    bool colon = *op == ':';
+    if (colon)
+      op++;
+    bool use = colon ? v.len > 0 : set; // value counts as set
+    if (op >= end || (*op != '-' && *op != '+'))
+      ok = false;
+    else if (*op == '-' && use)
+      out_put(val, v.data, v.len);
+    else if (*op == '-' || use)
+      expand_scalar(op + 1, end - op - 1, val);
+  }
+  free(v.data);
+  return ok;
+}
+
+// Expand the parameter after a marker at s into val. Returns the number of
+// bytes of s that were used (0: not a parameter, the '$' is literal).
+static size_t expand_param(const char *s, struct out_buf *val) {
+  if (*s == '{') {
+    const char *end = strchr(s, '}');
+    if (end == NULL || !expand_braced(s + 1, end, val))
+      return 0;
+    return (size_t)(end - s) + 1;
+  }
+  size_t n = param_len(s);
+  if (n > 0)
+    param_value(s, n, val);
+  return n;
+}
+
+// expand the markers of s (n bytes) into one string, without splitting
+static void expand_scalar(const char *s, size_t n, struct out_buf *ob) {
+  const char *end = s + n;
+  while (s < end) {
+    if (*s == QUOTE_ESC && s + 1 < end) {
+      out_put(ob, s + 1, 1);
+      s += 2;
+    } else if ((*s == EXPAND_MARK || *s == EXPAND_MARK_QUOTED) && s + 1 < end) {
+      size_t used = expand_param(s + 1, ob);
+      if (used == 0) out_put(ob, "$", 1);
+      s += 1 + used;
+    } else {
+      out_put(ob, s++, 1);
+    }
+  }
+}
+
+// expand one word into fields (may add none, or many for "$@")
+static void expand_word(const char *word, struct fields *f) {
+  const char *p = word;
+  if (*word == '\0')
+    f->started = true; // "" is an empty argument
+  if (*p == '~' && (p[1] == '/' || p[1] == '\0')) {
+    const char *home = getenv("HOME");
+    fields_add_value(f, home ? home : "", home ? strlen(home) : 0, true);
+    p++;
+  }
+
+  struct out_buf val = {.data = malloc(64), .cap = 64, .fd = -1};
+  while (*p != '\0') {
+    if (*p == QUOTE_ESC && p[1] != '\0') {
+      out_put(&f->cur, p, 2);
+      f->started = true;
+      p += 2;
+    } else if (*p == EXPAND_MARK || *p == EXPAND_MARK_QUOTED) {
+      bool quoted = *p == EXPAND_MARK_QUOTED;
+      if (quoted && p[1] == '@') {
+        // "$@": every argument is a field of its own
+        for (int i = 1; i < script_argc; i++) {
+          if (i > 1) fields_end(f);
+          fields_add_value(f, script_args[i], strlen(script_args[i]), true);
+        }
+        p += 2;
+        continue;
+      }
+      val.len = 0;
+      size_t used = expand_param(p + 1, &val);
+      if (used == 0) {
+        out_put(&f->cur, "$", 1);
+        f->started = true;
+      } else {
+        fields_add_value(f, val.data, val.len, quoted);
+      }
+      p += 1 + used;
+    } else {
+      out_put(&f->cur, p++, 1);
+      f->started = true;
+    }
+  }
+  free(val.data);
+  fields_end(f);
+}
+
+// ---- glob patterns ----
+
+enum glob_tok_type { GLOB_LIT, GLOB_ONE, GLOB_STAR, GLOB_CLASS };
+
+struct glob_tok {
+  enum glob_tok_type type;
+  const char *lit;  // GLOB_LIT: len bytes
+  size_t len;
+  uint8_t set[32];  // GLOB_CLASS: bit per byte value
+};
+
+// one component of a path pattern (between slashes)
+struct glob_part {
+  char *text;       // without escapes; the name itself if literal
+  bool literal;     // no glob characters: no directory listing needed
+  struct glob_tok *tok;
+  int ntok;
+  size_t prefix_len; // text[0..prefix_len) is a literal start
+};
+
+// Compile one component (s, n bytes, with QUOTE_ESC escapes) into tokens.
+// Literal runs are copied into part->text, which tokens point into.
+static void glob_compile_part(const char *s, size_t n, struct glob_part *g) {
+  memset(g, 0, sizeof(*g));
+  g->text = malloc(n + 1);
+  g->tok = malloc(sizeof(struct glob_tok) * (n + 1));
+  g->literal = true;
+  size_t tlen = 0;
+  bool in_prefix = true;
+  const char *end = s + n;
+
+  while (s < end) {
+    struct glob_tok *t = &g->tok[g->ntok];
+    const char *close = NULL;
+    if (*s == '[') {
+      // find the closing ']' (a ']' right after '[' or "[!" is literal)
+      const char *q = s + 1;
+      if (q < end && (*q == '!' || *q == '^')) q++;
+      if (q < end && *q == ']') q++;
+      while (q < end && *q != ']') q++;
+      if (q < end) close = q;
+    }
+
+    if (*s == '*' || *s == '?' || close != NULL) {
+      g->literal = false;
+      in_prefix = false;
+      memset(t, 0, sizeof(*t));
+      if (*s == '*') {
+        t->type = GLOB_STAR;
+        if (g->ntok == 0 || g->tok[g->ntok - 1].type != GLOB_STAR)
+          g->ntok++; // ** is the same as *
+        s++;
+        continue;
+      }
+      if (*s == '?') {
+        t->type = GLOB_ONE;
+        g->ntok++;
+        s++;
+        continue;
+      }
+      t->type = GLOB_CLASS;
+      const char *q = s + 1;
+      bool negate = *q == '!' || *q == '^';
+      if (negate) q++;
+      while (q < close) {
+        unsigned char a = (unsigned char)*q, b = a;
+        if (a == QUOTE_ESC && q + 1 < close)
+          a = b = (unsigned char)*++q;
+        if (q + 2 < close && q[1] == '-') {
+          b = (unsigned char)q[2];
+          q += 2;
+        }
+        for (unsigned c = a; c <= b; c++)
+          t->set[c >> 3] |= (uint8_t)(1u << (c & 7));
+        q++;
+      }
+      if (negate)
+        for (int i = 0; i < 32; i++) t->set[i] = ~t->set[i];
+      t->set[0] &= ~1u; // never the terminating NUL
+      g->ntok++;
+      s = close + 1;
+      continue;
+    }
+
+    // literal byte: extend the current literal token
+    char c = *s;
+    if (c == QUOTE_ESC && s + 1 < end)
+      c = *++s;
+    s++;
+    if (g->ntok > 0 && g->tok[g->ntok - 1].type == GLOB_LIT &&
+        g->tok[g->ntok - 1].lit + g->tok[g->ntok - 1].len == g->text + tlen) {
+      g->tok[g->ntok - 1].len++;
+    } else {
+      t->type = GLOB_LIT;
+      t->lit = g->text + tlen;
+      t->len = 1;
+      g->ntok++;
+    }
+    g->text[tlen++] = c;
+    if (in_prefix)
+      g->prefix_len = tlen;
+  }
+  g->text[tlen] = '\0';
+}
+
+// Does name match the compiled component? Greedy with backtracking to the
+// last '*', which is enough for glob patterns (no nested groups).
+static bool glob_match(const struct glob_part *g, const char *name) {
+  int t = 0, star_t = -1;
+  const char *s = name, *star_s = NULL;
+  while (1) {
+    if (t < g->ntok) {
+      const struct glob_tok *tok = &g->tok[t];
+      if (tok->type == GLOB_STAR) {
+        star_t = ++t;
+        star_s = s;
+        continue;
+      }
+      if (tok->type == GLOB_LIT && strncmp(s, tok->lit, tok->len) == 0) {
+        s += tok->len;
+        t++;
+        continue;
+      }
+      if (tok->type == GLOB_ONE && *s != '\0') {
+        s++;
+        while (((unsigned char)*s & 0xc0) == 0x80) s++; // one UTF-8 character
+        t++;
+        continue;
+      }
+      if (tok->type == GLOB_CLASS &&
+          (tok->set[(unsigned char)*s >> 3] & (1u << ((unsigned char)*s & 7)))) {
+        s++;
+        t++;
+        continue;
+      }
+    } else if (*s == '\0') {
+      return true;
+    }
+    // mismatch: let the last '*' take one more byte
+    if (star_t < 0 || *star_s == '\0')
+      return false;
+    s = ++star_s;
+    t = star_t;
+  }
+}
+
+static int glob_strcmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Replace a field that has unquoted glob characters by the sorted paths
+// matching it. Returns false if nothing matched.
+static bool glob_field(const char *field, struct fields *out) {
+  // split into components; "/" at the start is kept in the first path
+  int nparts = 0;
+  struct glob_part *parts = NULL;
+  const char *s = field;
+  bool absolute = *s == '/';
+  while (*s == '/') s++;
+  while (*s != '\0') {
+    const char *slash = strchr(s, '/');
+    size_t n = slash != NULL ? (size_t)(slash - s) : strlen(s);
+    parts = realloc(parts, sizeof(struct glob_part) * (nparts + 1));
+    glob_compile_part(s, n, &parts[nparts++]);
+    s += n;
+    if (*s == '/') {
+      while (*s == '/') s++;
+      if (*s == '\0') {
+        // trailing '/': only directories match
+        parts = realloc(parts, sizeof(struct glob_part) * (nparts + 1));
+        glob_compile_part("", 0, &parts[nparts++]);
+      }
+    }
+  }
+
+  // paths matched so far, each ending with '/' (or empty: the current dir)
+  char **paths = malloc(sizeof(char *));
+  int npaths = 1;
+  paths[0] = strdup(absolute ? "/" : "");
+  for (int i = 0; i < nparts && npaths > 0; i++) {
+    struct glob_part *g = &parts[i];
+    bool last = i == nparts - 1;
+    char **next = NULL;
+    int nnext = 0, next_cap = 0;
+    for (int k = 0; k < npaths; k++) {
+      char *base = paths[k];
+      size_t blen = strlen(base);
+      if (g->literal) {
+        // no listing: just append; the last component must exist
+        char *cand = malloc(blen + strlen(g->text) + 2);
+        sprintf(cand, "%s%s%s", base, g->text, last ? "" : "/");
+        struct stat st;
+        if (last && lstat(cand, &st) != 0) {
+          free(cand);
+          continue;
+        }
+        if (nnext == next_cap) {
+          next_cap = next_cap ? 2 * next_cap : 16;
+          next = realloc(next, next_cap * sizeof(char *));
+        }
+        next[nnext++] = cand;
+        continue;
+      }
+
+      struct dir_cache *c = dir_cache_get(blen ? base : ".", true);
+      if (c == NULL)
+        continue;
+      // names starting with the literal prefix are one range of the sorted list
+      long lo = 0, hi = c->n;
+      while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (strncmp(c->sorted[mid], g->text, g->prefix_len) < 0)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      for (long j = lo; j < c->n && strncmp(c->sorted[j], g->text, g->prefix_len) == 0; j++) {
+        const char *name = c->sorted[j];
+        // hidden files only if the pattern starts with a literal '.'
+        // (text has no glob characters: for "*.log" it is ".log")
+        if (name[0] == '.' && (g->prefix_len == 0 || g->text[0] != '.'))
+          continue;
+        if (!glob_match(g, name))
+          continue;
+        char *cand = malloc(blen + strlen(name) + 2);
+        sprintf(cand, "%s%s", base, name);
+        if (!last) {
+          struct stat st;
+          if (stat(cand, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            free(cand);
+            continue;
+          }
+          strcat(cand, "/");
+        }
+        if (nnext == next_cap) {
+          next_cap = next_cap ? 2 * next_cap : 16;
+          next = realloc(next, next_cap * sizeof(char *));
+        }
+        next[nnext++] = cand;
+      }
+    }
+    for (int k = 0; k < npaths; k++) free(paths[k]);
+    free(paths);
+    paths = next;
+    npaths = nnext;
+  }
+
+  if (npaths > 1)
+    qsort(paths, npaths, sizeof(char *), glob_strcmp);
+  for (int k = 0; k < npaths; k++) {
+    fields_add_value(out, paths[k], strlen(paths[k]), true);
+    fields_end(out);
+    free(paths[k]);
+  }
+  free(paths);
+  for (int i = 0; i < nparts; i++) {
+    free(parts[i].text);
+    free(parts[i].tok);
+  }
+  free(parts);
+  return npaths > 0;
+}
+
+// remove the QUOTE_ESC escapes of a field, into the line arena
+static char *unescape_field(const char *s) {
+  char *r = arena_alloc(&line_arena, strlen(s) + 1), *o = r;
+  for (; *s != '\0'; s++) {
+    if (*s == QUOTE_ESC && s[1] != '\0') s++;
+    *o++ = *s;
+  }
+  *o = '\0';
+  return r;
+}
 
-  // fork reader process that prints incoming messages
-  pid_t reader = fork();
-  if (reader == 0) {
-    chatroom_reader_loop(myfifo);
-    exit(0);
+static bool has_glob(const char *s) {
+  for (; *s != '\0'; s++) {
+    if (*s == QUOTE_ESC && s[1] != '\0') s++;
+    else if (is_glob_char(*s)) return true;
   }
+  return false;
+}
 
-  // main loop: read user input and broadcast to others
-  char line[512];
-  while (1) {
-    printf("[%s] %s > ", room, user);
-    fflush(stdout);
-
-    if (fgets(line, sizeof(line), stdin) == NULL) break;
-    if (strcmp(line, "/exit\n") == 0 || strcmp(line, "/exit") == 0) break;
+// expand word into final fields in the arena; returns how many
+static int expand_to_argv(const char *word, char ***argv_out) {
+  struct fields f = {.cur = {.data = malloc(64), .cap = 64, .fd = -1}};
+  expand_word(word, &f);
+
+  struct fields done = {.cur = {.data = malloc(64), .cap = 64, .fd = -1}};
+  for (int i = 0; i < f.n; i++) {
+    if (!has_glob(f.v[i]) || !glob_field(f.v[i], &done)) {
+      // no glob, or no match: the field as it is
+      done.started = true;
+      out_put(&done.cur, f.v[i], strlen(f.v[i]));
+      fields_end(&done);
+    }
+    free(f.v[i]);
+  }
+  char **argv = arena_alloc(&line_arena, sizeof(char *) * (done.n + 1));
+  for (int i = 0; i < done.n; i++) {
+    argv[i] = unescape_field(done.v[i]);
+    free(done.v[i]);
+  }
+  argv[done.n] = NULL;
+  *argv_out = argv;
+  free(f.v);
+  free(f.cur.data);
+  free(done.v);
+  free(done.cur.data);
+  return done.n;
+}
 
-    // format message like [room] user: msg
-    char msg[1024];
-    int m = snprintf(msg, sizeof(msg), "[%s] %s: %s", room, user, line);
-    if (m <= 0) continue;
+static bool needs_expansion(const char *s) {
+  return s[0] == '~' || strpbrk(s, "\001\002\003*?[") != NULL;
+}
 
-    DIR *d = opendir(roomdir);
-    if (!d) continue;
+// NAME=value word with the value expanded (no splitting, no globs)
+static char *expand_assignment(const char *word) {
+  struct out_buf ob = {.data = malloc(64), .cap = 64, .fd = -1};
+  expand_scalar(word, strlen(word), &ob);
+  char *r = arena_alloc(&line_arena, ob.len + 1);
+  memcpy(r, ob.data, ob.len);
+  r[ob.len] = '\0';
+  free(ob.data);
+  return r;
+}
 
-    struct dirent *ent;
-    while ((ent = readdir(d)) != NULL) {
-      // skip . and ..
-      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
-      // don't write to our own fifo
-      if (strcmp(ent->d_name, user) == 0) continue;
-
-      char otherfifo[PATH_MAX];
-      snprintf(otherfifo, sizeof(otherfifo), "%s/%s", roomdir, ent->d_name);
-
-      // send message by creating a child (so writing does not block us)
-      pid_t sp = fork();
-      if (sp == 0) {
-        int fd = open(otherfifo, O_WRONLY | O_NONBLOCK);
-        if (fd >= 0) {
-          write(fd, msg, (size_t)m);
-          close(fd);
+// Expand every command of a pipe chain. Leading NAME=value words become
+// command->assigns (the environment of that command only); a line with
+// nothing but assignments sets shell variables. Returns -1 on an error
+// (it was printed), e.g. a redirection that expands to several files.
+static int expand_command(struct command_t *command) {
+  dir_cache_epoch++; // directories are checked again, once per command line
+
+  for (struct command_t *c = command; c != NULL; c = c->next) {
+    int nassign = 0;
+    while (c->args[nassign] != NULL && assignment_name_len(c->args[nassign]) > 0)
+      nassign++;
+
+    bool changed = nassign > 0;
+    for (int i = nassign; c->args[i] != NULL && !changed && c->body == NULL; i++)
+      changed = needs_expansion(c->args[i]);
+    if (changed) {
+      // collect the fields of all words into a new argv
+      char **words = arena_alloc(&line_arena, sizeof(char *) * c->arg_count);
+      int nwords = 0, cap = c->arg_count;
+      for (int i = nassign; c->args[i] != NULL; i++) {
+        char **fv;
+        int n = 1;
+        if (needs_expansion(c->args[i])) {
+          n = expand_to_argv(c->args[i], &fv);
+        } else {
+          fv = &c->args[i];
+        }
+        if (nwords + n + 1 > cap) {
+          cap = 2 * (nwords + n + 1);
+          char **w = arena_alloc(&line_arena, sizeof(char *) * cap);
+          memcpy(w, words, sizeof(char *) * nwords);
+          words = w;
         }
-        exit(0);
+        memcpy(words + nwords, fv, sizeof(char *) * n);
+        nwords += n;
       }
+
+      if (nassign > 0) {
+        c->assigns = arena_alloc(&line_arena, sizeof(char *) * (nassign + 1));
+        for (int i = 0; i < nassign; i++)
+          c->assigns[i] = expand_assignment(c->args[i]);
+        c->assigns[nassign] = NULL;
+      }
+      if (nwords == 0)
+        words[nwords++] = parse_empty;
+      words[nwords] = NULL;
+      c->args = words;
+      c->arg_count = nwords + 1;
+      c->name = words[0];
     }
-    closedir(d);
 
-    // clean up finished sender children
-    while (waitpid(-1, NULL, WNOHANG) > 0) {}
+    for (int i = 0; i < 3; i++) {
+      if (c->redirects[i] == NULL || !needs_expansion(c->redirects[i]))
+        continue;
+      char **fv;
+      if (expand_to_argv(c->redirects[i], &fv) != 1) {
+        fprintf(stderr, "-%s: %s: ambiguous redirect\n", sysname,
+                unescape_field(c->redirects[i]));
+        return -1;
+      }
+      c->redirects[i] = fv[0];
+    }
   }
 
-  // stop reader process before exiting
-  if (reader > 0) {
-    kill(reader, SIGKILL);
-    waitpid(reader, NULL, 0);
+  // only assignments: shell variables (exported ones stay exported)
+  if (command->next == NULL && command->name[0] == '\0' && command->assigns != NULL) {
+    for (int i = 0; command->assigns[i] != NULL; i++) {
+      char *a = command->assigns[i];
+      size_t n = assignment_name_len(a);
+      a[n] = '\0';
+      var_set(a, a + n + 1, false);
+      a[n] = '=';
+    }
+    command->assigns = NULL;
+    pipe_status_reset(1); // $? is 0 after an assignment
   }
+  return 0;
+}
 
-  // remove our fifo when leaving
-  unlink(myfifo);
+static void prompt_cwd_changed(void);
+
+// ---- control flow ----
+
+static int loop_depth = 0;    // loops running around the current command
+static int loop_break = 0;    // loops still to leave (break N)
+static int loop_continue = 0; // continue N: leave N-1 loops, go on with the next
+
+// Builtin command: break [N] and continue [N]
+static int builtin_break(struct command_t *command) {
+  long n = command->args[1] != NULL ? strtol(command->args[1], NULL, 10) : 1;
+  if (n < 1) {
+    fprintf(stderr, "-%s: %s: %s: loop count out of range\n", sysname, command->name,
+            command->args[1]);
+    pipe_status[0] = 1;
+    return SUCCESS;
+  }
+  if (loop_depth == 0) {
+    fprintf(stderr, "-%s: %s: only meaningful in a loop\n", sysname, command->name);
+    pipe_status[0] = 1;
+    return SUCCESS;
+  }
+  if (n > loop_depth)
+    n = loop_depth;
+  if (command->name[0] == 'b')
+    loop_break = n;
+  else
+    loop_continue = n;
   return SUCCESS;
 }
 
-// Builtin command: cut (like Unix cut)
-// Reads stdin line by line and prints selected fields.
-static int builtin_cut(struct command_t *command) {
-  char delim = '\t';           // default delimiter is TAB
-  char *fields_spec = NULL;    // example: "1,3,10"
+static int run_command(struct command_t *command) {
+  int r;
 
-  // parse flags -d/--delimiter and -f/--fields
-  for (int i = 1; command->args[i] != NULL; i++) {
-    char *a = command->args[i];
+  if (strcmp(command->name, "") == 0)
+    return SUCCESS;
 
-    if (strcmp(a, "-d") == 0) {
-      if (command->args[i + 1] != NULL && command->args[i + 1][0] != '\0') {
-        delim = command->args[i + 1][0];
-        i++;
-      }
-      continue;
-    }
-    if (strncmp(a, "-d", 2) == 0) {
-      if (a[2] != '\0') delim = a[2];
-      continue;
+  if (strcmp(command->name, "exit") == 0) {
+    if (command->args[1] != NULL) { // exit N: the status of the shell
+      pipe_status_reset(1);
+      pipe_status[0] = atoi(command->args[1]) & 255;
     }
+    return EXIT;
+  }
 
-    if (strcmp(a, "--delimiter") == 0) {
-      if (command->args[i + 1] != NULL && command->args[i + 1][0] != '\0') {
-        delim = command->args[i + 1][0];
-        i++;
-      }
-      continue;
-    }
-    if (strncmp(a, "--delimiter=", 12) == 0) {
-      if (a[12] != '\0') delim = a[12];
-      continue;
-    }
+  // new command line: PATH directories may be checked again
+  path_epoch++;
+  pipe_status_reset(1);
 
-    if (strcmp(a, "-f") == 0) {
-      if (command->args[i + 1] != NULL) {
-        fields_spec = command->args[i + 1];
-        i++;
-      }
-      continue;
-    }
-    if (strncmp(a, "-f", 2) == 0) {
-      if (a[2] != '\0') fields_spec = a + 2;
-      continue;
-    }
+  // flush prompt/echo output now, otherwise forked builtins would inherit
+  // it in their stdio buffer and write it into their redirected stdout
+  fflush(stdout);
 
-    if (strcmp(a, "--fields") == 0) {
-      if (command->args[i + 1] != NULL) {
-        fields_spec = command->args[i + 1];
-        i++;
-      }
-      continue;
-    }
-    if (strncmp(a, "--fields=", 9) == 0) {
-      if (a[9] != '\0') fields_spec = a + 9;
-      continue;
-    }
+  // builtin: hash shows/resets the PATH lookup cache of the shell process
+  if (strcmp(command->name, "hash") == 0) {
+    pipe_status[0] = builtin_hash(command);
+    return SUCCESS;
   }
 
-  // if fields not given, do nothing
-  if (fields_spec == NULL || fields_spec[0] == '\0') {
+  // job control builtins work on the job table of the shell process
+  if (strcmp(command->name, "history") == 0) {
+    pipe_status[0] = builtin_history(command);
     return SUCCESS;
   }
+  if (strcmp(command->name, "stats") == 0)
+    return builtin_stats(command);
+  if (strcmp(command->name, "set") == 0)
+    return builtin_set(command);
+  if (strcmp(command->name, "export") == 0)
+    return builtin_export(command);
+  if (strcmp(command->name, "unset") == 0)
+    return builtin_unset(command);
+  if (strcmp(command->name, "break") == 0 || strcmp(command->name, "continue") == 0)
+    return builtin_break(command);
+  if (strcmp(command->name, "jobs") == 0)
+    return builtin_jobs(command);
+  if (strcmp(command->name, "fg") == 0)
+    return builtin_fg_bg(command, true);
+  if (strcmp(command->name, "bg") == 0)
+    return builtin_fg_bg(command, false);
+  if (strcmp(command->name, "wait") == 0)
+    return builtin_wait(command);
+  if (strcmp(command->name, "kill") == 0)
+    return builtin_kill(command);
 
-  int fields[256];
-  int fields_n = 0;
+  // builtin: cd changes current directory of the shell process
+  if (strcmp(command->name, "cd") == 0) {
+    if (command->arg_count > 0) {
+      const char *dir = command->args[1] != NULL ? command->args[1] : getenv("HOME");
+      r = dir != NULL ? chdir(dir) : -1;
+      if (dir == NULL) errno = ENOENT;
+      if (r == 0) prompt_cwd_changed();
+      if (r == -1) {
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        pipe_status[0] = 1;
+      }
+      return SUCCESS;
+    }
+  }
 
-  // copy fields string because strtok will modify it
-  char *spec_copy = strdup(fields_spec);
-  if (spec_copy == NULL) return SUCCESS;
+  // if we have pipe chain, run_pipeline will start multiple children
+  if (command->next != NULL) {
+    return run_pipeline(command);
+  }
 
-  // split "1,3,10" by comma
-  char *saveptr = NULL;
-  char *tok = strtok_r(spec_copy, ",", &saveptr);
-  while (tok != NULL && fields_n < 256) {
-    int v = parse_positive_int(tok);
-    if (v > 0) fields[fields_n++] = v;
-    tok = strtok_r(NULL, ",", &saveptr);
+  pid_t pid;
+  bool fork_builtin = builtin_needs_fork(command, -1);
+  if (is_builtin(command) && !fork_builtin) {
+    // builtin commands (Part III) run in the shell process, no fork:
+    // redirections are just fds given to the builtin
+    int redir[2];
+    if (open_redirects(command, redir) != 0) {
+      pipe_status[0] = 1;
+      return SUCCESS;
+    }
+    pipe_status[0] = run_builtin(command, redir[0] != -1 ? redir[0] : STDIN_FILENO,
+                                 redir[1] != -1 ? redir[1] : STDOUT_FILENO, false);
+    if (redir[0] != -1) close(redir[0]);
+    if (redir[1] != -1) close(redir[1]);
+    return SUCCESS;
+  } else if (is_builtin(command)) {
+    // background (or terminal reading) builtin runs in a forked child
+    pid = fork();
+    if (pid == 0) // child
+    {
+      job_child_setup(0, !command->background);
+      exec_child_builtin(command, false);
+    }
+    if (pid < 0) {
+      fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
+      pipe_status[0] = 1;
+      return SUCCESS;
+    }
+    if (job_control) setpgid(pid, pid);
+  } else {
+    // external commands: resolve PATH before starting the child, so the
+    // result stays in the parent's hash table (Part I)
+    char *full_path = resolve_path(command->name);
+    if (full_path == NULL) {
+      // resolve_path returned NULL (command not found in PATH)
+      fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
+      pipe_status[0] = 127;
+      return SUCCESS;
+    }
+    pid = spawn_command(command, full_path, -1, -1, 0, !command->background);
+    free(full_path);
+    if (pid < 0) {
+      pipe_status[0] = 1;
+      return SUCCESS;
+    }
   }
 
-  free(spec_copy);
+  struct job *job = job_new(command);
+  job_add_proc(job, pid, 0, command->name);
 
-  if (fields_n == 0) {
+  // parent: background means do not wait
+  if (command->background) {
+    // the SIGCHLD handler reaps it, jobs_notify() reports it
+    last_bg_pid = pid;
+    if (job_control)
+      printf("[%d] %d\n", job->id, pid);
+    return SUCCESS;
+  } else {
+    // foreground: wait until command finishes (or is stopped)
+    job_wait_fg(job);
+    job_pipe_status(job);
+    if (job->state == JOB_DONE)
+      job_remove(job);
     return SUCCESS;
   }
+}
 
-  // read input line by line
-  char *line = NULL;
-  size_t cap = 0;
+// `time cmd ...` times the whole command line (a pipe chain too); with
+// SHELLISH_STATS every command line is measured and recorded
+int process_command(struct command_t *command) {
+  if (expand_command(command) != 0) {
+    pipe_status_reset(1);
+    pipe_status[0] = 1;
+    pipe_status_done();
+    return SUCCESS;
+  }
 
-  while (1) {
-    ssize_t nread = getline(&line, &cap, stdin);
-    if (nread < 0) break;
+  bool timed = strcmp(command->name, "time") == 0;
+  if (timed && command->args[1] != NULL) {
+    command->args++;
+    command->arg_count--;
+    command->name = command->args[0];
+  } else if (timed) {
+    command->name = parse_empty; // just `time`: prints zeros like bash
+  }
+  timed = timed && !command->background; // nothing to wait for
 
-    // remove newline if exists
-    int has_nl = 0;
-    if (nread > 0 && line[nread - 1] == '\n') {
-      has_nl = 1;
-      line[nread - 1] = '\0';
-      nread--;
-    }
+  if (!timed && (!stats.enabled || strcmp(command->name, "") == 0 ||
+                 strcmp(command->name, "exit") == 0 || command->background)) {
+    int r = run_command(command);
+    pipe_status_done();
+    return r;
+  }
 
-    // we will split line by delimiter and store pointers to each field
-    char *starts[1024];
-    char *ends[1024];
-    int count = 0;
+  struct rusage self;
+  getrusage(RUSAGE_SELF, &self);
+  stats_line_begin();
+  int r = run_command(command);
+  pipe_status_done();
+  stats_line_end(command, &self, timed);
+  return r;
+}
 
-    char *p = line;
-    starts[count] = p;
+static int run_node(struct node *n);
 
-    while (*p != '\0') {
-      if (*p == delim) {
-        ends[count] = p;
-        *p = '\0';         // terminate this field
-        count++;
-        if (count >= 1023) break;
-        starts[count] = p + 1; // start of next field
-      }
-      p++;
-    }
+// run a list; stops early for exit, Ctrl-C, break and continue
+static int run_list(struct node *n) {
+  for (; n != NULL; n = n->next) {
+    if (run_node(n) == EXIT)
+      return EXIT;
+    if (interrupted || loop_break || loop_continue)
+      break;
+  }
+  return SUCCESS;
+}
 
-    ends[count] = p;
-    count++;
+// After the body of a loop: true if the loop must stop. A pending break
+// or continue that is for an outer loop is left for it.
+static bool loop_done(void) {
+  if (interrupted)
+    return true;
+  if (loop_break > 0) {
+    loop_break--;
+    return true;
+  }
+  if (loop_continue > 0 && --loop_continue > 0)
+    return true;
+  return false;
+}
 
-    // print requested fields in the given order
-    int first_out = 1;
-    for (int i = 0; i < fields_n; i++) {
-      int idx = fields[i] - 1;
-      if (idx >= 0 && idx < count) {
-        if (!first_out) putchar(delim);
-        fputs(starts[idx], stdout);
-        first_out = 0;
-      }
+// for var in words; do ...; done. The words are expanded once, at the start.
+static int run_for(struct node *n) {
+  char **items = script_argc > 1 ? script_args + 1 : NULL;
+  int count = script_argc > 1 ? script_argc - 1 : 0;
+  if (n->words != NULL) {
+    // all fields of all words, in the arena until the loop ends
+    count = 0;
+    for (int i = 0; n->words[i] != NULL; i++) {
+      char **fv;
+      int k = expand_to_argv(n->words[i], &fv);
+      char **all = arena_alloc(&line_arena, sizeof(char *) * (count + k));
+      memcpy(all, items, sizeof(char *) * count);
+      memcpy(all + count, fv, sizeof(char *) * k);
+      items = all;
+      count += k;
     }
+  }
 
-    if (has_nl) putchar('\n');
+  int r = SUCCESS, status = 0;
+  loop_depth++;
+  for (int i = 0; i < count; i++) {
+    var_set(n->var, items[i], false);
+    r = run_list(n->right);
+    status = last_status;
+    if (r == EXIT || loop_done())
+      break;
   }
+  loop_depth--;
+  last_status = status;
+  return r;
+}
 
-  if (line) free(line);
-  return SUCCESS;
+// while/until: the condition and the body are the same subtrees every time
+static int run_while(struct node *n) {
+  int r = SUCCESS, status = 0;
+  loop_depth++;
+  while (1) {
+    r = run_list(n->left);
+    if (r == EXIT || interrupted || loop_break || loop_continue) {
+      loop_done();
+      break;
+    }
+    if ((last_status == 0) != (n->type == NODE_WHILE))
+      break;
+    r = run_list(n->right);
+    status = last_status;
+    if (r == EXIT || loop_done())
+      break;
+  }
+  loop_depth--;
+  last_status = status;
+  return r;
 }
 
-// Run a pipe chain like: cmd1 | cmd2 | cmd3
-// We fork each command and connect them with pipe() and dup2().
-static int run_pipeline(struct command_t *command) {
-  int prev_read = -1;     // read end of previous pipe
-  pid_t pids[256];
-  int pid_count = 0;
+static int run_node(struct node *n) {
+  int r = SUCCESS;
+  switch (n->type) {
+  case NODE_CMD: {
+    // expansion works on a copy of the chain, which goes away (with the
+    // expanded words) right after the chain ran
+    struct arena_mark mark = arena_save(&line_arena);
+    struct command_t *copy = NULL, **tail = &copy;
+    for (struct command_t *c = n->cmd; c != NULL; c = c->next) {
+      *tail = arena_alloc(&line_arena, sizeof(struct command_t));
+      **tail = *c;
+      tail = &(*tail)->next;
+    }
+    r = process_command(copy);
+    arena_release(&line_arena, mark);
+    if (n->negate)
+      last_status = last_status == 0;
+    return r;
+  }
+  case NODE_AND:
+  case NODE_OR:
+    r = run_node(n->left);
+    if (r == EXIT || interrupted || loop_break || loop_continue)
+      return r;
+    if ((last_status == 0) == (n->type == NODE_AND))
+      r = run_node(n->right);
+    return r;
+  case NODE_GROUP:
+    return run_list(n->left);
+  case NODE_IF:
+    r = run_list(n->left);
+    if (r == EXIT || interrupted || loop_break || loop_continue)
+      return r;
+    if (last_status == 0)
+      return run_list(n->right);
+    last_status = 0;
+    return n->orelse != NULL ? run_list(n->orelse) : SUCCESS;
+  case NODE_WHILE:
+  case NODE_UNTIL:
+    return run_while(n);
+  case NODE_FOR: {
+    struct arena_mark mark = arena_save(&line_arena);
+    r = run_for(n);
+    arena_release(&line_arena, mark);
+    return r;
+  }
+  }
+  return r;
+}
 
-  struct command_t *cur = command;
+// run a parsed command line
+static int run_tree(struct node *tree) {
+  interrupted = 0;
+  loop_break = loop_continue = 0;
+  return run_list(tree);
+}
 
-  while (cur != NULL) {
-    int pipefd[2] = {-1, -1};
+// child of a ( list ) or of a compound command in a pipe chain or in the
+// background: a shell of its own, without the jobs of the parent and
+// without job control
+static void run_subshell(struct command_t *command) {
+  job_list = NULL;
+  proc_index = NULL;
+  proc_index_size = proc_index_used = 0;
+  job_control = false;
+  stats.enabled = false;
+  loop_depth = 0;
+  jobs_init(false);
+  run_tree(command->body);
+  fflush(stdout);
+  _exit(last_status);
+}
 
-    // create pipe only if there is a next command
-    if (cur->next != NULL) {
-      if (pipe(pipefd) < 0) {
-        fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
-        return SUCCESS;
-      }
-    }
+// ---- prompt ----
+//
+// $PS1 is a template; without it the prompt is "\u@\h:\w \s$ ":
+//   \u user   \h host up to the first '.'   \H host   \s shell name
+//   \w working directory   \W its last component   \$ '#' for root, else '$'
+//   \? status of the last command line   \j number of jobs   \t HH:MM:SS
+//   \L how long the last command line took   \g git branch (outside a
+//   repository: nothing)   \n newline   \e ESC   \\ backslash
+//   \[ ... \] text that takes no room on the screen (colors)
+// The template is compiled into segments once (again only when PS1
+// changes). User and host are looked up once and the directory only when
+// cd succeeds. Finding the git branch walks up the directory tree, which is
+// slow on network mounts, so a worker thread does it: the prompt shows the
+// branch known for this directory right away and is redrawn when the worker
+// finds a different one.
+
+enum prompt_seg_type {
+  SEG_TEXT, SEG_USER, SEG_HOST, SEG_HOST_FULL, SEG_CWD, SEG_CWD_BASE, SEG_SHELL,
+  SEG_DOLLAR, SEG_STATUS, SEG_JOBS, SEG_TIME, SEG_DURATION, SEG_GIT,
+  SEG_HIDE_BEGIN, SEG_HIDE_END,
+};
 
-    pid_t pid = fork();
-    if (pid == 0) {
-      // child: connect stdin from prev pipe if exists
-      if (prev_read != -1) {
-        dup2(prev_read, STDIN_FILENO);
-      }
-      // child: connect stdout to next pipe if exists
-      if (cur->next != NULL) {
-        dup2(pipefd[1], STDOUT_FILENO);
-      }
+struct prompt_seg {
+  enum prompt_seg_type type;
+  const char *text; // SEG_TEXT: len bytes of prompt_cache.ps1
+  size_t len;
+};
 
-      // close unused fds in child
-      if (prev_read != -1) close(prev_read);
-      if (pipefd[0] != -1) close(pipefd[0]);
-      if (pipefd[1] != -1) close(pipefd[1]);
+static struct {
+  bool init;
+  char *ps1;                // the compiled template
+  struct prompt_seg *segs;
+  int nsegs;
+  bool uses_git;
+  char user[256];
+  char host[256];
+  char cwd[PATH_MAX];
+  bool root;
+  double last_wall;         // seconds the last command line took (set by main)
+} prompt_cache;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool started;
+  char want[PATH_MAX];  // directory to look at next ("" if nothing to do)
+  char dir[PATH_MAX];   // directory of branch
+  char branch[256];
+} prompt_git = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+// cd succeeded: the cached directory (and $PWD) follows
+static void prompt_cwd_changed(void) {
+  if (getcwd(prompt_cache.cwd, sizeof(prompt_cache.cwd)) == NULL)
+    strcpy(prompt_cache.cwd, "?");
+  else
+    setenv("PWD", prompt_cache.cwd, 1);
+}
 
-      // apply <, >, >> for this command
-      apply_redirects(cur);
+static void prompt_init(void) {
+  const char *user = getenv("USER");
+  struct passwd *pw = user == NULL ? getpwuid(geteuid()) : NULL;
+  snprintf(prompt_cache.user, sizeof(prompt_cache.user), "%s",
+           user ? user : pw ? pw->pw_name : "?");
+  if (gethostname(prompt_cache.host, sizeof(prompt_cache.host)) != 0)
+    strcpy(prompt_cache.host, "?");
+  prompt_cache.root = geteuid() == 0;
+  prompt_cwd_changed();
+  prompt_cache.init = true;
+}
 
-      // support builtin commands in pipes
-      if (strcmp(cur->name, "cut") == 0) {
-        builtin_cut(cur);
-        exit(0);
-      }
-      if (strcmp(cur->name, "pinfo") == 0) {
-        builtin_pinfo(cur);
-        exit(0);
-      }
-      if (strcmp(cur->name, "chatroom") == 0) {
-        // chatroom is interactive, so we don't allow it in a pipe
-        fprintf(stderr, "-%s: chatroom cannot be used in a pipe\n", sysname);
-        exit(1);
-      }
+static void prompt_compile(const char *ps1) {
+  free(prompt_cache.ps1);
+  free(prompt_cache.segs);
+  prompt_cache.ps1 = strdup(ps1);
+  prompt_cache.segs = malloc(sizeof(struct prompt_seg) * (strlen(ps1) + 1));
+  prompt_cache.nsegs = 0;
+  prompt_cache.uses_git = false;
+
+  static const char escapes[] = "uhHwWs$?jtLg[]";
+  static const enum prompt_seg_type types[] = {
+      SEG_USER, SEG_HOST, SEG_HOST_FULL, SEG_CWD, SEG_CWD_BASE, SEG_SHELL, SEG_DOLLAR,
+      SEG_STATUS, SEG_JOBS, SEG_TIME, SEG_DURATION, SEG_GIT, SEG_HIDE_BEGIN, SEG_HIDE_END,
+  };
+  for (const char *p = prompt_cache.ps1; *p != '\0';) {
+    struct prompt_seg *seg = &prompt_cache.segs[prompt_cache.nsegs++];
+    const char *e = p[0] == '\\' && p[1] != '\0' ? strchr(escapes, p[1]) : NULL;
+    if (e != NULL) {
+      seg->type = types[e - escapes];
+      prompt_cache.uses_git |= seg->type == SEG_GIT;
+      p += 2;
+      continue;
+    }
+    seg->type = SEG_TEXT;
+    if (p[0] == '\\' && (p[1] == 'n' || p[1] == 'e' || p[1] == '\\')) {
+      // static strings, so the segment can point to them
+      seg->text = p[1] == 'n' ? "\n" : p[1] == 'e' ? "\033" : "\\";
+      seg->len = 1;
+      p += 2;
+      continue;
+    }
+    // plain text up to the next escape
+    seg->text = p;
+    seg->len = 1;
+    while (p[seg->len] != '\0' && p[seg->len] != '\\')
+      seg->len++;
+    p += seg->len;
+  }
+}
 
-      // external command: find full path and execv
-      char *full_path = resolve_path(cur->name);
-      if (full_path != NULL) {
-        execv(full_path, cur->args);
-        // execv returns only if there is an error
-        fprintf(stderr, "-%s: %s: %s\n", sysname, cur->name, strerror(errno));
-        free(full_path);
-        exit(126);
-      } else {
-        fprintf(stderr, "-%s: %s: command not found\n", sysname, cur->name);
-        exit(127);
+// branch of the git repository dir is in ("" if none); a detached HEAD
+// shows its commit. dir/.git may also be a file "gitdir: path" (worktrees).
+static void git_branch_of(const char *dir, char *out, size_t size) {
+  char path[PATH_MAX + 16], buf[PATH_MAX + 16];
+  size_t len = strlen(dir);
+  out[0] = '\0';
+  if (len >= PATH_MAX)
+    return;
+  memcpy(path, dir, len + 1);
+  while (1) {
+    snprintf(path + len, sizeof(path) - len, "/.git/HEAD");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      snprintf(path + len, sizeof(path) - len, "/.git");
+      fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd >= 0 && proc_read(fd, buf, sizeof(buf)) > 8 && strncmp(buf, "gitdir: ", 8) == 0) {
+        close(fd);
+        buf[strcspn(buf, "\n")] = '\0';
+        if (buf[8] == '/')
+          snprintf(path, sizeof(path), "%s/HEAD", buf + 8);
+        else
+          snprintf(path + len, sizeof(path) - len, "/%s/HEAD", buf + 8);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+      } else if (fd >= 0) {
+        close(fd);
+        fd = -1;
       }
     }
-
-    // parent error case
-    if (pid < 0) {
-      fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
-      if (prev_read != -1) close(prev_read);
-      if (pipefd[0] != -1) close(pipefd[0]);
-      if (pipefd[1] != -1) close(pipefd[1]);
-      return SUCCESS;
+    if (fd >= 0) {
+      ssize_t n = proc_read(fd, buf, sizeof(buf));
+      close(fd);
+      if (n <= 0)
+        return;
+      buf[strcspn(buf, "\n")] = '\0';
+      if (strncmp(buf, "ref: refs/heads/", 16) == 0)
+        snprintf(out, size, "%.*s", (int)size - 1, buf + 16); // long names are cut
+      else
+        snprintf(out, size, "%.7s", buf);
+      return;
     }
+    // not here: try the parent directory
+    while (len > 0 && path[len - 1] != '/')
+      len--;
+    while (len > 1 && path[len - 1] == '/')
+      len--;
+    if (len <= 1)
+      return;
+    path[len] = '\0';
+  }
+}
 
-    // save pid to wait later
-    if (pid_count < 256) {
-      pids[pid_count++] = pid;
+static void *prompt_git_worker(void *arg) {
+  (void)arg;
+  char dir[PATH_MAX], branch[sizeof(prompt_git.branch)];
+  pthread_mutex_lock(&prompt_git.lock);
+  while (1) {
+    while (prompt_git.want[0] == '\0')
+      pthread_cond_wait(&prompt_git.cond, &prompt_git.lock);
+    strcpy(dir, prompt_git.want);
+    prompt_git.want[0] = '\0';
+    pthread_mutex_unlock(&prompt_git.lock);
+
+    git_branch_of(dir, branch, sizeof(branch));
+
+    pthread_mutex_lock(&prompt_git.lock);
+    bool changed = strcmp(prompt_git.dir, dir) != 0 || strcmp(prompt_git.branch, branch) != 0;
+    strcpy(prompt_git.dir, dir);
+    strcpy(prompt_git.branch, branch);
+    if (changed && write(prompt_wake[1], "", 1) < 0) {
+      // the pipe is full: a redraw is pending anyway
     }
-
-    // parent closes ends that it does not need
-    if (prev_read != -1) close(prev_read);
-    if (pipefd[1] != -1) close(pipefd[1]);
-
-    // next command reads from current pipe read end
-    prev_read = pipefd[0];
-
-    cur = cur->next;
   }
+  return NULL;
+}
 
-  if (prev_read != -1) close(prev_read);
-
-  // if background, do not wait for all children (just cleanup finished ones)
-  if (command->background) {
-    while (waitpid(-1, NULL, WNOHANG) > 0) {}
-    return SUCCESS;
-  } else {
-    // foreground: wait all commands in pipe chain
-    for (int i = 0; i < pid_count; i++) {
-      waitpid(pids[i], NULL, 0);
+// branch known for dir (maybe from before the last command), and ask the
+// worker to look again
+static void prompt_git_branch(const char *dir, char *out, size_t size) {
+  pthread_mutex_lock(&prompt_git.lock);
+  if (!prompt_git.started) {
+    prompt_git.started = true;
+    if (pipe2(prompt_wake, O_CLOEXEC | O_NONBLOCK) == 0) {
+      // the worker gets no signals: SIGCHLD and SIGINT stay with the shell
+      sigset_t all, old;
+      sigfillset(&all);
+      pthread_sigmask(SIG_SETMASK, &all, &old);
+      pthread_t t;
+      if (pthread_create(&t, NULL, prompt_git_worker, NULL) == 0)
+        pthread_detach(t);
+      pthread_sigmask(SIG_SETMASK, &old, NULL);
     }
-    return SUCCESS;
   }
+  snprintf(out, size, "%s", strcmp(prompt_git.dir, dir) == 0 ? prompt_git.branch : "");
+  snprintf(prompt_git.want, sizeof(prompt_git.want), "%s", dir);
+  pthread_cond_signal(&prompt_git.cond);
+  pthread_mutex_unlock(&prompt_git.lock);
 }
 
-int process_command(struct command_t *command) {
-  int r;
+static int prompt_text(char *out, size_t size, int *width) {
+  if (!prompt_cache.init)
+    prompt_init();
+  const char *ps1 = var_get("PS1", 3);
+  if (ps1 == NULL)
+    ps1 = "\\u@\\h:\\w \\s$ "; // the prompt of the skeleton
+  if (prompt_cache.ps1 == NULL || strcmp(ps1, prompt_cache.ps1) != 0)
+    prompt_compile(ps1);
+
+  size_t len = 0;
+  int w = 0;
+  bool hidden = false;
+  char tmp[PATH_MAX];
+  for (int i = 0; i < prompt_cache.nsegs; i++) {
+    const struct prompt_seg *seg = &prompt_cache.segs[i];
+    const char *s = tmp;
+    size_t n = (size_t)-1;
+    switch (seg->type) {
+    case SEG_TEXT:
+      s = seg->text;
+      n = seg->len;
+      break;
+    case SEG_USER:
+      s = prompt_cache.user;
+      break;
+    case SEG_HOST:
+      s = prompt_cache.host;
+      n = strcspn(s, ".");
+      break;
+    case SEG_HOST_FULL:
+      s = prompt_cache.host;
+      break;
+    case SEG_CWD:
+      s = prompt_cache.cwd;
+      break;
+    case SEG_CWD_BASE: {
+      const char *slash = strrchr(prompt_cache.cwd, '/');
+      s = slash != NULL && slash[1] != '\0' ? slash + 1 : prompt_cache.cwd;
+      break;
+    }
+    case SEG_SHELL:
+      s = sysname;
+      break;
+    case SEG_DOLLAR:
+      s = prompt_cache.root ? "#" : "$";
+      break;
+    case SEG_STATUS:
+      snprintf(tmp, sizeof(tmp), "%d", last_status);
+      break;
+    case SEG_JOBS: {
+      int jobs = 0;
+      for (struct job *j = job_list; j != NULL; j = j->next)
+        jobs++;
+      snprintf(tmp, sizeof(tmp), "%d", jobs);
+      break;
+    }
+    case SEG_TIME: {
+      time_t now = time(NULL);
+      struct tm tm;
+      strftime(tmp, sizeof(tmp), "%H:%M:%S", localtime_r(&now, &tm));
+      break;
+    }
+    case SEG_DURATION: {
+      long ms = (long)(prompt_cache.last_wall * 1000);
+      if (ms < 1000)
+        snprintf(tmp, sizeof(tmp), "%ldms", ms);
+      else if (ms < 60000)
+        snprintf(tmp, sizeof(tmp), "%ld.%02lds", ms / 1000, ms % 1000 / 10);
+      else
+        snprintf(tmp, sizeof(tmp), "%ldm%02lds", ms / 60000, ms / 1000 % 60);
+      break;
+    }
+    case SEG_GIT:
+      prompt_git_branch(prompt_cache.cwd, tmp, sizeof(prompt_git.branch));
+      break;
+    case SEG_HIDE_BEGIN:
+    case SEG_HIDE_END:
+      hidden = seg->type == SEG_HIDE_BEGIN;
+      continue;
+    }
+    if (n == (size_t)-1)
+      n = strlen(s);
+    if (n > size - 1 - len)
+      n = size - 1 - len;
+    memcpy(out + len, s, n);
+    if (!hidden) {
+      const char *nl = memrchr(s, '\n', n);
+      if (nl != NULL) // \n: only the last line counts
+        w = text_width(nl + 1, n - (nl + 1 - s));
+      else
+        w += text_width(s, n);
+    }
+    len += n;
+  }
+  out[len] = '\0';
+  if (width != NULL)
+    *width = w;
+  return len;
+}
 
-  if (strcmp(command->name, "") == 0)
-    return SUCCESS;
+// ---- non-interactive mode ----
+//
+// shell-ish -c "cmd", shell-ish script.sh and a non-terminal stdin read
+// commands in big blocks with read(): no termios, no prompt, no echo.
+
+#define SCRIPT_BLOCK_SIZE (64 * 1024)
+
+struct line_reader {
+  int fd;          // -1: only the text already in buf (-c)
+  char *buf;
+  size_t len;      // bytes in buf
+  size_t pos;      // start of the next line
+  size_t cap;
+  bool eof;
+  bool seekable;
+};
 
-  if (strcmp(command->name, "exit") == 0)
-    return EXIT;
+// Returns the next line (NUL terminated, without '\n') or NULL at the end.
+// The line is inside the reader's buffer and valid until the next call.
+static char *line_reader_next(struct line_reader *r) {
+  while (1) {
+    char *start = r->buf + r->pos;
+    char *nl = memchr(start, '\n', r->len - r->pos);
+    if (nl != NULL) {
+      *nl = '\0';
+      r->pos = (size_t)(nl - r->buf) + 1;
+      return start;
+    }
+    if (r->eof || r->fd == -1) {
+      if (r->pos == r->len)
+        return NULL;
+      r->buf[r->len] = '\0'; // last line without '\n'
+      r->pos = r->len;
+      return start;
+    }
 
-  // builtin: cd changes current directory of the shell process
-  if (strcmp(command->name, "cd") == 0) {
-    if (command->arg_count > 0) {
-      r = chdir(command->args[1]);
-      if (r == -1)
-        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-      return SUCCESS;
+    // keep the partial line and read the next block after it
+    memmove(r->buf, start, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+    if (r->len + 1 >= r->cap) {
+      r->cap *= 2;
+      r->buf = realloc(r->buf, r->cap);
     }
+    ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len - 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      r->eof = true;
+    else
+      r->len += (size_t)n;
   }
+}
 
-  // if we have pipe chain, run_pipeline will fork multiple children
-  if (command->next != NULL) {
-    return run_pipeline(command);
+// When commands are read from stdin, the commands we run share it with us.
+// If stdin is seekable, give back what we read ahead, so a command reading
+// stdin starts right after its own line (like other shells do).
+static void line_reader_sync(struct line_reader *r) {
+  if (r->fd != STDIN_FILENO || !r->seekable || r->pos == r->len)
+    return;
+  if (lseek(r->fd, -(off_t)(r->len - r->pos), SEEK_CUR) >= 0) {
+    r->len = r->pos = 0;
+    r->eof = false;
   }
+}
 
-  pid_t pid = fork();
-  if (pid == 0) // child
-  {
-    // in child: apply redirection before running command
-    apply_redirects(command);
+// Run all commands of fd (or of text, for -c) until the input ends or
+// `exit` is run.
+static int run_script(int fd, const char *text) {
+  struct line_reader r;
+  memset(&r, 0, sizeof(r));
+  r.fd = fd;
+  if (text != NULL) {
+    r.buf = strdup(text);
+    r.len = strlen(text);
+    r.cap = r.len + 1;
+  } else {
+    r.cap = SCRIPT_BLOCK_SIZE;
+    r.buf = malloc(r.cap);
+    r.seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+  }
 
-    // builtin commands (Part III)
-    if (strcmp(command->name, "cut") == 0) {
-      builtin_cut(command);
-      exit(0);
-    }
+  char *line, *pending = NULL; // lines of an unfinished if/while/...
+  while ((line = line_reader_next(&r)) != NULL) {
+    // skip empty lines and comments (also the #! line)
+    const char *p = line;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '\0' || *p == '#')
+      continue;
 
-    if (strcmp(command->name, "pinfo") == 0) {
-      builtin_pinfo(command);
-      exit(0);
+    if (pending != NULL) {
+      size_t n = strlen(pending);
+      pending = realloc(pending, n + strlen(line) + 2);
+      pending[n] = '\n';
+      strcpy(pending + n + 1, line);
+      line = pending;
     }
-
-    if (strcmp(command->name, "chatroom") == 0) {
-      builtin_chatroom(command);
-      exit(0);
+    struct node *tree;
+    int parsed = parse_command(line, &tree);
+    if (parsed == PARSE_INCOMPLETE) {
+      if (pending == NULL)
+        pending = strdup(line);
+      free_command(tree);
+      continue;
     }
+    if (parsed != 0)
+      last_status = 2; // syntax error
+    line_reader_sync(&r);
 
-    // external commands: resolve PATH and run with execv (Part I)
-    char *full_path = resolve_path(command->name);
+    // keep the SIGCHLD pipe drained even if only background jobs run
+    jobs_read_events(false);
 
-    if (full_path != NULL) {
-      execv(full_path, command->args);
-      fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
-      free(full_path);
-      exit(126);
-    } else {
-      // resolve_path returned NULL (command not found in PATH)
-      fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
-      exit(127); // 127 is standard for "Command not found"
+    int code = run_tree(tree);
+    free_command(tree);
+    free(pending);
+    pending = NULL;
+    if (code == EXIT)
+      break;
+  }
+  if (pending != NULL) {
+    fprintf(stderr, "-%s: syntax error: unexpected end of input\n", sysname);
+    free(pending);
+    last_status = 2;
+  }
+
+  free(r.buf);
+  return last_status;
+}
+
+int main(int argc, char *argv[]) {
+  // a builtin writing to a closed pipe must not kill the shell
+  signal(SIGPIPE, SIG_IGN);
+  stats_init();
+  shell_pid = getpid();
+
+  // shell-ish -c "command"
+  if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+    if (argc < 3) {
+      fprintf(stderr, "-%s: -c: option requires an argument\n", sysname);
+      return 2;
     }
-  } else {
-    // parent: background means do not wait
-    if (command->background) {
-      // we can reap finished background children with WNOHANG
-      while (waitpid(-1, NULL, WNOHANG) > 0) {}
-      return SUCCESS;
-    } else {
-      // foreground: wait until command finishes
-      waitpid(pid, NULL, 0);
-      return SUCCESS;
+    jobs_init(false);
+    script_args = argv + 3; // shell-ish -c "cmd" name arg1 arg2 ...
+    script_argc = argc - 3;
+    return run_script(-1, argv[2]);
+  }
+
+  // shell-ish script.sh
+  if (argc >= 2) {
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, argv[1], strerror(errno));
+      return 127;
     }
+    jobs_init(false);
+    script_args = argv + 1;
+    script_argc = argc - 1;
+    int r = run_script(fd, NULL);
+    close(fd);
+    return r;
   }
-}
 
-int main() {
+  // commands piped in (cmds.txt | shell-ish) or redirected (shell-ish <cmds.txt)
+  if (!isatty(STDIN_FILENO)) {
+    jobs_init(false);
+    return run_script(STDIN_FILENO, NULL);
+  }
+
+  jobs_init(true);
+  history_init();
+
   while (1) {
-    // allocate and clear new command struct for each input line
-    struct command_t *command =
-        (struct command_t *)malloc(sizeof(struct command_t));
-    memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+    // report background jobs that finished since the last command
+    jobs_notify();
 
+    // NULL for an empty line, a syntax error or an unfinished construct
+    struct node *tree;
     int code;
-    code = prompt(command);
+    code = prompt(&tree);
     if (code == EXIT)
       break;
-
-    code = process_command(command);
+    if (code == UNKNOWN)
+      last_status = 2; // syntax error
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    code = run_tree(tree);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (tree != NULL) // \L in $PS1
+      prompt_cache.last_wall = timespec_diff(start, end);
     if (code == EXIT)
       break;
 
     // free everything we allocated for this command
-    free_command(command);
+    free_command(tree);
   }
 
   printf("\n");
-  return 0;
+  return last_status;
 }